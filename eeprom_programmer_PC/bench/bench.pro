@@ -0,0 +1,19 @@
+include(../common.pri)
+include(../libeepromprog.pri)
+
+CONFIG += console
+
+CONFIG -= app_bundle
+
+TARGET = eeprom-bench
+TEMPLATE = app
+
+# Runs against eeprom-emulator, which needs pseudo-terminals
+!unix: error("eeprom-bench needs a POSIX system")
+
+SOURCES += \
+	bench_main.cpp \
+	bench.cpp
+
+HEADERS += \
+	bench.h
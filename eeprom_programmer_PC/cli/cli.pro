@@ -0,0 +1,39 @@
+include(../common.pri)
+include(../libeepromprog.pri)
+
+CONFIG += console
+
+CONFIG -= app_bundle
+
+TARGET = eeprom-programmer
+TEMPLATE = app
+
+# --daemon takes jobs over a QLocalServer
+QT += network
+
+SOURCES += \
+	app_.cpp \
+	main.cpp \
+	app.cpp \
+	daemon.cpp
+
+HEADERS += \
+	app.h \
+	daemon.h
+
+unix {
+    SOURCES += sigwatch.cpp
+    HEADERS += sigwatch.h
+    CONFIG(release, debug|release): \
+        CONFIG += staticlib
+}
+
+win32 {
+    SOURCES += signalhandler.cpp
+    HEADERS += signalhandler.h
+}
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
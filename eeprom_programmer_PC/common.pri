@@ -0,0 +1,42 @@
+# Settings shared by every target of the PC side
+
+QT += core
+QT += serialport
+
+QT -= gui
+QT -= widgets
+
+# Coroutines (task.h) need C++20, gcc 10 also wants the explicit switch
+CONFIG += c++2a
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+
+# The following define makes your compiler emit warnings if you use
+# any feature of Qt which as been marked deprecated (the exact warnings
+# depend on your compiler). Please consult the documentation of the
+# deprecated API in order to know how to port your code away from it.
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# Disable debug messages for release builds
+# evaluate only when "release" is defined of the two options "debug" and "release"
+CONFIG(release, debug|release): {
+    DEFINES += QT_NO_DEBUG_OUTPUT NDEBUG
+}
+
+# You can also make your code fail to compile if you use deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SRC_DIR = $$PWD/src
+
+VPATH += $$SRC_DIR
+INCLUDEPATH += $$SRC_DIR
+DEPENDPATH += $$SRC_DIR
+
+# Headers shared with the firmware (memory_table.h)
+FIRMWARE_INC_DIR = $$PWD/../eeprom_programmer_STM32/Core/Inc
+INCLUDEPATH += $$FIRMWARE_INC_DIR
+DEPENDPATH += $$FIRMWARE_INC_DIR
+
+# Where libeepromprog gets built, relative to the build tree of every target
+LIBEEPROMPROG_DIR = $$OUT_PWD/../libeepromprog
@@ -0,0 +1,21 @@
+include(../common.pri)
+include(../libeepromprog.pri)
+
+CONFIG += console
+
+CONFIG -= app_bundle
+
+TARGET = eeprom-emulator
+TEMPLATE = app
+
+# pseudo-terminals: POSIX only
+!unix: error("eeprom-emulator needs a POSIX system")
+
+SOURCES += \
+	emulator_main.cpp \
+	deviceemulator.cpp \
+	sigwatch.cpp
+
+HEADERS += \
+	deviceemulator.h \
+	sigwatch.h
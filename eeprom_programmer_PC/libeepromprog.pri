@@ -0,0 +1,10 @@
+# Link a target against libeepromprog
+
+win32:CONFIG(release, debug|release): LIBEEPROMPROG_LIBDIR = $$LIBEEPROMPROG_DIR/release
+else:win32:CONFIG(debug, debug|release): LIBEEPROMPROG_LIBDIR = $$LIBEEPROMPROG_DIR/debug
+else: LIBEEPROMPROG_LIBDIR = $$LIBEEPROMPROG_DIR
+
+LIBS += -L$$LIBEEPROMPROG_LIBDIR -leepromprog
+
+win32-g++|unix: PRE_TARGETDEPS += $$LIBEEPROMPROG_LIBDIR/libeepromprog.a
+else: PRE_TARGETDEPS += $$LIBEEPROMPROG_LIBDIR/eepromprog.lib
@@ -0,0 +1,45 @@
+include(../common.pri)
+
+TARGET = eepromprog
+TEMPLATE = lib
+
+CONFIG += staticlib
+
+SOURCES += \
+	crc16.cpp \
+	eeprom.cpp \
+	jobscheduler.cpp \
+	serialportio.cpp \
+	serialportreader.cpp \
+	serialportwriter.cpp \
+	memorycomm.cpp \
+	packageparser.cpp \
+	packbits.cpp \
+	portdiscovery.cpp \
+	sessionstats.cpp \
+	trace.cpp
+
+HEADERS += \
+	crc16.h \
+	eeprom.h \
+	jobscheduler.h \
+	serialportio.h \
+	serialportreader.h \
+	serialportwriter.h \
+	memorycomm.h \
+	packageparser.h \
+	packbits.h \
+	portdiscovery.h \
+	sessionstats.h \
+	spscqueue.h \
+	task.h \
+	trace.h \
+	xferrequest.h
+
+# --transport termios and uring
+linux {
+    SOURCES += rawserialport.cpp \
+        uringserialport.cpp
+    HEADERS += rawserialport.h \
+        uringserialport.h
+}
@@ -0,0 +1,12 @@
+include(../common.pri)
+include(../libeepromprog.pri)
+
+CONFIG += console
+
+CONFIG -= app_bundle
+
+TARGET = eeprom-microbench
+TEMPLATE = app
+
+SOURCES += \
+	microbench_main.cpp
@@ -21,7 +21,11 @@
 
 
 App::App(int &argc, char **argv, FILE* outStream)
-	: MemoryComm(argc, argv, outStream)
+	: QCoreApplication(argc, argv)
+	, m_standardOutput(outStream)
+	, m_comm(outStream)
+	, m_discovery(outStream)
+	, m_daemon(outStream)
 {
 	bool start = configure();
 	if(!start) {
@@ -30,10 +34,20 @@ App::App(int &argc, char **argv, FILE* outStream)
 		return;
 	}
 
-	if (!m_serialPort.open(QIODevice::ReadWrite)) {
+	if(m_discover) {
+		m_session = discover();
+		return;
+	}
+
+	if(m_runDaemon) {
+		m_session = daemon();
+		return;
+	}
+
+	if (!m_comm.open()) {
 
 		m_standardOutput << QObject::tr("Failed to open port %1: %2")
-						  .arg(m_serialPortOptions.name, m_serialPort.errorString())
+						  .arg(m_comm.getSerialPortOptions().name, m_comm.errorString())
 						 << Qt::endl;
 
 		QTimer::singleShot(0, qApp, SLOT(quit()));
@@ -41,25 +55,22 @@ App::App(int &argc, char **argv, FILE* outStream)
 	}
 
 	m_standardOutput << QObject::tr("Connected to port %1")
-					  .arg(m_serialPortOptions.name)
+					  .arg(m_comm.getSerialPortOptions().name)
 				   << Qt::endl;
 
 	setSignals();
 
-	m_pingTimer.setSingleShot(false);
-	m_pingTimer.start(500);
-
 	// Start communication
-	App::handleXfer(nullptr);
+	m_session = run();
 }
 
 void App::setSignals()
 {
-	connect(&m_pingTimer, &QTimer::timeout,
-					this, &App::pingTimerLoop);
+	connect(&m_comm, &MemoryComm::portError,
+					this, &App::handlePortError);
 
-	connect(&m_serialPortReader, &SerialPortReader::timeout,
-						   this, &App::handleTimeout);
+	connect(this, &QCoreApplication::aboutToQuit,
+			&m_comm, &MemoryComm::close);
 }
 
 void App::setCommandLineOptions(QCommandLineParser& parser)
@@ -77,15 +88,53 @@ void App::setCommandLineOptions(QCommandLineParser& parser)
 							"Read memory content."},
 			{{"w", "write"},
 							"Write memory content."},
+			{"chips",
+							"Write several chips of a fixture at once, given by their address straps (A2..A0), e.g. 0,1,2,3.", "list"},
+			{"channels",
+							"Sockets (I2C buses of the programmer) to use, writes go to all of them at once, e.g. 0,1.", "list"},
+			{"store",
+							"With -w, keep the image on the programmer, which then writes it to a chip each time its START input goes low."},
+			{"erase",
+							"Set the whole memory to FF, written by the programmer."},
+			{"fill",
+							"Set the whole memory to <byte> (hex), written by the programmer.", "byte"},
+			{"blank-check",
+							"Check, on the programmer, that the memory is all <pattern> bytes."},
+			{"pattern",
+							"Byte --blank-check looks for, in hex (FF).", "byte"},
 			{{"f", "file"},
 							"Read from / write to <file>.", "file"},
 			{{"p", "port"},
 							"Connect to serial port <port>.", "port"},
 			{{"b", "baudrate"},
 							"Set the serial port baudrate to <baudrate>.", "baudrate"},
+			{"transport",
+							"Serial port backend: " + SerialPortIo::transportNames().join(", ") + " (qt).", "name"},
+			{{"d", "discover"},
+							"List the programmers connected to this computer."},
+			{"watch",
+							"With --discover, keep running and report programmers as they are plugged in or out."},
+			{"no-compress",
+							"Send write blocks as they are, for firmware without compressed blocks."},
+			{"verify",
+							"After writing, read the memory back and compare (on the programmer for --erase / --fill)."},
+			{"stats",
+							"Print transfer statistics at the end."},
+			{"stats-json",
+							"Write transfer statistics as JSON to <file> (- for stdout).", "file"},
+			{"trace",
+							"Record every package of the session to <file>.", "file"},
+			{"replay",
+							"Don't use a serial port, play back the programmer side of trace <file>.", "file"},
+			{"replay-fast",
+							"With --replay, answer right away instead of at the recorded timing."},
+			{"daemon",
+							"Keep running with the programmers connected, taking jobs from a local socket."},
+			{"socket",
+							"Local socket name for --daemon (" DAEMON_SOCKET_NAME ").", "name"},
 		});
 
-	parser.addPositionalArgument("target", "24LC16 - X24645 - 24LC64 - 24LC256");
+	parser.addPositionalArgument("target", EEPROM::getMemNames().join(" - "));
 }
 
 bool App::configure() {
@@ -103,12 +152,23 @@ bool App::configure() {
 		parser.showHelp(0);
 		return false;
 	}
-	if(args.size() < 1) {
+	if(parser.isSet("discover")) {
+		m_discover = true;
+		m_watch = parser.isSet("watch");
+		return true;
+	}
+	if(parser.isSet("daemon")) {
+		// The target is only the default of jobs that don't name one
+		m_runDaemon = true;
+		if(parser.isSet("socket"))
+			m_socketName = parser.value("socket");
+	}
+	else if(args.size() < 1) {
 		m_standardOutput << "Error: you must select the memory target." << Qt::endl;
 		parser.showHelp(1);
 		return false;
 	}
-	if(!setTargetMem(target)) {
+	if(!target.isEmpty() && !m_comm.setTargetMem(target)) {
 		m_standardOutput << "Error: invalid memory type selected." << Qt::endl;
 		parser.showHelp(1);
 		return false;
@@ -116,33 +176,115 @@ bool App::configure() {
 
 	const QString targetFile = parser.value("file");
 
+	MemoryComm::SerialPortOptions portOptions = m_comm.getSerialPortOptions();
+
 	if(parser.isSet("port")) {
-		m_serialPortOptions.name = parser.value("port");
+		portOptions.name = parser.value("port");
+		m_portSet = true;
 	}
 
 	if(parser.isSet("write")) {
-		setNextOperation(OP_TX);
+		setNextOperation(parser.isSet("store") ? MemoryComm::OP_STORE : MemoryComm::OP_TX);
 		if(!targetFile.isNull())
 			setInputFilename(targetFile);
 	}
 	else if(parser.isSet("read")) {
-		setNextOperation(OP_RX);
+		setNextOperation(MemoryComm::OP_RX);
 		if(!targetFile.isNull())
 			setOutputFilename(targetFile);
 	}
+	else if(parser.isSet("erase") || parser.isSet("fill")) {
+		setNextOperation(MemoryComm::OP_FILL);
+	}
+	else if(parser.isSet("blank-check")) {
+		setNextOperation(MemoryComm::OP_BLANKCHECK);
+	}
+
+	if(parser.isSet("chips")) {
+		for(const QString &chip : parser.value("chips").split(',')) {
+			bool ok = false;
+			const uint strap = chip.trimmed().toUInt(&ok);
+			if(!ok || strap >= CHIPS_MAX) {
+				m_standardOutput << "Error: chips are numbered 0 to " << CHIPS_MAX - 1 << "." << Qt::endl;
+				return false;
+			}
+			m_chips |= quint8(1U << strap);
+		}
+	}
+	if(parser.isSet("channels")) {
+		for(const QString &channel : parser.value("channels").split(',')) {
+			bool ok = false;
+			const uint bus = channel.trimmed().toUInt(&ok);
+			if(!ok || bus >= CHANNELS) {
+				m_standardOutput << "Error: channels are numbered 0 to " << CHANNELS - 1 << "." << Qt::endl;
+				return false;
+			}
+			m_channels |= quint8(1U << bus);
+		}
+		if(m_chips && (m_channels & (m_channels - 1))) {
+			m_standardOutput << "Error: --chips works on one channel only." << Qt::endl;
+			return false;
+		}
+	}
+
+	// --fill and --pattern both give the byte, --erase is FF
+	const QString pattern = parser.isSet("fill") ? parser.value("fill") : parser.value("pattern");
+	if(!pattern.isEmpty() && !parser.isSet("erase")) {
+		bool ok = false;
+		const uint value = pattern.toUInt(&ok, 16);
+		if(!ok || value > 0xFF) {
+			m_standardOutput << "Error: the pattern must be a byte in hex." << Qt::endl;
+			return false;
+		}
+		m_pattern = uint8_t(value);
+	}
 
 	if(parser.isSet("baudrate")) {
-		m_serialPortOptions.baudrate = parser.value("baudrate").toInt();
+		portOptions.baudrate = parser.value("baudrate").toInt();
+	}
+
+	if(parser.isSet("transport")
+			&& !SerialPortIo::findTransport(parser.value("transport"), portOptions.transport)) {
+		m_standardOutput << "Error: unknown transport " << parser.value("transport")
+						 << ". Use one of: " << SerialPortIo::transportNames().join(" - ") << Qt::endl;
+		return false;
+	}
+
+	portOptions.compression = !parser.isSet("no-compress");
+	m_verify = parser.isSet("verify");
+	m_printStats = parser.isSet("stats");
+	m_statsFile = parser.value("stats-json");
+
+	if(parser.isSet("trace")) {
+		if(!m_trace.open(parser.value("trace"))) {
+			m_standardOutput << "Error: could not create trace file: "
+							 << m_trace.errorString() << Qt::endl;
+			return false;
+		}
+		m_comm.setTraceRecorder(&m_trace);
+	}
+
+	if(parser.isSet("replay")) {
+		if(!m_replay.load(parser.value("replay"))) {
+			m_standardOutput << "Error: could not load trace "
+							 << m_replay.errorString() << Qt::endl;
+			return false;
+		}
+		m_replay.setTiming(parser.isSet("replay-fast") ? TraceReplayDevice::FAST_TIMING
+													   : TraceReplayDevice::ORIGINAL_TIMING);
+		m_comm.setDevice(&m_replay);
+		m_replaying = true;
 	}
 
-	qDebug() << "Serial port:   " << m_serialPortOptions.name;
-	qDebug() << "Baudrate:      " << m_serialPortOptions.baudrate;
+	qDebug() << "Serial port:   " << portOptions.name;
+	qDebug() << "Baudrate:      " << portOptions.baudrate;
 	qDebug() << "Target file:   " << targetFile;
 	qDebug() << "Input  file:   " << getInputFilename();
 	qDebug() << "Output file:   " << getOutputFilename();
 	qDebug() << "Target device: " << target;
 
-	setSerialPortOptions(m_serialPortOptions);
+	m_comm.setSerialPortOptions(portOptions);
+	m_discovery.setSerialPortOptions(portOptions);
 
 	return true;
 }
@@ -151,6 +293,22 @@ App::~App() {
 
 }
 
+#ifdef _WIN32
+bool App::handleSignal(int signal)
+{
+	qDebug() << "Handling signal " << signal;
+	if(signal & DEFAULT_SIGNALS) {
+		QTimer::singleShot(0, qApp, SLOT(quit()));
+		// The thread is going to stop soon, so don't propagate this signal further
+		return true;
+	}
+	else {
+		// Let the signal propagate as though we had not been there
+		return false;
+	}
+}
+#endif
+
 
 const QString &App::getOutputFilename() const
 {
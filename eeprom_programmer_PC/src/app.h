@@ -1,23 +1,43 @@
 #ifndef APP_H
 #define APP_H
 
+#include "daemon.h"
 #include "memorycomm.h"
+#include "portdiscovery.h"
+#include "task.h"
 
+#include <QCoreApplication>
 #include <QByteArray>
 #include <QStringList>
 #include <QTextStream>
 #include <QTimer>
 #include <QCommandLineParser>
 #include <QFile>
+#include <QJsonDocument>
+
+#ifdef _WIN32
+#include "signalhandler.h"
+#endif
 
 #define APP_VERSION_STRING "2.0.0"
 
-class App: public MemoryComm
+/*
+ * Command line front end: parses the options and drives a single
+ * programmer session until the requested operation is done.
+ */
+class App
+		: public QCoreApplication
+#ifdef _WIN32
+		, public SignalHandler
+#endif
 {
 
 public:
 	App(int &argc, char **argv, FILE* outStream = stdout);
 	~App();
+	bool handleSignal(int signal);
+
+	typedef MemoryComm::operations_e operations_e;
 
 	void setOutputFilename(const QString &newFilename_out);
 	void setInputFilename(const QString &newFilename_in);
@@ -26,50 +46,63 @@ public:
 	const QString &getInputFilename() const;
 	const QString &getOutputFilename() const;
 
-	enum app_states_e {
-		ST_DISCONNECTED,
-		ST_INIT,
-		ST_IDLE,
-		ST_MEMID,
-		ST_WAIT_PING,
-		ST_WAIT_READMEM,
-		ST_WAIT_WRITEMEM
-	};
-
-
 private slots:
-	void handleTimeout(void);
-	void pingTimerLoop(void);
+	void handlePortError(void);
 
 private:
-	void handleXfer(pkgdata_t *pkg);
+	// The whole session, from the handshake to the end of the operation
+	Task<> run(void);
+	Task<bool> connectDevice(void);
+	Task<bool> readMem(void);
+	Task<bool> writeMem(void);
+	Task<bool> verifyMem(void);
+	Task<bool> blankCheck(void);
+	Task<bool> fillMem(void);
+	Task<bool> storeImage(void);
+	Task<bool> reportChips(void);
+	Task<bool> pingLoop(void);
+	Task<> discover(void);
+	Task<> daemon(void);
+	void printProgrammers(const QList<ProgrammerInfo> &table);
 
 	void setCommandLineOptions(QCommandLineParser& parser);
-	void printError(pkgdata_t *pkg);
+	void printError(errorcode_e err);
+	bool isLinkError(errorcode_e err);
 	bool configure(void);
 
 	void printData(void);
-	virtual bool saveData(void);
-	virtual void reconnect();
-
-	bool writeMem(void);
+	bool saveData(void);
+	bool loadData(void);
+	void printStats(void);
+
+	QTextStream m_standardOutput;
+	TraceRecorder m_trace;
+	TraceReplayDevice m_replay;
+	bool m_replaying = false;
+	MemoryComm m_comm;
+	PortDiscovery m_discovery;
+	ProgrammerDaemon m_daemon;
 
 	QByteArray m_memBuffer;
-	QTimer m_pingTimer;
-
-	app_states_e  m_xferState = ST_DISCONNECTED;
-	bool m_connected = false;
-	// Use two variables so we can change one without affecting
-	// the other (new requests will go to m_nextOperation).
-	operations_e m_currentOperation = OP_NONE;
-	operations_e m_nextOperation    = OP_NONE;
+	Task<> m_session;
+
+	operations_e m_nextOperation = MemoryComm::OP_NONE;
+	bool m_discover = false;
+	bool m_verify = false;
+	bool m_verifyFailed = false;	/* also a chip that isn't blank */
+	uint8_t m_pattern = 0xFF;	/* of --blank-check and --fill */
+	quint8 m_chips = 0;			/* --chips, bit n for the strap n */
+	quint8 m_channels = 0;		/* --channels, bit n for the I2C bus n */
+	bool m_printStats = false;
+	QString m_statsFile;		/* JSON statistics, "-" for stdout */
+	bool m_watch = false;
+	bool m_runDaemon = false;
+	bool m_portSet = false;
+	QString m_socketName = DAEMON_SOCKET_NAME;
 
 	QString m_filename_in  = "mem_in.bin";
 	QString m_filename_out = "mem_out.bin";
 	void setSignals();
-	bool doSomething();
-	void retryConnection();
-	void retryOperation(operations_e);
 };
 
 // m_ = member
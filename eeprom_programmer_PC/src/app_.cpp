@@ -20,240 +20,356 @@
 #include "app.h"
 
 
-void App::reconnect()
-{
-	qDebug() << "App::reconnect()";
-	m_xferState = ST_DISCONNECTED;
-	m_connected = false;
-	handleXfer(nullptr);
-}
-
-void App::handleTimeout(void) {
-	m_standardOutput << "uC connection timed out." << Qt::endl;
-	reconnect();
-}
-
-void App::pingTimerLoop(void) {
-	if(m_currentOperation == OP_NONE && m_nextOperation == OP_NONE) {
-		setNextOperation(OP_PING);
-	}
-	handleXfer(nullptr);
+void App::handlePortError(void) {
+	QCoreApplication::exit(1);
 }
 
-void App::printError(pkgdata_t *pkg)
+void App::printError(errorcode_e err)
 {
-	if(!pkg || pkg->cmd != CMD_ERR)
-		m_standardOutput << "Unknown error from uC" << Qt::endl;
-	else {
-		char c_err = pkg->data[0];
-		errorcode_e err = static_cast<errorcode_e>(c_err);
+	if(err == ERROR_TIMEOUT)
+		m_standardOutput << "uC connection timed out." << Qt::endl;
+	else
 		m_standardOutput << "uC ERROR " << EEPROM::getErrorMsg(err) << Qt::endl;
-	}
 }
 
-bool App::doSomething()
+// Errors after which the uC has dropped the session
+bool App::isLinkError(errorcode_e err)
 {
-	// We only process the new request
-	// if there's nothing being done.
-	if(m_currentOperation != OP_NONE)
-		return false;
+	return err == ERROR_UNKNOWN || err == ERROR_MAX_RETRY
+		|| err == ERROR_TIMEOUT || err == ERROR_COMM;
+}
 
-	m_xferState = ST_IDLE;
-
-	switch(m_nextOperation)
-	{
-	case OP_RX:
-		m_xferState = ST_WAIT_READMEM;
-		m_currentOperation = OP_RX;
-		readMem();
-		break;
-
-	case OP_TX:
-		m_xferState = ST_WAIT_WRITEMEM;
-		m_currentOperation = OP_TX;
-		if(!App::writeMem()) {
-			m_currentOperation = OP_NONE;
-			m_xferState = ST_IDLE;
-			QCoreApplication::exit(1);
+Task<> App::run()
+{
+	int ret = 0;
+	bool done = false;
+
+	while(!done) {
+		m_comm.stats().beginPhase(SessionStats::PHASE_HANDSHAKE);
+		const bool connected = co_await connectDevice();
+		m_comm.stats().endPhase(SessionStats::PHASE_HANDSHAKE);
+		if(!connected) {
+			ret = 1;
+			break;
 		}
-		break;
-
-	case OP_PING:
-	case OP_NONE:
-		m_xferState = ST_WAIT_PING;
-		m_currentOperation = OP_PING;
-		sendCommand_ping();
-	//	m_pingTimer.start();
-		break;
-
-	default:
-		m_standardOutput << "Invalid operation." << Qt::endl;
-		m_currentOperation = OP_NONE;
-		break;
-	}
 
-	// clean "Next" flag
-	m_nextOperation = OP_NONE;
+		switch(m_nextOperation)
+		{
+		case MemoryComm::OP_RX:
+			done = co_await readMem();
+			break;
 
-	// return true if we're gonna do something
-	return m_currentOperation != OP_NONE;
-}
+		case MemoryComm::OP_TX:
+			if(!loadData()) {
+				ret = 1;
+				done = true;
+				break;
+			}
+			done = co_await writeMem();
+			break;
 
-void App::retryConnection()
-{
-	clearBuffers();
-	m_xferState = ST_DISCONNECTED;
-	m_connected = false;
-//	QTimer::singleShot(1000, this, &App::reconnect);
-}
+		case MemoryComm::OP_STORE:
+			if(!loadData()) {
+				ret = 1;
+				done = true;
+				break;
+			}
+			done = co_await storeImage();
+			break;
 
-void App::retryOperation(operations_e op)
-{
-	m_currentOperation = OP_NONE;
-	setNextOperation(op);
-	doSomething();
-}
+		case MemoryComm::OP_BLANKCHECK:
+			done = co_await blankCheck();
+			break;
 
-void App::handleXfer(pkgdata_t *pkg) {
-	// TODO: improve handle of error packages?
+		case MemoryComm::OP_FILL:
+			done = co_await fillMem();
+			break;
 
-	static bool busy = false;
-	if(busy) // make sure no stupid shit happen
-		return;
-	busy = true;
+		default:
+			// Nothing to do, keep the link alive until we're told to quit
+			done = co_await pingLoop();
+			break;
+		}
+		// not done: the link went down, start over
+		if(!done)
+			m_comm.stats().countRetry();
+	}
 
-	switch(m_xferState)
-	{
-	case ST_DISCONNECTED: // trying to connect
-		m_connected = false;
-		sendCommand(CMD_INIT);
-		m_xferState = ST_INIT;
-		break;
+	if(m_verifyFailed)
+		ret = 1;
+	printStats();
 
-	case ST_INIT: // Waiting for INIT response
+	if(m_replaying && m_replay.mismatches() > 0) {
+		m_standardOutput << "Replay: " << m_replay.mismatches()
+						 << " packages didn't match the trace." << Qt::endl;
+		ret = 1;
+	}
 
-		if(!pkg)
-			break;
+	QTimer::singleShot(50, qApp, [ret]() { QCoreApplication::exit(ret); });
+}
+
+// true once the uC accepted the target memory
+Task<bool> App::connectDevice()
+{
+	for(;;) {
+		XferResult result = co_await m_comm.connectDevice();
 
-		if(pkg->cmd == CMD_INIT) {
+		if(result.ok()) {
 			m_standardOutput << "Connected to uC." << Qt::endl;
-			m_connected = true;
-			m_xferState = ST_MEMID;
-			sendCommand_memid();
+			co_return true;
 		}
-		else {
-			m_standardOutput << "Could not connect to uC" << Qt::endl;
-			retryConnection();
+		if(result.error == ERROR_MEMID) {
+			printError(result.error);
+			co_return false;
 		}
-		break;
 
-	case ST_MEMID:
-		if(!pkg)
-			break;
+		if(result.error == ERROR_TIMEOUT)
+			printError(result.error);
+		else
+			m_standardOutput << "Could not connect to uC" << Qt::endl;
+		m_comm.clearBuffers();
+		co_await delay(500);
+	}
+}
 
-		if(pkg->cmd == CMD_OK) {
-			m_xferState = ST_IDLE;
-			m_currentOperation = OP_NONE;
-			doSomething();
+// Each one returns true when finished, false if the link needs a reconnect
+Task<bool> App::readMem()
+{
+	for(;;) {
+		m_comm.stats().beginPhase(SessionStats::PHASE_TRANSFER);
+		XferResult result = co_await m_comm.readAll();
+		m_comm.stats().endPhase(SessionStats::PHASE_TRANSFER);
+
+		if(result.ok()) {
+			m_memBuffer = result.data;
+			printData();
+			saveData();
+			co_return true;
 		}
-		else {
-			printError(pkg);
-			QCoreApplication::exit(1);
+		printError(result.error);
+		if(isLinkError(result.error))
+			co_return false;
+		m_comm.stats().countRetry();
+	}
+}
+
+Task<bool> App::writeMem()
+{
+	for(;;) {
+		// After each connect the programmer is back to a single
+		// socket and a single chip
+		if(m_channels) {
+			const XferResult channels = co_await m_comm.selectChannels(m_channels);
+			if(!channels.ok()) {
+				printError(channels.error);
+				co_return !isLinkError(channels.error);
+			}
+		}
+		if(m_chips) {
+			const XferResult targets = co_await m_comm.selectTargets(m_chips);
+			if(!targets.ok()) {
+				printError(targets.error);
+				co_return !isLinkError(targets.error);
+			}
 		}
-		break;
 
-	case ST_IDLE:
-		doSomething();
-		break;
+		m_comm.stats().beginPhase(SessionStats::PHASE_TRANSFER);
+		XferResult result = co_await m_comm.write(m_memBuffer);
+		m_comm.stats().endPhase(SessionStats::PHASE_TRANSFER);
+
+		if(result.ok()) {
+			m_standardOutput << "Memory write SUCCESSFULLY ("
+							 << m_memBuffer.size() << " bytes, " << result.wireBytes
+							 << " on the wire)" << Qt::endl;
+			if(m_chips && !co_await reportChips())
+				co_return false;
+			co_return !m_verify || co_await verifyMem();
+		}
+		printError(result.error);
+		if(isLinkError(result.error))
+			co_return false;
+		m_comm.stats().countRetry();
+	}
+}
 
-	case ST_WAIT_PING: // waiting for ping answer
+// How each chip of --chips did, false if the link needs a reconnect
+Task<bool> App::reportChips()
+{
+	const XferResult result = co_await m_comm.chipStatus();
+	if(!result.ok()) {
+		printError(result.error);
+		co_return !isLinkError(result.error);
+	}
 
-		if(!pkg)
-			break;
+	const QByteArray &status = result.data;
+	for(int chip = 0; chip < CHIPS_MAX && chip + 1 < status.size(); ++chip) {
+		if(!(quint8(status[0]) & (1U << chip)))
+			continue;
+		const errorcode_e err = errorcode_e(status[chip + 1]);
+		m_standardOutput << "Chip " << chip << ": "
+						 << (err == ERROR_NONE ? QString("OK") : EEPROM::getErrorMsg(err)) << Qt::endl;
+		if(err != ERROR_NONE)
+			m_verifyFailed = true;
+	}
+	co_return true;
+}
 
-		if(pkg->cmd == CMD_TXRX_ACK) {
-			m_standardOutput << "Ping." << Qt::endl;
-			m_currentOperation = OP_NONE;
-			m_xferState = ST_IDLE;
-		}
-		else {
-			m_standardOutput << "Connection error" << Qt::endl;
-			retryConnection();
+// Read the memory back and compare it with what we wrote
+Task<bool> App::verifyMem()
+{
+	for(;;) {
+		m_comm.stats().beginPhase(SessionStats::PHASE_VERIFY);
+		XferResult result = co_await m_comm.readAll();
+		m_comm.stats().endPhase(SessionStats::PHASE_VERIFY);
+
+		if(result.ok()) {
+			qsizetype i = 0;
+			while(i < m_memBuffer.size() && i < result.data.size() && m_memBuffer[i] == result.data[i])
+				++i;
+			if(i == m_memBuffer.size() && i == result.data.size()) {
+				m_standardOutput << "Memory verified." << Qt::endl;
+			}
+			else {
+				m_standardOutput << QString("Verify FAILED at 0x%1").arg(i, 0, 16) << Qt::endl;
+				m_verifyFailed = true;
+			}
+			co_return true;
 		}
-		break;
-
-	case ST_WAIT_READMEM: // requested read eeprom - waiting memory data
+		printError(result.error);
+		if(isLinkError(result.error))
+			co_return false;
+		m_comm.stats().countRetry();
+	}
+}
 
-		if(!pkg)
-			break;
+// The uC compares, only the outcome crosses the link
+Task<bool> App::blankCheck()
+{
+	for(;;) {
+		m_comm.stats().beginPhase(SessionStats::PHASE_VERIFY);
+		XferResult result = co_await m_comm.blankCheck(m_pattern);
+		m_comm.stats().endPhase(SessionStats::PHASE_VERIFY);
+
+		if(result.ok()) {
+			if(result.mismatchAt < 0) {
+				m_standardOutput << "Memory is blank." << Qt::endl;
+			}
+			else {
+				m_standardOutput << QString("Memory NOT blank at 0x%1").arg(result.mismatchAt, 0, 16) << Qt::endl;
+				m_verifyFailed = true;
+			}
+			co_return true;
+		}
+		printError(result.error);
+		if(isLinkError(result.error))
+			co_return false;
+		m_comm.stats().countRetry();
+	}
+}
 
-		if(pkg->cmd == CMD_MEMDATA) {
-			// finished receiving memory data
-			m_memBuffer = pkg->data;
-			printData();
-			saveData();
-			m_xferState = ST_IDLE;
-			m_currentOperation = OP_NONE;
-			QTimer::singleShot(50, qApp, SLOT(quit()));
+// Erase / fill: the uC writes the pages, only the request goes over USB
+Task<bool> App::fillMem()
+{
+	for(;;) {
+		m_comm.stats().beginPhase(SessionStats::PHASE_TRANSFER);
+		XferResult result = co_await m_comm.fill(0, quint32(m_comm.getMemSize()), m_pattern, m_verify);
+		m_comm.stats().endPhase(SessionStats::PHASE_TRANSFER);
+
+		if(result.ok()) {
+			m_standardOutput << "Memory filled with " << QString::number(m_pattern, 16).toUpper().rightJustified(2, '0')
+							 << (m_verify ? " and verified." : ".") << Qt::endl;
+			co_return true;
 		}
-		else {
-			printError(pkg);
-			retryOperation(OP_RX);
+		if(result.mismatchAt >= 0) {
+			m_standardOutput << QString("Verify FAILED at 0x%1").arg(result.mismatchAt, 0, 16) << Qt::endl;
+			m_verifyFailed = true;
+			co_return true;
 		}
-		break;
-
-	case ST_WAIT_WRITEMEM: // requested eeprom full write - waiting confirmation
+		printError(result.error);
+		if(isLinkError(result.error))
+			co_return false;
+		m_comm.stats().countRetry();
+	}
+}
 
-		if(!pkg)
-			break;
+// Upload the image for standalone runs, less the blank blocks at its end
+Task<bool> App::storeImage()
+{
+	QByteArray image = m_memBuffer;
+	while(image.size() > PKG_DATA_MAX && image.right(PKG_DATA_MAX).count(char(0xFF)) == PKG_DATA_MAX)
+		image.chop(PKG_DATA_MAX);
+	if(image.size() > STORE_CAPACITY) {
+		m_standardOutput << "Error: the image doesn't fit in the programmer (" << image.size()
+						 << " bytes without the blank end, " << STORE_CAPACITY << " at most)." << Qt::endl;
+		m_verifyFailed = true;
+		co_return true;
+	}
 
-		if(pkg->cmd == CMD_TXRX_DONE) {
-			m_standardOutput << "Memory write SUCCESSFULLY" << Qt::endl;
-			m_xferState = ST_IDLE;
-			m_currentOperation = OP_NONE;
-			QTimer::singleShot(50, qApp, SLOT(quit()));
+	for(;;) {
+		// The image is written to the sockets selected when storing it
+		if(m_channels) {
+			const XferResult channels = co_await m_comm.selectChannels(m_channels);
+			if(!channels.ok()) {
+				printError(channels.error);
+				co_return !isLinkError(channels.error);
+			}
 		}
-		else {
-			printError(pkg);
-			retryOperation(OP_TX);
+
+		m_comm.stats().beginPhase(SessionStats::PHASE_TRANSFER);
+		XferResult result = co_await m_comm.store(image);
+		m_comm.stats().endPhase(SessionStats::PHASE_TRANSFER);
+
+		if(result.ok()) {
+			m_standardOutput << "Image stored on the programmer (" << image.size() << " bytes, "
+							 << result.wireBytes << " on the wire), press START to write a chip." << Qt::endl;
+			co_return true;
 		}
-		break;
+		printError(result.error);
+		if(isLinkError(result.error))
+			co_return false;
+		m_comm.stats().countRetry();
+	}
+}
 
-	default:
-		while(1); // catch the bug :-)
+void App::printStats()
+{
+	if(m_printStats)
+		m_standardOutput << m_comm.stats().toText();
+
+	if(m_statsFile.isEmpty())
+		return;
+
+	const QByteArray json = QJsonDocument(m_comm.stats().toJson()).toJson();
+	if(m_statsFile == "-") {
+		m_standardOutput << json;
+		return;
+	}
+	QFile file(m_statsFile);
+	if(!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+		m_standardOutput << "Could not write statistics to \"" << m_statsFile
+						 << "\"." << Qt::endl;
 	}
-	busy = false;
 }
-// TODO: split into simple methods
 
-void App::printData() {
+Task<bool> App::pingLoop()
+{
+	for(;;) {
+		co_await delay(500);
+		XferResult result = co_await m_comm.ping();
 
-//	m_standardOutput << m_readData.toHex() << Qt::endl;
-	int i;
-	char buf[128];
-//	QByteArray buff[128];
-//	QByteArray::Iterator it = buff->begin();
-	uint8_t *page = (uint8_t*)(m_memBuffer.data());
-
-	for(int reg=0; reg < m_memsize; reg += 32)
-	{
-		char *p = buf;
-		sprintf(p, "%04X: ", reg );
-		p+=6;
-		for(i=0; i<16; ++i) {
-			sprintf(p+3*i, "%02X ", int(page[reg+i]) );
+		if(result.ok()) {
+			m_standardOutput << "Ping." << Qt::endl;
 		}
-		m_standardOutput << buf << Qt::endl;
-
-		p=buf;
-		sprintf(p, "%04X: ", reg+16 );
-		p+=6;
-		for(i=0; i<16; ++i) {
-			sprintf(p+3*i, "%02X ", int(page[16+reg+i]) );
+		else {
+			m_standardOutput << "Connection error" << Qt::endl;
+			m_comm.clearBuffers();
+			co_return false;
 		}
-		m_standardOutput << buf << Qt::endl;
 	}
-	// No time for doing better
+}
+
+void App::printData() {
+	m_standardOutput << EEPROM::hexDump(m_memBuffer) << Qt::flush;
 }
 
 bool App::saveData() {
@@ -273,7 +389,7 @@ bool App::saveData() {
 	return true;
 }
 
-bool App::writeMem() {
+bool App::loadData() {
 
 	QFile file((m_filename_in));
 
@@ -283,16 +399,111 @@ bool App::writeMem() {
 		return false;
 	}
 
-	if(file.size() != m_memsize) {
+	const qint64 memsize = m_comm.getMemSize();
+
+	if(file.size() != memsize) {
 		m_standardOutput << "File size don't match." << Qt::endl;
 		return false;
 	}
 
 	m_memBuffer.clear();
-	m_memBuffer.resize(m_memsize);
+	m_memBuffer.resize(memsize);
 	m_memBuffer = file.readAll();
 	file.close();
 
-	return MemoryComm::writeMem(m_memBuffer);
+	return true;
 }
 
+
+Task<> App::discover()
+{
+	const QList<ProgrammerInfo> table = co_await m_discovery.probeAll();
+	printProgrammers(table);
+
+	if(!m_watch) {
+		bool found = false;
+		for(const ProgrammerInfo &programmer : table)
+			found |= programmer.ready();
+		QTimer::singleShot(50, qApp, [found]() { QCoreApplication::exit(found ? 0 : 1); });
+		co_return;
+	}
+
+	connect(&m_discovery, &PortDiscovery::programmerAttached,
+			this, [this](MemoryComm *session) {
+		m_standardOutput << "Programmer attached on "
+						 << session->getSerialPortOptions().name << Qt::endl;
+	});
+	connect(&m_discovery, &PortDiscovery::programmerDetached,
+			this, [this](const QString &portName) {
+		m_standardOutput << "Programmer detached from " << portName << Qt::endl;
+	});
+	m_discovery.startWatching();
+}
+
+// Serve jobs until we're told to quit
+Task<> App::daemon()
+{
+	if(!m_daemon.listen(m_socketName)) {
+		m_standardOutput << "Error: could not listen on " << m_socketName << ": "
+						 << m_daemon.errorString() << Qt::endl;
+		QTimer::singleShot(0, qApp, []() { QCoreApplication::exit(1); });
+		co_return;
+	}
+	m_standardOutput << "Waiting for jobs on " << m_daemon.serverName() << Qt::endl;
+	m_daemon.setDefaultMemory(m_comm.getMemType());
+
+	// The given port, or every programmer plugged now or later
+	if(m_portSet) {
+		if(!m_comm.open()) {
+			m_standardOutput << QObject::tr("Failed to open port %1: %2")
+								.arg(m_comm.getSerialPortOptions().name, m_comm.errorString())
+							 << Qt::endl;
+			QTimer::singleShot(0, qApp, []() { QCoreApplication::exit(1); });
+			co_return;
+		}
+		connect(this, &QCoreApplication::aboutToQuit,
+				&m_comm, &MemoryComm::close);
+		m_daemon.addSession(&m_comm);
+		co_return;
+	}
+
+	const memtype_e memtype = m_comm.getMemType();
+	connect(&m_discovery, &PortDiscovery::programmerAttached,
+			this, [this, memtype](MemoryComm *session) {
+		if(memtype != MEMTYPE_NONE)
+			session->setTargetMem(memtype);
+		m_daemon.addSession(session);
+	});
+	connect(&m_discovery, &PortDiscovery::programmerDetached,
+			&m_daemon, &ProgrammerDaemon::removeSession);
+
+	printProgrammers(co_await m_discovery.probeAll());
+	m_discovery.startWatching();
+}
+
+void App::printProgrammers(const QList<ProgrammerInfo> &table)
+{
+	if(table.isEmpty()) {
+		m_standardOutput << "No programmers found." << Qt::endl;
+		return;
+	}
+
+	m_standardOutput << QString("%1 %2 %3").arg("PORT", -14).arg("SERIAL", -26).arg("STATUS")
+					 << Qt::endl;
+
+	for(const ProgrammerInfo &programmer : table) {
+		QString status;
+		if(programmer.ready())
+			status = QString("ready (%1 ms)").arg(programmer.handshakeMs);
+		else if(!programmer.errorString.isEmpty())
+			status = programmer.errorString;
+		else
+			status = EEPROM::getErrorMsg(programmer.error);
+
+		m_standardOutput << QString("%1 %2 %3")
+							.arg(programmer.portName, -14)
+							.arg(programmer.serialNumber, -26)
+							.arg(status)
+						 << Qt::endl;
+	}
+}
@@ -0,0 +1,410 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "bench.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QJsonDocument>
+#include <QQueue>
+#include <QRandomGenerator>
+
+#include <sys/resource.h>
+#include <utility>
+
+#define EMULATOR_START_MS 5000
+#define DIFF_STRIDE 64		/* diff: one byte in DIFF_STRIDE differs */
+#define SPARSE_TABLE 32		/* sparse: random bytes at the start of each KiB */
+
+
+static qint64 cpuUs(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return qint64(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+			+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// KiB on Linux
+static qint64 peakRss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+QString Bench::Case::key() const
+{
+	// Keys of the default transport are the ones older results have
+	QString key = QString("%1/%2/p%3/w%4/l%5")
+			.arg(EEPROM::memoryTable[chip].name, op)
+			.arg(payload).arg(window).arg(latencyUs);
+	if(transport != "qt")
+		key += "/" + transport;
+	if(image != "random")
+		key += "/" + image;
+	return key;
+}
+
+
+Bench::Bench(const BenchOptions &op, QObject *parent)
+	: QObject(parent)
+	, m_options(op)
+	, m_log(stderr)
+	, m_comm(stderr)
+{
+	m_emulator.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+}
+
+Bench::~Bench()
+{
+	stopEmulator();
+}
+
+bool Bench::startEmulator(int latencyUs)
+{
+	// A real programmer: the port as given, at the latency it has
+	if(!m_options.port.isEmpty()) {
+		MemoryComm::SerialPortOptions port;
+		port.name = m_options.port;
+		m_comm.setSerialPortOptions(port);
+		return true;
+	}
+
+	QStringList args;
+	args << "--bandwidth" << QString::number(m_options.bandwidth)
+		 << "--latency" << QString::number(latencyUs);
+	if(m_options.twcMs >= 0)
+		args << "--twc" << QString::number(m_options.twcMs);
+
+	m_emulator.start(m_options.emulator, args);
+	if(!m_emulator.waitForStarted(EMULATOR_START_MS)) {
+		m_log << "Error: could not start " << m_options.emulator << ": "
+			  << m_emulator.errorString() << Qt::endl;
+		return false;
+	}
+
+	// It tells which pty it got on its first line
+	const QString banner = "Emulating a programmer on ";
+	QElapsedTimer timer;
+	timer.start();
+	while(!m_emulator.canReadLine()) {
+		const int left = EMULATOR_START_MS - int(timer.elapsed());
+		if(left <= 0 || !m_emulator.waitForReadyRead(left)) {
+			m_log << "Error: no answer from " << m_options.emulator << Qt::endl;
+			stopEmulator();
+			return false;
+		}
+	}
+	const QString line = QString::fromLocal8Bit(m_emulator.readLine()).trimmed();
+	if(!line.startsWith(banner)) {
+		m_log << "Error: unexpected output from the emulator: " << line << Qt::endl;
+		stopEmulator();
+		return false;
+	}
+
+	MemoryComm::SerialPortOptions port;
+	port.name = line.mid(banner.size());
+	m_comm.setSerialPortOptions(port);
+	return true;
+}
+
+void Bench::stopEmulator()
+{
+	m_comm.close();
+	if(m_emulator.state() == QProcess::NotRunning)
+		return;
+	m_emulator.terminate();
+	if(!m_emulator.waitForFinished(1000))
+		m_emulator.kill();
+}
+
+// ping and loopback only: no chip needed in the socket
+bool Bench::linkOnly() const
+{
+	for(const QString &op : m_options.ops) {
+		if(op != "ping" && op != "loopback")
+			return false;
+	}
+	return true;
+}
+
+// Takes effect on the next open
+void Bench::setTransport(const QString &transport)
+{
+	MemoryComm::SerialPortOptions port = m_comm.getSerialPortOptions();
+	SerialPortIo::findTransport(transport, port.transport);
+	m_comm.setSerialPortOptions(port);
+}
+
+// Fresh session with chip selected, holding a known image
+Task<bool> Bench::connectChip(memtype_e chip, const QString &image)
+{
+	m_comm.close();
+	m_comm.setTargetMem(chip);
+	if(!m_comm.open()) {
+		m_log << "Error: failed to open " << m_comm.getSerialPortOptions().name << ": "
+			  << m_comm.errorString() << Qt::endl;
+		co_return false;
+	}
+
+	XferResult result = co_await (linkOnly() ? m_comm.probe() : m_comm.connectDevice());
+	if(!result.ok()) {
+		m_log << "Error: connect: " << EEPROM::getErrorMsg(result.error) << Qt::endl;
+		co_return false;
+	}
+
+	const int total = int(qMin<qint64>(m_options.bytes, EEPROM::getMemSize(chip)));
+	QRandomGenerator random(quint32(chip) + 1);
+	m_image.resize(total);
+	for(int i = 0; i < total; ++i)
+		m_image[i] = char(random.generate());
+	// Mostly erased, like most real images: compressed blocks both ways
+	if(image == "sparse") {
+		for(int i = 0; i < total; ++i) {
+			if(i % 1024 >= SPARSE_TABLE)
+				m_image[i] = char(0xFF);
+		}
+	}
+
+	if(linkOnly())
+		co_return true;
+	result = co_await m_comm.write(m_image);
+	if(!result.ok()) {
+		m_log << "Error: initial write: " << EEPROM::getErrorMsg(result.error) << Qt::endl;
+		co_return false;
+	}
+	co_return true;
+}
+
+/*
+ * Moves m_image through the chip in payload sized jobs, keeping up to
+ * window of them queued on the session. Job time runs from queueing
+ * the job to its completion, so it includes the wait behind the others.
+ */
+Task<QJsonObject> Bench::runCase(Case c)
+{
+	const int total = m_image.size();
+	const int payload = qMin(c.payload, total);
+	const int jobs = total / payload;
+	const bool write = c.op == "write";
+	const bool ping = c.op == "ping";
+	const bool loopback = c.op == "loopback";
+	// The echoes have to be what was sent
+	const bool compare = c.op == "verify" || c.op == "diff" || loopback;
+
+	QByteArray reference = m_image;
+	if(c.op == "diff") {
+		for(int i = 0; i < reference.size(); i += DIFF_STRIDE)
+			reference[i] = char(~reference[i]);
+	}
+
+	LatencyHistogram jobUs;
+	int errors = 0;
+	qint64 mismatched = 0;
+	qint64 diffRuns = 0;
+
+	QElapsedTimer clock;
+	const qint64 cpuStart = cpuUs();
+	clock.start();
+
+	QQueue<XferRequest> inflight;
+	int submitted = 0;
+	while(submitted < jobs || !inflight.isEmpty()) {
+		while(submitted < jobs && inflight.size() < c.window) {
+			const quint32 offset = quint32(submitted * payload);
+			XferRequest request = ping ? m_comm.ping()
+					: loopback ? m_comm.loopback(m_image.mid(int(offset), payload))
+					: write ? m_comm.write(m_image.mid(int(offset), payload), offset)
+					: m_comm.readRange(offset, quint32(payload));
+
+			const qint64 queuedNs = clock.nsecsElapsed();
+			request.onFinished([&, offset, queuedNs](const XferResult &result) {
+				jobUs.record((clock.nsecsElapsed() - queuedNs) / 1000);
+				if(!result.ok()) {
+					++errors;
+					return;
+				}
+				if(!compare)
+					return;
+
+				const char *expected = reference.constData() + offset;
+				bool inRun = false;
+				for(int i = 0; i < result.data.size(); ++i) {
+					const bool differs = result.data[i] != expected[i];
+					if(differs) {
+						++mismatched;
+						if(!inRun)
+							++diffRuns;
+					}
+					inRun = differs;
+				}
+			});
+			inflight.enqueue(request);
+			++submitted;
+		}
+		co_await inflight.dequeue();
+	}
+
+	const qint64 elapsedNs = clock.nsecsElapsed();
+	const qint64 cpu = cpuUs() - cpuStart;
+
+	// verify must find nothing, diff exactly what was planted
+	const qint64 expectedDiff = c.op == "diff" ? (total + DIFF_STRIDE - 1) / DIFF_STRIDE : 0;
+	if(compare && errors == 0 && mismatched != expectedDiff)
+		++errors;
+
+	QJsonObject json;
+	json["key"] = c.key();
+	json["chip"] = EEPROM::memoryTable[c.chip].name;
+	json["op"] = c.op;
+	json["payload"] = payload;
+	json["window"] = c.window;
+	json["latency_us"] = c.latencyUs;
+	json["transport"] = c.transport;
+	json["image"] = c.image;
+	json["bytes"] = ping ? 0 : total;
+	json["jobs"] = jobs;
+	json["errors"] = errors;
+	json["seconds"] = double(elapsedNs) / 1e9;
+	json["kib_s"] = elapsedNs && !ping ? double(total) / 1024.0 * 1e9 / double(elapsedNs) : 0.0;
+	json["job_p50_us"] = jobUs.percentile(50);
+	json["job_p99_us"] = jobUs.percentile(99);
+	if(ping && c.window == 1) {
+		json["rtt_p50_us"] = jobUs.percentile(50);
+		json["rtt_p99_us"] = jobUs.percentile(99);
+	}
+	json["cpu_ms"] = double(cpu) / 1000.0;
+	json["peak_rss_kib"] = peakRss();
+	if(c.op == "diff")
+		json["diff_runs"] = diffRuns;
+	co_return json;
+}
+
+// Cases that lost more than threshold % of their baseline throughput
+QJsonArray Bench::compareBaseline(const QJsonArray &cases)
+{
+	QJsonArray regressions;
+	if(m_options.baseline.isEmpty())
+		return regressions;
+
+	QFile file(m_options.baseline);
+	if(!file.open(QIODevice::ReadOnly)) {
+		m_log << "Error: could not open baseline " << m_options.baseline << Qt::endl;
+		return regressions;
+	}
+	const QJsonArray baseCases = QJsonDocument::fromJson(file.readAll()).object()["cases"].toArray();
+
+	QHash<QString, double> base;
+	for(const QJsonValue &v : baseCases)
+		base.insert(v.toObject()["key"].toString(), v.toObject()["kib_s"].toDouble());
+
+	for(const QJsonValue &v : cases) {
+		const QJsonObject c = v.toObject();
+		const QString key = c["key"].toString();
+		if(!base.contains(key) || base[key] <= 0)
+			continue;
+
+		const double change = (c["kib_s"].toDouble() / base[key] - 1.0) * 100.0;
+		if(change < -m_options.threshold) {
+			QJsonObject r;
+			r["key"] = key;
+			r["baseline_kib_s"] = base[key];
+			r["kib_s"] = c["kib_s"];
+			r["change_pct"] = change;
+			regressions.append(r);
+			m_log << QString("REGRESSION %1: %2 -> %3 KiB/s (%4%)")
+					 .arg(key).arg(base[key], 0, 'f', 1)
+					 .arg(c["kib_s"].toDouble(), 0, 'f', 1).arg(change, 0, 'f', 1)
+				  << Qt::endl;
+		}
+	}
+	return regressions;
+}
+
+Task<int> Bench::run()
+{
+	QJsonArray cases;
+	int failed = 0;
+
+	const QList<int> latencies = m_options.port.isEmpty() ? m_options.latencies : QList<int>{-1};
+	for(int latency : latencies) {
+		if(!startEmulator(latency))
+			co_return 1;
+
+		for(const QString &transport : std::as_const(m_options.transports)) {
+			setTransport(transport);
+
+			for(memtype_e chip : std::as_const(m_options.chips)) {
+				for(const QString &image : std::as_const(m_options.images)) {
+					if(!co_await connectChip(chip, image)) {
+						++failed;
+						continue;
+					}
+
+					for(int payload : std::as_const(m_options.payloads)) {
+						for(int window : std::as_const(m_options.windows)) {
+							for(const QString &op : std::as_const(m_options.ops)) {
+								const Case c{chip, op, payload, window, latency, transport, image};
+								const QJsonObject result = co_await runCase(c);
+								cases.append(result);
+
+								m_log << QString("%1 %2 KiB/s  p50 %3 us  p99 %4 us%5")
+										 .arg(c.key(), -28)
+										 .arg(result["kib_s"].toDouble(), 9, 'f', 1)
+										 .arg(result["job_p50_us"].toInt(), 8)
+										 .arg(result["job_p99_us"].toInt(), 8)
+										 .arg(result["errors"].toInt() ? "  ERRORS" : "")
+									  << Qt::endl;
+
+								// Start over from a known state
+								if(result["errors"].toInt()) {
+									++failed;
+									co_await connectChip(chip, image);
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+		stopEmulator();
+	}
+
+	QJsonObject link;
+	link["bandwidth"] = m_options.bandwidth;
+	link["twc_ms"] = m_options.twcMs;
+
+	const QJsonArray regressions = compareBaseline(cases);
+
+	m_results = QJsonObject();
+	m_results["version"] = 1;
+	m_results["link"] = link;
+	m_results["cases"] = cases;
+	if(!m_options.baseline.isEmpty()) {
+		m_results["baseline"] = m_options.baseline;
+		m_results["threshold_pct"] = m_options.threshold;
+		m_results["regressions"] = regressions;
+	}
+
+	if(failed)
+		co_return 1;
+	co_return regressions.isEmpty() ? 0 : 2;
+}
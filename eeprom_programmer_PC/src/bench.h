@@ -0,0 +1,83 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "memorycomm.h"
+#include "sessionstats.h"
+#include "task.h"
+
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QList>
+#include <QObject>
+#include <QProcess>
+#include <QTextStream>
+
+/* What to sweep, and how hard */
+struct BenchOptions {
+	QString emulator;				/* eeprom-emulator executable */
+	QString port;					/* a real programmer instead, one pass at latency -1 */
+	QList<memtype_e> chips;
+	QStringList ops = {"write", "read", "verify", "diff"};	/* and ping, loopback */
+	QStringList transports = {"qt"};
+	QStringList images = {"random"};	/* or sparse: blank with a small table per KiB */
+	QList<int> payloads = {256, 1024, 4096};	/* bytes per job */
+	QList<int> windows = {1, 4};				/* jobs queued at once */
+	QList<int> latencies = {0, 500, 2000};		/* us, per device answer */
+	int bytes = 8192;				/* per case, at most the chip size */
+	double bandwidth = 1e6;
+	int twcMs = -1;					/* -1: the one of the chip */
+	QString baseline;
+	double threshold = 5.0;			/* % of throughput lost to be a regression */
+};
+
+/*
+ * End-to-end throughput benchmark: runs read, write, verify and diff
+ * jobs for every chip against eeprom-emulator, for every combination of
+ * job size, queue depth, link latency and serial port transport, and
+ * reports the results as JSON. Each latency gets its own emulator
+ * process. ping jobs are one package each way: with a window of 1 their
+ * job time is the per-package round trip of the transport, loopback jobs
+ * move their payload to the programmer and back with no chip involved.
+ */
+class Bench : public QObject
+{
+	Q_OBJECT
+public:
+	explicit Bench(const BenchOptions &op, QObject *parent = nullptr);
+	~Bench();
+
+	// Resolves to the exit code: 0 ok, 1 errors, 2 regressions
+	Task<int> run(void);
+
+	const QJsonObject &results(void) const {return m_results;};
+
+private:
+	struct Case {
+		memtype_e chip;
+		QString op;
+		int payload;
+		int window;
+		int latencyUs;
+		QString transport;
+		QString image;
+
+		QString key(void) const;
+	};
+
+	bool startEmulator(int latencyUs);
+	bool linkOnly(void) const;
+	void stopEmulator(void);
+	void setTransport(const QString &transport);
+	Task<bool> connectChip(memtype_e chip, const QString &image);
+	Task<QJsonObject> runCase(Case c);
+	QJsonArray compareBaseline(const QJsonArray &cases);
+
+	BenchOptions m_options;
+	QTextStream m_log;
+	QProcess m_emulator;
+	MemoryComm m_comm;
+	QByteArray m_image;			/* what the last write put in the chip */
+	QJsonObject m_results;
+};
+
+#endif // BENCH_H
@@ -0,0 +1,223 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "bench.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QStandardPaths>
+
+#include <utility>
+
+// Next to us, where the build tree puts it, or in PATH
+static QString findEmulator(void)
+{
+	const QString dir = QCoreApplication::applicationDirPath();
+	const QStringList candidates = {
+		dir + "/eeprom-emulator",
+		dir + "/../emulator/eeprom-emulator"
+	};
+	for(const QString &path : candidates) {
+		if(QFileInfo(path).isExecutable())
+			return path;
+	}
+	return QStandardPaths::findExecutable("eeprom-emulator");
+}
+
+static bool parseIntList(const QString &value, QList<int> &list)
+{
+	list.clear();
+	for(const QString &item : value.split(',', Qt::SkipEmptyParts)) {
+		bool ok;
+		list.append(item.toInt(&ok));
+		if(!ok || list.last() < 0)
+			return false;
+	}
+	return !list.isEmpty();
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("EEPROM Programmer benchmark");
+	QCoreApplication::setApplicationVersion("1.0.0");
+
+	QTextStream err(stderr);
+	BenchOptions op;
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Throughput of the programmer protocol against eeprom-emulator, or a real programmer.");
+	parser.addHelpOption();
+	parser.addVersionOption();
+	parser.addOptions({
+			{"emulator",
+							"eeprom-emulator executable to use.", "path"},
+			{"port",
+							"Run against the programmer on <device> instead, latencies don't apply.", "device"},
+			{"chips",
+							"Comma separated memory types (all of them).", "list"},
+			{"ops",
+							"Comma separated jobs to run (write,read,verify,diff), or ping, loopback.", "list"},
+			{"transports",
+							"Comma separated serial port backends to compare ("
+							+ SerialPortIo::transportNames().join(",") + "), qt by default.", "list"},
+			{"images",
+							"Comma separated chip contents (random,sparse), random by default.", "list"},
+			{"payloads",
+							"Comma separated job sizes in bytes, multiple of 256 (256,1024,4096).", "list"},
+			{"windows",
+							"Comma separated number of jobs kept queued (1,4).", "list"},
+			{"latencies",
+							"Comma separated device answer latencies in us (0,500,2000).", "list"},
+			{"bytes",
+							"Bytes moved per case, at most the chip size (8192).", "n"},
+			{"bandwidth",
+							"Emulated link speed in bytes per second (1000000).", "bytes"},
+			{"twc",
+							"Page write cycle in ms, instead of the one of each chip.", "ms"},
+			{"baseline",
+							"Earlier results to compare the throughput against.", "file"},
+			{"threshold",
+							"Throughput loss in % that counts as a regression (5).", "pct"},
+			{{"o", "output"},
+							"Write the JSON results to <file> instead of stdout.", "file"},
+		});
+	parser.process(app);
+
+	op.port = parser.value("port");
+	op.emulator = parser.isSet("emulator") ? parser.value("emulator") : findEmulator();
+	if(op.port.isEmpty() && op.emulator.isEmpty()) {
+		err << "Error: eeprom-emulator not found, use --emulator" << Qt::endl;
+		return 1;
+	}
+
+	if(parser.isSet("chips")) {
+		for(const QString &name : parser.value("chips").split(',', Qt::SkipEmptyParts)) {
+			const MemoryInfo *mem = EEPROM::findMemInfo(name);
+			if(!mem || mem->type == MEMTYPE_NONE) {
+				err << "Error: unknown memory type " << name << ". Use one of: "
+					<< EEPROM::getMemNames().join(" - ") << Qt::endl;
+				return 1;
+			}
+			op.chips.append(mem->type);
+		}
+	}
+	else {
+		for(const MemoryInfo &mem : EEPROM::memoryTable) {
+			if(mem.type != MEMTYPE_NONE)
+				op.chips.append(mem.type);
+		}
+	}
+
+	if(parser.isSet("ops")) {
+		op.ops = parser.value("ops").split(',', Qt::SkipEmptyParts);
+		for(const QString &name : std::as_const(op.ops)) {
+			if(name != "write" && name != "read" && name != "verify" && name != "diff"
+					&& name != "ping" && name != "loopback") {
+				err << "Error: unknown job " << name << Qt::endl;
+				return 1;
+			}
+		}
+	}
+
+	if(parser.isSet("transports")) {
+		op.transports = parser.value("transports").split(',', Qt::SkipEmptyParts);
+		for(const QString &name : std::as_const(op.transports)) {
+			transport_e transport = TRANSPORT_QT;
+			if(!SerialPortIo::findTransport(name, transport)) {
+				err << "Error: unknown transport " << name << ". Use one of: "
+					<< SerialPortIo::transportNames().join(" - ") << Qt::endl;
+				return 1;
+			}
+		}
+	}
+
+	if(parser.isSet("images")) {
+		op.images = parser.value("images").split(',', Qt::SkipEmptyParts);
+		for(const QString &name : std::as_const(op.images)) {
+			if(name != "random" && name != "sparse") {
+				err << "Error: unknown image " << name << Qt::endl;
+				return 1;
+			}
+		}
+	}
+
+	if((parser.isSet("payloads") && !parseIntList(parser.value("payloads"), op.payloads))
+			|| (parser.isSet("windows") && !parseIntList(parser.value("windows"), op.windows))
+			|| (parser.isSet("latencies") && !parseIntList(parser.value("latencies"), op.latencies))) {
+		err << "Error: bad number list" << Qt::endl;
+		return 1;
+	}
+	for(int payload : std::as_const(op.payloads)) {
+		// Writes move whole blocks only
+		if(payload == 0 || payload % PKG_DATA_MAX) {
+			err << "Error: payloads must be multiple of " << PKG_DATA_MAX << Qt::endl;
+			return 1;
+		}
+	}
+	if(op.windows.contains(0)) {
+		err << "Error: windows must be at least 1" << Qt::endl;
+		return 1;
+	}
+
+	if(parser.isSet("bytes"))
+		op.bytes = parser.value("bytes").toInt();
+	if(op.bytes < PKG_DATA_MAX || op.bytes % PKG_DATA_MAX) {
+		err << "Error: bytes must be multiple of " << PKG_DATA_MAX << Qt::endl;
+		return 1;
+	}
+	if(parser.isSet("bandwidth"))
+		op.bandwidth = parser.value("bandwidth").toDouble();
+	if(parser.isSet("twc"))
+		op.twcMs = parser.value("twc").toInt();
+	op.baseline = parser.value("baseline");
+	if(parser.isSet("threshold"))
+		op.threshold = parser.value("threshold").toDouble();
+
+	Bench bench(op);
+	Task<int> session;
+	const QString output = parser.value("output");
+
+	QTimer::singleShot(0, &app, [&]() {
+		session = [](Bench &bench, QString output) -> Task<int> {
+			const int ret = co_await bench.run();
+
+			const QByteArray json = QJsonDocument(bench.results()).toJson();
+			if(output.isEmpty()) {
+				QTextStream(stdout) << json;
+			}
+			else {
+				QFile file(output);
+				if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+						|| file.write(json) != json.size()) {
+					QTextStream(stderr) << "Error: could not write " << output << Qt::endl;
+					QCoreApplication::exit(1);
+					co_return 1;
+				}
+			}
+			QCoreApplication::exit(ret);
+			co_return ret;
+		}(bench, output);
+	});
+
+	return app.exec();
+}
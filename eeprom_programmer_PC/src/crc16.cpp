@@ -1,10 +1,28 @@
 #include "crc16.h"
 
+#include <array>
+
+/* CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF, no reflection */
+#define CRC16_POLY 0x1021
+#define CRC16_INIT 0xFFFF
+
+static constexpr std::array<uint16_t, 256> crcTable = [] {
+	std::array<uint16_t, 256> table{};
+	for(int i = 0; i < 256; ++i) {
+		uint16_t crc = uint16_t(i << 8);
+		for(int bit = 0; bit < 8; ++bit)
+			crc = uint16_t(crc & 0x8000 ? (crc << 1) ^ CRC16_POLY : crc << 1);
+		table[size_t(i)] = crc;
+	}
+	return table;
+}();
+
 CRC16::CRC16()
 {
 
 }
 
+// Packages carry a zero CRC until the firmware checks it
 uint16_t CRC16::gen(uint8_t data)
 {
 	return 0;
@@ -15,6 +33,19 @@ uint16_t CRC16::gen(uint8_t data1, const QByteArray& data2)
 	return 0;
 }
 
+uint16_t CRC16::gen(const QByteArray& data)
+{
+	return gen(reinterpret_cast<const uint8_t*>(data.constData()), uint32_t(data.size()));
+}
+
+uint16_t CRC16::gen(const uint8_t *data, uint32_t len)
+{
+	uint16_t crc = CRC16_INIT;
+	while(len--)
+		crc = uint16_t((crc << 8) ^ crcTable[size_t((crc >> 8) ^ *data++)]);
+	return crc;
+}
+
 QByteArray CRC16::wordToByteArray(uint16_t data)
 {
 	char tmp[2] = {char(data >> 8), char(data & 0xFF)};
@@ -33,6 +64,16 @@ QByteArray CRC16::genByteArray(uint8_t data1, const QByteArray& data2)
 	return wordToByteArray(crc);
 }
 
+QByteArray CRC16::genByteArray(const QByteArray& data)
+{
+	return wordToByteArray(gen(data));
+}
+
+QByteArray CRC16::genByteArray(const uint8_t *data, uint32_t len)
+{
+	return wordToByteArray(gen(data, len));
+}
+
 uint16_t CRC16::arrayToWord(const QByteArray& array)
 {
 	uint16_t word = (array[0] << 8) | array[1];
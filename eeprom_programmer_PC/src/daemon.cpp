@@ -0,0 +1,285 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "daemon.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+
+/* The uC drops the link after TIMEOUT_MS (5 s) without packages */
+#define KEEPALIVE_MS 2000
+
+
+ProgrammerDaemon::ProgrammerDaemon(FILE* outStream, QObject *parent)
+	: QObject(parent)
+	, m_standardOutput(outStream)
+	, m_server(this)
+	, m_scheduler(this)
+{
+	connect(&m_server, &QLocalServer::newConnection,
+					this, &ProgrammerDaemon::handleNewConnection);
+}
+
+ProgrammerDaemon::~ProgrammerDaemon()
+{
+	m_server.close();
+}
+
+bool ProgrammerDaemon::listen(const QString &name)
+{
+	// Left behind by a daemon that didn't exit cleanly
+	QLocalServer::removeServer(name);
+	if(!m_server.listen(name))
+		return false;
+
+	m_scheduler.setKeepAlive(KEEPALIVE_MS);
+	return true;
+}
+
+void ProgrammerDaemon::addSession(MemoryComm *session)
+{
+	m_scheduler.addSession(session);
+	m_standardOutput << "Programmer on " << session->getSerialPortOptions().name
+					 << " ready for jobs." << Qt::endl;
+}
+
+void ProgrammerDaemon::removeSession(const QString &portName)
+{
+	if(!m_scheduler.hasSession(portName))
+		return;
+	m_scheduler.removeSession(portName);
+	m_standardOutput << "Programmer on " << portName << " gone." << Qt::endl;
+}
+
+void ProgrammerDaemon::handleNewConnection()
+{
+	while(QLocalSocket *client = m_server.nextPendingConnection()) {
+		qDebug() << "Daemon: client connected";
+		connect(client, &QLocalSocket::readyRead, this, [this, client]() {
+			while(client->canReadLine())
+				handleLine(client, client->readLine());
+		});
+		connect(client, &QLocalSocket::disconnected,
+						client, &QObject::deleteLater);
+	}
+}
+
+void ProgrammerDaemon::handleLine(QLocalSocket *client, const QByteArray &line)
+{
+	if(line.trimmed().isEmpty())
+		return;
+
+	QJsonParseError error;
+	const QJsonDocument doc = QJsonDocument::fromJson(line, &error);
+	if(!doc.isObject()) {
+		QJsonObject answer;
+		answer["ok"] = false;
+		answer["error"] = QString("bad request: %1").arg(error.errorString());
+		reply(client, answer);
+		return;
+	}
+
+	// Runs until its first co_await right here, so jobs reach the
+	// sessions in the order they arrived. The task frees itself.
+	runJob(QPointer<QLocalSocket>(client), doc.object());
+}
+
+// Same file as last time, unless it changed on disk
+bool ProgrammerDaemon::loadImage(const QString &fileName, QByteArray &data, QString &error)
+{
+	const QFileInfo info(fileName);
+	const QDateTime modified = info.lastModified();
+
+	auto it = m_images.constFind(fileName);
+	if(it != m_images.constEnd() && it->modified == modified) {
+		data = it->data;
+		return true;
+	}
+
+	QFile file(fileName);
+	if(!file.open(QIODevice::ReadOnly)) {
+		error = QString("could not open %1: %2").arg(fileName, file.errorString());
+		return false;
+	}
+	data = file.readAll();
+	m_images.insert(fileName, Image{modified, data});
+	return true;
+}
+
+Task<> ProgrammerDaemon::runJob(QPointer<QLocalSocket> client, QJsonObject request)
+{
+	QElapsedTimer elapsed;
+	elapsed.start();
+
+	QJsonObject answer;
+	answer["id"] = request["id"];
+	answer["ok"] = false;
+
+	const QString op = request["op"].toString();
+	if(op == "status") {
+		const QJsonObject table = status();
+		for(auto it = table.begin(); it != table.end(); ++it)
+			answer[it.key()] = it.value();
+		answer["ok"] = true;
+		reply(client, answer);
+		co_return;
+	}
+	if(op != "read" && op != "write" && op != "verify" && op != "ping" && op != "blankcheck"
+			&& op != "fill") {
+		answer["error"] = QString("unknown op \"%1\"").arg(op);
+		reply(client, answer);
+		co_return;
+	}
+
+	const QString port = request["port"].toString();
+	if(!port.isEmpty() && !m_scheduler.hasSession(port)) {
+		answer["error"] = QString("no programmer on %1").arg(port);
+		reply(client, answer);
+		co_return;
+	}
+	if(m_scheduler.sessionCount() == 0) {
+		answer["error"] = "no programmer available";
+		reply(client, answer);
+		co_return;
+	}
+
+	memtype_e memtype = m_defaultMemtype;
+	if(request.contains("memtype")) {
+		const MemoryInfo *mem = EEPROM::findMemInfo(request["memtype"].toString());
+		memtype = mem ? mem->type : MEMTYPE_NONE;
+	}
+	if(memtype == MEMTYPE_NONE) {
+		answer["error"] = QString("memtype must be one of: %1").arg(EEPROM::getMemNames().join(" "));
+		reply(client, answer);
+		co_return;
+	}
+
+	QByteArray image;
+	if(op == "write" || op == "verify") {
+		QString error;
+		if(!loadImage(request["image"].toString(), image, error)) {
+			answer["error"] = error;
+			reply(client, answer);
+			co_return;
+		}
+	}
+
+	const qint64 memsize = EEPROM::getMemSize(memtype);
+	const qint64 offset = qint64(request["offset"].toDouble(0));
+	const qint64 length = op == "read" || op == "fill" ? qint64(request["length"].toDouble(double(memsize - offset)))
+									   : image.size();
+	if(op != "ping" && op != "blankcheck" && (offset < 0 || length <= 0 || offset + length > memsize)) {
+		answer["error"] = "range outside the memory";
+		reply(client, answer);
+		co_return;
+	}
+
+	// verify is a read, compared here
+	SchedulerJob job;
+	job.memtype = memtype;
+	job.offset = quint32(offset);
+	job.length = quint32(length);
+	job.port = port;
+	if(op == "ping") {
+		job.operation = MemoryComm::OP_PING;
+	}
+	else if(op == "write") {
+		job.operation = MemoryComm::OP_TX;
+		job.data = image;
+	}
+	else if(op == "blankcheck") {
+		job.operation = MemoryComm::OP_BLANKCHECK;
+		job.fill = uint8_t(request["pattern"].toInt(0xFF));
+	}
+	else if(op == "fill") {
+		job.operation = MemoryComm::OP_FILL;
+		job.fill = uint8_t(request["pattern"].toInt(0xFF));
+		job.verify = request["verify"].toBool(false);
+	}
+
+	const XferResult result = co_await m_scheduler.submit(job);
+	const errorcode_e err = result.error;
+	if(!result.port.isEmpty())
+		answer["port"] = result.port;
+
+	if(err != ERROR_NONE) {
+		answer["error"] = EEPROM::getErrorMsg(err);
+		if(result.mismatchAt >= 0)
+			answer["mismatch_at"] = result.mismatchAt;
+	}
+	else if(op == "read") {
+		const QString output = request["output"].toString();
+		if(output.isEmpty()) {
+			answer["data"] = QString::fromLatin1(result.data.toHex());
+			answer["ok"] = true;
+		}
+		else {
+			QFile file(output);
+			if(file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+					&& file.write(result.data) == result.data.size())
+				answer["ok"] = true;
+			else
+				answer["error"] = QString("could not write %1").arg(output);
+		}
+	}
+	else if(op == "verify") {
+		qsizetype i = 0;
+		while(i < image.size() && i < result.data.size() && image[i] == result.data[i])
+			++i;
+		answer["ok"] = i == image.size();
+		if(i != image.size()) {
+			answer["error"] = "verify failed";
+			answer["mismatch_at"] = offset + i;
+		}
+	}
+	else if(op == "blankcheck") {
+		answer["ok"] = true;
+		answer["blank"] = result.mismatchAt < 0;
+		if(result.mismatchAt >= 0)
+			answer["mismatch_at"] = result.mismatchAt;
+	}
+	else {
+		answer["ok"] = true;
+	}
+
+	++m_jobsDone;
+	answer["ms"] = elapsed.elapsed();
+	answer["wire_bytes"] = result.wireBytes;
+	reply(client, answer);
+}
+
+QJsonObject ProgrammerDaemon::status() const
+{
+	QJsonObject json;
+	json["programmers"] = m_scheduler.utilization();
+	json["pending"] = m_scheduler.pendingJobs();
+	json["jobs_done"] = m_jobsDone;
+	return json;
+}
+
+void ProgrammerDaemon::reply(QLocalSocket *client, const QJsonObject &answer)
+{
+	// Gone while its job was running
+	if(!client)
+		return;
+	client->write(QJsonDocument(answer).toJson(QJsonDocument::Compact));
+	client->write("\n");
+}
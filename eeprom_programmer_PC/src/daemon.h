@@ -0,0 +1,79 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "jobscheduler.h"
+#include "memorycomm.h"
+#include "task.h"
+
+#include <QDateTime>
+#include <QHash>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QObject>
+#include <QPointer>
+#include <QTextStream>
+
+#define DAEMON_SOCKET_NAME "eeprom-programmer"
+
+/*
+ * Keeps programmer sessions connected and runs jobs for clients of a
+ * local socket, so each job costs its own transfer and nothing else:
+ * no process start, port open, handshake or image load.
+ *
+ * Clients send one JSON object per line and get one back per job, in
+ * completion order, matched by "id":
+ *
+ *     {"id": 1, "op": "write", "memtype": "24LC16", "image": "/tmp/a.bin"}
+ *     {"id": 1, "ok": true, "port": "ttyACM0", "ms": 412}
+ *
+ * op is read, write, verify, blankcheck, fill, ping or status. read
+ * takes "offset" and "length" (the whole chip by default) and writes to
+ * "output", or answers with the content in "data" as hex. write and
+ * verify take "image" and "offset". blankcheck takes "pattern" (255)
+ * and answers "blank" and "mismatch_at". fill takes "offset", "length",
+ * "pattern" and "verify". "port" picks a programmer, otherwise the
+ * JobScheduler gives the job to whichever gets free first. Any number of
+ * jobs can be sent without waiting for the answers.
+ */
+class ProgrammerDaemon : public QObject
+{
+	Q_OBJECT
+public:
+	explicit ProgrammerDaemon(FILE* outStream = stdout, QObject *parent = nullptr);
+	~ProgrammerDaemon();
+
+	bool listen(const QString &name);
+	QString errorString(void) const {return m_server.errorString();};
+	QString serverName(void) const {return m_server.fullServerName();};
+
+	// Open session to run jobs on, not owned
+	void addSession(MemoryComm *session);
+	void removeSession(const QString &portName);
+	// For jobs that don't name their memory
+	void setDefaultMemory(memtype_e type) {m_defaultMemtype = type;};
+
+private slots:
+	void handleNewConnection(void);
+
+private:
+	struct Image {
+		QDateTime modified;
+		QByteArray data;
+	};
+
+	void handleLine(QLocalSocket *client, const QByteArray &line);
+	Task<> runJob(QPointer<QLocalSocket> client, QJsonObject request);
+	QJsonObject status(void) const;
+	bool loadImage(const QString &fileName, QByteArray &data, QString &error);
+	void reply(QLocalSocket *client, const QJsonObject &answer);
+
+	QTextStream m_standardOutput;
+	QLocalServer m_server;
+	JobScheduler m_scheduler;
+	memtype_e m_defaultMemtype = MEMTYPE_NONE;
+	QHash<QString, Image> m_images;		/* by file name */
+	qint64 m_jobsDone = 0;
+};
+
+#endif // DAEMON_H
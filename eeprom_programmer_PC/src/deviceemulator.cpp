@@ -0,0 +1,522 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "deviceemulator.h"
+#include "packbits.h"
+#include "serialportwriter.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QtAlgorithms>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* Same as the firmware, see main.h */
+#define EMU_TIMEOUT_MS 5000
+#define EMU_RETRIES_MAX 10
+#define EMU_I2C_HZ 400000
+/* STM32F103 flash: 1 KiB pages, ~20 ms to erase one, ~50 us per word */
+#define FLASH_PAGE 1024
+#define FLASH_ERASE_US 20000
+#define FLASH_BLOCK_US (PKG_DATA_MAX / 4 * 50)
+
+
+DeviceEmulator::DeviceEmulator(QObject *parent)
+	: QObject(parent)
+	, m_outTimer(this)
+	, m_timeout(this)
+{
+	m_outTimer.setSingleShot(true);
+	m_outTimer.setTimerType(Qt::PreciseTimer);
+	connect(&m_outTimer, &QTimer::timeout,
+					this, &DeviceEmulator::flushOutput);
+
+	m_timeout.setSingleShot(true);
+	m_timeout.setInterval(EMU_TIMEOUT_MS);
+	connect(&m_timeout, &QTimer::timeout,
+					this, &DeviceEmulator::handleTimeout);
+
+	m_random.seed(m_link.seed);
+	m_clock.start();
+}
+
+DeviceEmulator::~DeviceEmulator()
+{
+	if(m_slave != -1)
+		::close(m_slave);
+	if(m_master != -1)
+		::close(m_master);
+}
+
+bool DeviceEmulator::open()
+{
+	m_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(m_master == -1 || grantpt(m_master) != 0 || unlockpt(m_master) != 0) {
+		m_errorString = QString("can't create a pseudo-terminal: %1").arg(strerror(errno));
+		return false;
+	}
+	m_portName = QString::fromLocal8Bit(ptsname(m_master));
+
+	m_slave = ::open(ptsname(m_master), O_RDWR | O_NOCTTY);
+	if(m_slave == -1) {
+		m_errorString = QString("can't open %1: %2").arg(m_portName, strerror(errno));
+		return false;
+	}
+
+	// Bytes in, bytes out: no echo, no line editing
+	struct termios tio;
+	tcgetattr(m_slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(m_slave, TCSANOW, &tio);
+
+	fcntl(m_master, F_SETFL, fcntl(m_master, F_GETFL) | O_NONBLOCK);
+
+	m_notifier = new QSocketNotifier(m_master, QSocketNotifier::Read, this);
+	connect(m_notifier, &QSocketNotifier::activated,
+					this, &DeviceEmulator::handleReadable);
+	return true;
+}
+
+void DeviceEmulator::setLinkOptions(const LinkOptions& op)
+{
+	m_link = op;
+	m_random.seed(op.seed);
+}
+
+bool DeviceEmulator::loadImage(const QString &fileName)
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::ReadOnly)) {
+		m_errorString = file.errorString();
+		return false;
+	}
+	m_memory = file.readAll();
+	return true;
+}
+
+bool DeviceEmulator::chance(double p)
+{
+	return p > 0.0 && m_random.generateDouble() < p;
+}
+
+// Time for the I2C bus to move that many bytes, 9 clocks each
+qint64 DeviceEmulator::i2cUs(qint64 bytes) const
+{
+	return bytes * 9 * 1000000 / EMU_I2C_HZ;
+}
+
+void DeviceEmulator::handleReadable()
+{
+	char buf[4096];
+	for(;;) {
+		const ssize_t n = ::read(m_master, buf, sizeof(buf));
+		if(n > 0) {
+			m_in.append(buf, int(n));
+			continue;
+		}
+		if(n == -1 && errno == EINTR)
+			continue;
+		break;
+	}
+
+	while(m_parser.parse(m_in)) {
+		package_t *pkg = m_parser.package();
+
+		// The package needed the link for this long
+		const qint64 bytes = PKG_MINSIZE + pkg->datalen;
+		const qint64 now = m_clock.nsecsElapsed();
+		qint64 wireNs = 0;
+		if(m_link.bandwidth > 0)
+			wireNs = qint64(double(bytes) * 1e9 / m_link.bandwidth);
+		m_rxDoneNs = qMax(now, m_rxDoneNs) + wireNs;
+
+		if(chance(m_link.dropRate)) {
+			qDebug() << "Dropping host package" << EEPROM::getCommandName(pkg->cmd);
+			continue;
+		}
+		handlePackage(pkg);
+	}
+}
+
+// Queue a package, due after the device is done working on it and the
+// link had time to carry it
+void DeviceEmulator::send(commands_e cmd, const QByteArray &data, qint64 busyUs)
+{
+	if(chance(m_link.dropRate)) {
+		qDebug() << "Dropping device package" << EEPROM::getCommandName(cmd);
+		return;
+	}
+
+	QByteArray bytes = SerialPortWriter::buildPackage(cmd, data);
+	if(chance(m_link.corruptRate)) {
+		const int i = m_random.bounded(int(bytes.size()));
+		bytes[i] = char(bytes[i] ^ (1 << m_random.bounded(8)));
+	}
+
+	const qint64 now = m_clock.nsecsElapsed();
+	const qint64 ready = qMax(now, m_rxDoneNs) + (busyUs + m_link.latencyUs) * 1000;
+	qint64 wireNs = 0;
+	if(m_link.bandwidth > 0)
+		wireNs = qint64(double(bytes.size()) * 1e9 / m_link.bandwidth);
+	m_txFreeNs = qMax(ready, m_txFreeNs) + wireNs;
+
+	m_out.enqueue({m_txFreeNs, bytes});
+	if(!m_outTimer.isActive())
+		flushOutput();
+}
+
+void DeviceEmulator::flushOutput()
+{
+	const qint64 now = m_clock.nsecsElapsed();
+
+	while(!m_out.isEmpty() && m_out.head().dueNs <= now) {
+		QByteArray &bytes = m_out.head().bytes;
+		const ssize_t n = ::write(m_master, bytes.constData(), size_t(bytes.size()));
+		if(n == -1 && errno != EINTR && errno != EAGAIN) {
+			qWarning() << "Emulator: write failed:" << strerror(errno);
+			m_out.dequeue();
+			continue;
+		}
+		if(n > 0)
+			bytes.remove(0, int(n));
+		if(!bytes.isEmpty())
+			break;	// pty buffer full, try again in a bit
+		m_out.dequeue();
+	}
+
+	if(!m_out.isEmpty()) {
+		const qint64 waitNs = qMax<qint64>(m_out.head().dueNs - now, 1000000);
+		m_outTimer.start(int(waitNs / 1000000));
+	}
+}
+
+void DeviceEmulator::handleTimeout()
+{
+	qDebug() << "Emulator: host went quiet, disconnecting";
+	disconnectHost();
+}
+
+void DeviceEmulator::disconnectHost()
+{
+	m_state = ST_DISCONNECTED;
+	m_timeout.stop();
+	m_parser.clear();
+	// Whatever is still on its way to a host that left
+	tcflush(m_slave, TCIFLUSH);
+}
+
+errorcode_e DeviceEmulator::selectMemory(memtype_e type)
+{
+	if(type <= MEMTYPE_NONE || type >= MEMTYPE_mAX)
+		return ERROR_MEMID;
+	if(m_chip != MEMTYPE_NONE && type != m_chip)
+		return ERROR_MEMID;
+
+	m_mem = &EEPROM::memoryTable[type];
+	m_targets = 0;
+	// A fresh chip is erased, a loaded image keeps what fits
+	const int size = int(m_mem->size);
+	if(m_memory.size() < size)
+		m_memory.append(QByteArray(size - m_memory.size(), char(0xFF)));
+	return ERROR_NONE;
+}
+
+static quint32 get_u32(const uint8_t *p)
+{
+	return (quint32(p[0]) << 24) | (quint32(p[1]) << 16) |
+		   (quint32(p[2]) <<  8) |  quint32(p[3]);
+}
+
+// Same checks as the firmware
+errorcode_e DeviceEmulator::parseXferRequest(const uint8_t *data)
+{
+	if(!m_mem || data[0] != m_mem->type)
+		return ERROR_MEMID;
+
+	const quint32 offset = get_u32(&data[1]);
+	const quint32 length = get_u32(&data[5]);
+	const quint32 memsize = quint32(m_mem->size);
+
+	if(length == 0 || offset % PKG_DATA_MAX != 0 || length % PKG_DATA_MAX != 0 ||
+	   offset >= memsize || length > memsize - offset)
+		return ERROR_MEMIDX;
+
+	m_idx = offset;
+	m_top = offset + length;
+	return ERROR_NONE;
+}
+
+void DeviceEmulator::sendBlock()
+{
+	// address phase plus the data
+	const QByteArray block = m_memory.mid(int(m_idx), PKG_DATA_MAX);
+	const QByteArray packed = m_rle ? PackBits::encode(block) : QByteArray();
+	if(m_rle && packed.size() + 1 < block.size())
+		send(CMD_MEMDATA_RLE, QByteArray(1, char(packed.size())) + packed, i2cUs(PKG_DATA_MAX + 3));
+	else
+		send(CMD_MEMDATA, block, i2cUs(PKG_DATA_MAX + 3));
+	m_state = ST_READ_WAIT_ACK;
+}
+
+void DeviceEmulator::handlePackage(package_t *pkg)
+{
+	qDebug() << "Emulator got" << EEPROM::getCommandName(pkg->cmd);
+
+	if(m_state != ST_DISCONNECTED)
+		m_timeout.start();
+
+	switch(m_state)
+	{
+	case ST_DISCONNECTED:
+		if(pkg->cmd == CMD_INIT) {
+			send(CMD_INIT);
+			m_channels = 1;
+			m_state = ST_MEMID;
+			m_timeout.start();
+		}
+		break;
+
+	case ST_MEMID:
+		if(pkg->cmd == CMD_MEMID) {
+			if(selectMemory(memtype_e(pkg->data[0])) == ERROR_NONE) {
+				send(CMD_OK);
+				m_state = ST_CONNECTED;
+			}
+			else {
+				sendErr(ERROR_MEMID);
+				disconnectHost();
+			}
+		}
+		else if(pkg->cmd == CMD_INIT) {
+			send(CMD_INIT);
+		}
+		break;
+
+	case ST_CONNECTED:
+		switch(pkg->cmd)
+		{
+		case CMD_PING:
+			send(CMD_TXRX_ACK);
+			break;
+		case CMD_LOOPBACK:
+			send(CMD_LOOPBACK, QByteArray(reinterpret_cast<const char*>(pkg->data), pkg->datalen));
+			break;
+		case CMD_DISCONNECT:
+			disconnectHost();
+			break;
+		case CMD_MEMID:
+			if(selectMemory(memtype_e(pkg->data[0])) == ERROR_NONE) {
+				send(CMD_OK);
+			}
+			else {
+				sendErr(ERROR_MEMID);
+				disconnectHost();
+			}
+			break;
+		case CMD_READMEM:
+		case CMD_READMEM_RLE:
+		case CMD_WRITEMEM: {
+			const errorcode_e err = parseXferRequest(pkg->data);
+			if(err != ERROR_NONE) {
+				sendErr(err);
+				break;
+			}
+			send(CMD_OK);
+			m_retries = 0;
+			m_rle = pkg->cmd == CMD_READMEM_RLE;
+			m_storing = false;
+			m_state = pkg->cmd == CMD_WRITEMEM ? ST_WRITE : ST_READ_WAIT_NEXT;
+			break;
+		}
+		case CMD_STORE: {
+			// A whole image, into flash instead of the chip
+			errorcode_e err = parseXferRequest(pkg->data);
+			if(err == ERROR_NONE && (m_idx != 0 || m_top > STORE_CAPACITY))
+				err = ERROR_MEMIDX;
+			if(err != ERROR_NONE) {
+				sendErr(err);
+				break;
+			}
+			m_store.clear();
+			m_storing = true;
+			send(CMD_OK, QByteArray(), FLASH_ERASE_US);
+			m_state = ST_WRITE;
+			break;
+		}
+		case CMD_BLANKCHECK: {
+			const errorcode_e err = parseXferRequest(pkg->data);
+			if(err != ERROR_NONE) {
+				sendErr(err);
+				break;
+			}
+			// The firmware reads up to the first byte that differs
+			const char fill = char(pkg->data[XFER_REQUEST_SIZE]);
+			quint32 at = m_idx;
+			while(at < m_top && m_memory.at(int(at)) == fill)
+				++at;
+			if(at >= m_top) {
+				send(CMD_OK, QByteArray(), i2cUs(m_top - m_idx));
+			}
+			else {
+				uint8_t reply[4] = {uint8_t(at >> 24), uint8_t(at >> 16), uint8_t(at >> 8), uint8_t(at)};
+				send(CMD_NOTBLANK, QByteArray(reinterpret_cast<char*>(reply), 4), i2cUs(at + 1 - m_idx));
+			}
+			break;
+		}
+		case CMD_TARGETS:
+			// Every strap answers, on a single channel
+			if(m_channels & (m_channels - 1)) {
+				sendErr(ERROR_MEMID);
+				break;
+			}
+			m_targets = pkg->data[0];
+			send(CMD_OK);
+			break;
+		case CMD_CHANNEL:
+			// Both sockets hold the same image, written at the same time
+			if(pkg->data[0] == 0 || pkg->data[0] >= (1U << CHANNELS)) {
+				sendErr(ERROR_MEMID);
+				break;
+			}
+			m_channels = pkg->data[0];
+			m_targets = 0;
+			send(CMD_OK);
+			break;
+		case CMD_GETSTATUS: {
+			QByteArray status(CHIPSTATUS_SIZE, char(ERROR_NONE));
+			status[0] = char(m_targets);
+			send(CMD_CHIPSTATUS, status);
+			break;
+		}
+		case CMD_FILL: {
+			const errorcode_e err = parseXferRequest(pkg->data);
+			if(err != ERROR_NONE) {
+				sendErr(err);
+				break;
+			}
+			const quint32 length = m_top - m_idx;
+			m_memory.replace(int(m_idx), int(length), QByteArray(int(length), char(pkg->data[XFER_REQUEST_SIZE])));
+
+			// Back to back page writes, then the read back if asked for
+			const qint64 pages = length / quint32(m_mem->pageSize);
+			const int twcMs = m_link.twcMs >= 0 ? m_link.twcMs : m_mem->twcMs;
+			qint64 busyUs = pages * (i2cUs(m_mem->pageSize + 3) + twcMs * 1000);
+			if(pkg->data[XFER_REQUEST_SIZE + 1])
+				busyUs += i2cUs(length);
+			send(CMD_OK, QByteArray(), busyUs);
+			break;
+		}
+		default:
+			disconnectHost();
+			break;
+		}
+		break;
+
+	case ST_READ_WAIT_NEXT:
+		if(pkg->cmd == CMD_READNEXT) {
+			sendBlock();
+		}
+		else {
+			sendErr(ERROR_UNKNOWN);
+			disconnectHost();
+		}
+		break;
+
+	case ST_READ_WAIT_ACK:
+		if(pkg->cmd == CMD_TXRX_ACK) {
+			m_idx += PKG_DATA_MAX;
+			if(m_idx >= m_top) {
+				sendErr(ERROR_MEMIDX);
+				m_state = ST_CONNECTED;
+			}
+			else {
+				m_state = ST_READ_WAIT_NEXT;
+			}
+		}
+		else if(pkg->cmd == CMD_TXRX_DONE) {
+			m_state = ST_CONNECTED;
+		}
+		else if(pkg->cmd == CMD_TXRX_ERR && m_retries < EMU_RETRIES_MAX) {
+			sendBlock();
+			++m_retries;
+		}
+		else {
+			if(m_retries >= EMU_RETRIES_MAX)
+				sendErr(ERROR_MAX_RETRY);
+			disconnectHost();
+		}
+		break;
+
+	case ST_WRITE:
+		if(pkg->cmd == CMD_MEMDATA || pkg->cmd == CMD_MEMDATA_RLE) {
+			QByteArray block((const char*)(pkg->data), pkg->datalen);
+			// Decoded into the block buffer, like the firmware does
+			if(pkg->cmd == CMD_MEMDATA_RLE
+					&& (!PackBits::decode(block.mid(1), block, PKG_DATA_MAX) || block.size() != PKG_DATA_MAX)) {
+				sendErr(ERROR_COMM);
+				m_state = ST_CONNECTED;
+				break;
+			}
+			if(m_idx + block.size() > m_top) {
+				sendErr(ERROR_MEMIDX);
+				disconnectHost();
+				break;
+			}
+			if(m_storing) {
+				m_store.append(block);
+				// A page erase every FLASH_PAGE bytes
+				const qint64 busyUs = FLASH_BLOCK_US + (m_idx % FLASH_PAGE == 0 ? FLASH_ERASE_US : 0);
+				m_idx += block.size();
+				send(m_idx >= m_top ? CMD_TXRX_DONE : CMD_TXRX_ACK, QByteArray(), busyUs);
+				if(m_idx >= m_top)
+					m_state = ST_CONNECTED;
+				break;
+			}
+			m_memory.replace(int(m_idx), block.size(), block);
+			m_idx += block.size();
+
+			// One page at a time, each followed by its write cycle, which
+			// overlaps the transfers to the other chips with several targets
+			const int pages = qMax(1, int(block.size()) / m_mem->pageSize);
+			const int twcMs = m_link.twcMs >= 0 ? m_link.twcMs : m_mem->twcMs;
+			const int chips = qMax(1, int(qPopulationCount(m_targets)));
+			const qint64 pageUs = i2cUs(m_mem->pageSize + 3);
+			const qint64 busyUs = pages * qMax(chips * pageUs, pageUs + twcMs * 1000);
+
+			if(m_idx >= m_top) {
+				send(CMD_TXRX_DONE, QByteArray(), busyUs);
+				m_state = ST_CONNECTED;
+			}
+			else {
+				send(CMD_TXRX_ACK, QByteArray(), busyUs);
+			}
+		}
+		else {
+			if(pkg->cmd != CMD_ERR)
+				sendErr(ERROR_UNKNOWN);
+			disconnectHost();
+		}
+		break;
+	}
+}
@@ -0,0 +1,111 @@
+#ifndef DEVICEEMULATOR_H
+#define DEVICEEMULATOR_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QQueue>
+#include <QRandomGenerator>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include "eeprom.h"
+#include "packageparser.h"
+
+/*
+ * How the emulated link and chip behave. Times are added on top of what
+ * the I2C bus at 400 kHz would take anyway.
+ */
+struct LinkOptions {
+	double bandwidth = 1e6;		/* bytes per second each way, 0 = unlimited */
+	int latencyUs = 0;			/* before every package the device sends */
+	int twcMs = -1;				/* page write cycle, -1 = the one of the chip */
+	double corruptRate = 0.0;	/* chance of flipping a byte of a device package */
+	double dropRate = 0.0;		/* chance of losing a package, either way */
+	quint32 seed = 1;
+};
+
+/*
+ * A programmer on a pseudo-terminal: speaks the same protocol as the
+ * firmware (uart_fsm) over an in-memory chip, so the CLI can be pointed
+ * at the /dev/pts/N it prints, with no STM32 around.
+ */
+class DeviceEmulator : public QObject
+{
+	Q_OBJECT
+public:
+	explicit DeviceEmulator(QObject *parent = nullptr);
+	~DeviceEmulator();
+
+	bool open(void);
+	QString portName(void) const {return m_portName;};
+	QString errorString(void) const {return m_errorString;};
+
+	void setLinkOptions(const LinkOptions& op);
+	// Chip in the socket, MEMTYPE_NONE takes whatever the host selects
+	void setChip(memtype_e chip) {m_chip = chip;};
+	bool loadImage(const QString &fileName);
+
+private slots:
+	void handleReadable(void);
+	void flushOutput(void);
+	void handleTimeout(void);
+
+private:
+	enum state_e {
+		ST_DISCONNECTED,
+		ST_MEMID,
+		ST_CONNECTED,
+		ST_READ_WAIT_NEXT,
+		ST_READ_WAIT_ACK,
+		ST_WRITE
+	};
+
+	void handlePackage(package_t *pkg);
+	void send(commands_e cmd, const QByteArray &data = QByteArray(), qint64 busyUs = 0);
+	void sendErr(errorcode_e err) {send(CMD_ERR, QByteArray(1, char(err)));};
+	void sendBlock(void);
+	errorcode_e selectMemory(memtype_e type);
+	errorcode_e parseXferRequest(const uint8_t *data);
+	void disconnectHost(void);
+	bool chance(double p);
+	qint64 i2cUs(qint64 bytes) const;
+
+	QString m_portName;
+	QString m_errorString;
+	int m_master = -1;
+	int m_slave = -1;			/* kept open so the pty outlives its clients */
+	QSocketNotifier *m_notifier = nullptr;
+
+	LinkOptions m_link;
+	QRandomGenerator m_random;
+	QElapsedTimer m_clock;
+	qint64 m_rxDoneNs = 0;		/* last host package fully received */
+	qint64 m_txFreeNs = 0;		/* the link is busy sending until then */
+
+	struct Outgoing {
+		qint64 dueNs;
+		QByteArray bytes;
+	};
+	QQueue<Outgoing> m_out;
+	QTimer m_outTimer;
+
+	PackageParser m_parser;
+	QByteArray m_in;
+	QTimer m_timeout;			/* TIMEOUT_MS of the firmware */
+
+	state_e m_state = ST_DISCONNECTED;
+	memtype_e m_chip = MEMTYPE_NONE;
+	const MemoryInfo *m_mem = nullptr;
+	QByteArray m_memory;
+	quint32 m_idx = 0;
+	quint32 m_top = 0;
+	int m_retries = 0;
+	bool m_rle = false;			/* the read asked for CMD_MEMDATA_RLE */
+	quint8 m_targets = 0;		/* CMD_TARGETS, all chips hold the same image */
+	quint8 m_channels = 1;		/* CMD_CHANNEL, so do all sockets */
+	QByteArray m_store;			/* image of CMD_STORE */
+	bool m_storing = false;		/* ST_WRITE is a CMD_STORE */
+};
+
+#endif // DEVICEEMULATOR_H
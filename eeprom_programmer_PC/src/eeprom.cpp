@@ -1,11 +1,11 @@
 #include "eeprom.h"
 
+#include <cstdio>
+
 EEPROM::EEPROM()
 {
 }
 
-memtype_e EEPROM::m_memtype = MEMTYPE_NONE;
-int EEPROM::m_memsize = 0;
 
 
 
@@ -14,14 +14,25 @@ int EEPROM::cmdHasData(commands_e command) {
 
 	case CMD_INIT:  return 0;
 	case CMD_MEMID: return 1;
-
-	case CMD_READMEM: return 1;
+	case CMD_TARGETS: return 1;
+	case CMD_GETSTATUS: return 0;
+	case CMD_CHANNEL: return 1;
+	case CMD_LOOPBACK: return PKG_DATA_MAX;
+	case CMD_CHIPSTATUS: return CHIPSTATUS_SIZE;
+
+	case CMD_READMEM: return XFER_REQUEST_SIZE;
+	case CMD_READMEM_RLE: return XFER_REQUEST_SIZE;
+	case CMD_BLANKCHECK: return BLANKCHECK_REQUEST_SIZE;
+	case CMD_NOTBLANK: return 4;
 	case CMD_READNEXT: return 0;
 	case CMD_MEMDATA: return PKG_DATA_MAX;
 	case CMD_DATA: return 1;
 	case CMD_INFO: return PKG_DATA_MAX;
+	case CMD_MEMDATA_RLE: return PKG_VARLEN;
 
-	case CMD_WRITEMEM: return 0;
+	case CMD_WRITEMEM: return XFER_REQUEST_SIZE;
+	case CMD_STORE: return XFER_REQUEST_SIZE;
+	case CMD_FILL: return FILL_REQUEST_SIZE;
 
 	case CMD_OK:  return 0;
 	case CMD_ERR: return 1;
@@ -40,6 +51,49 @@ int EEPROM::cmdHasData(commands_e command) {
 	return 0;
 }
 
+QByteArray EEPROM::xferRequest(memtype_e type, quint32 offset, quint32 length) {
+	QByteArray request;
+	request.reserve(XFER_REQUEST_SIZE);
+	request.append(char(type));
+	for(int shift = 24; shift >= 0; shift -= 8)
+		request.append(char(offset >> shift));
+	for(int shift = 24; shift >= 0; shift -= 8)
+		request.append(char(length >> shift));
+	return request;
+}
+
+QByteArray EEPROM::blankCheckRequest(memtype_e type, quint32 offset, quint32 length, uint8_t fill) {
+	QByteArray request = xferRequest(type, offset, length);
+	request.append(char(fill));
+	return request;
+}
+
+QByteArray EEPROM::fillRequest(memtype_e type, quint32 offset, quint32 length, uint8_t pattern, bool verify) {
+	QByteArray request = xferRequest(type, offset, length);
+	request.append(char(pattern));
+	request.append(char(verify ? 1 : 0));
+	return request;
+}
+
+QByteArray EEPROM::hexDump(const QByteArray &data) {
+	const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data.constData());
+	const int size = int(data.size());
+	// Use wider addresses for the memories above 64K
+	const int digits = size > 0x10000 ? 5 : 4;
+
+	QByteArray dump;
+	char buf[128];
+	for(int reg = 0; reg < size; reg += 16) {
+		char *p = buf;
+		p += sprintf(p, "%0*X: ", digits, reg);
+		for(int i = 0; i < 16 && reg + i < size; ++i)
+			p += sprintf(p, "%02X ", int(bytes[reg + i]));
+		*p++ = '\n';
+		dump.append(buf, int(p - buf));
+	}
+	return dump;
+}
+
 QString EEPROM::getErrorMsg(errorcode_e err) {
 	switch(err)
 	{
@@ -74,26 +128,47 @@ QString EEPROM::getCommandName(commands_e cmd) {
 	case CMD_TXRX_ERR:		return QString("XferError");
 	case CMD_READMEM:		return QString("ReadMemory");
 	case CMD_READNEXT:		return QString("ReadNext");
+	case CMD_READMEM_RLE:	return QString("ReadMemoryRle");
+	case CMD_BLANKCHECK:	return QString("BlankCheck");
+	case CMD_NOTBLANK:		return QString("NotBlank");
+	case CMD_TARGETS:		return QString("Targets");
+	case CMD_GETSTATUS:		return QString("GetStatus");
+	case CMD_CHANNEL:		return QString("Channel");
+	case CMD_LOOPBACK:		return QString("Loopback");
+	case CMD_CHIPSTATUS:	return QString("ChipStatus");
 	case CMD_MEMDATA:		return QString("MemoryData");
 	case CMD_WRITEMEM:		return QString("WriteMemory");
+	case CMD_STORE:			return QString("Store");
+	case CMD_FILL:			return QString("Fill");
 	case CMD_DATA:			return QString("Data");
 	case CMD_INFO:			return QString("Info");
+	case CMD_MEMDATA_RLE:	return QString("MemoryDataRle");
 	}
 	return QString("Unregistered_command");
 }
 
-qint64 EEPROM::getMemSize(void) {
-	return getMemSize(m_memtype);
+qint64 EEPROM::getMemSize(memtype_e type) {
+	if(type <= MEMTYPE_NONE || type >= MEMTYPE_mAX)
+		return -1;
+	return memoryTable[type].size;
 }
 
-qint64 EEPROM::getMemSize(memtype_e type) {
-	switch(type) {
-	case MEMTYPE_24LC16:  return 0x800;
-	case MEMTYPE_24LC64:
-	case MEMTYPE_X24645:  return 0x2000;
-	case MEMTYPE_24LC256: return 0x8000;
-	default: return -1;
+const MemoryInfo *EEPROM::findMemInfo(const QString &name) {
+
+	QString Name = name.toUpper();
+
+	for(int i = MEMTYPE_NONE+1; i < MEMTYPE_mAX; ++i) {
+		if(Name == memoryTable[i].name)
+			return &memoryTable[i];
 	}
+	return nullptr;
+}
+
+QStringList EEPROM::getMemNames(void) {
+	QStringList names;
+	for(int i = MEMTYPE_NONE+1; i < MEMTYPE_mAX; ++i)
+		names << memoryTable[i].name;
+	return names;
 }
 
 void EEPROM::setMem_X24645() {
@@ -106,28 +181,17 @@ void EEPROM::setMem_24LC256() {
 	setTargetMem(MEMTYPE_24LC256);
 }
 bool EEPROM::setTargetMem(memtype_e memtype) {
-	if(memtype < MEMTYPE_24LC16 || memtype > MEMTYPE_mAX)
+	if(memtype <= MEMTYPE_NONE || memtype >= MEMTYPE_mAX)
 		return false;
-	m_memtype = memtype;
-	m_memsize = getMemSize(memtype);
+	m_mem = &memoryTable[memtype];
 	return true;
 }
 bool EEPROM::setTargetMem(QString memtype) {
 
-	QString Memtype = memtype.toUpper();
-
-	if(Memtype == "24LC16")
-		m_memtype = MEMTYPE_24LC16;
-	else if (Memtype == "X24645")
-		m_memtype = MEMTYPE_X24645;
-	else if (Memtype == "24LC64")
-		m_memtype = MEMTYPE_24LC64;
-	else if (Memtype == "24LC256")
-		m_memtype = MEMTYPE_24LC256;
-	else {
+	const MemoryInfo *mem = findMemInfo(memtype);
+	if(!mem)
 		return false;
-	}
 
-	m_memsize = getMemSize(m_memtype);
+	m_mem = mem;
 	return true;
 }
@@ -3,14 +3,20 @@
 
 #include <QByteArray>
 #include <QString>
-
-enum memtype_e {
-	MEMTYPE_NONE,
-	MEMTYPE_24LC16,
-	MEMTYPE_24LC64,
-	MEMTYPE_X24645,
-	MEMTYPE_24LC256,
-	MEMTYPE_mAX
+#include <QStringList>
+
+// Shared with the firmware, defines enum memtype_e
+#include "memory_table.h"
+
+/* Geometry and timing of a memory chip */
+struct MemoryInfo {
+	memtype_e type;
+	const char *name;
+	uint8_t address7;	/* 7 bit I2C address */
+	qint64 size;		/* bytes */
+	uint16_t pageSize;	/* page write buffer, bytes */
+	uint8_t addrSize;	/* register address bytes */
+	uint8_t twcMs;		/* max write cycle time, ms */
 };
 
 enum commands_e	: uint8_t {
@@ -19,6 +25,10 @@ enum commands_e	: uint8_t {
 	CMD_INIT			= 0x01,
 	CMD_PING			= 0x02,
 	CMD_MEMID			= 0x03,
+	CMD_TARGETS			= 0x04, /* <mask>, bit n: write to the chip strapped as n too, 0 for one chip */
+	CMD_GETSTATUS		= 0x05, /* answered CMD_CHIPSTATUS */
+	CMD_CHANNEL			= 0x06, /* <mask>, bit n: jobs go to channel n, writes to all of them at once */
+	CMD_LOOPBACK		= 0x07, /* <data[PKG_DATA_MAX]>, sent back as is, USB throughput test */
 	CMD_IDLE			= 0xE1,
 	CMD_STARTXFER		= 0xA5, /* not really a command */
 	CMD_ENDXFER			= 0x5A, /* not really a command */
@@ -31,15 +41,22 @@ enum commands_e	: uint8_t {
 	CMD_TXRX_ERR		= 0xF1, /* mid transfer error, meant to resend content     */
 
 	/* read eeprom and send to PC */
-	CMD_READMEM			= 0x60, /* Specifies which memory is required, and start TX process */
+	CMD_READMEM			= 0x60, /* <memtype><offset[4]><length[4]>, starts TX process */
 	CMD_READNEXT		= 0x61, /* Request to send next block */
+	CMD_READMEM_RLE		= 0x62, /* as CMD_READMEM, blocks may come back as CMD_MEMDATA_RLE */
+	CMD_BLANKCHECK		= 0x63, /* <memtype><offset[4]><length[4]><fill>, answered OK or NOTBLANK */
 
 	CMD_MEMDATA         = 0x70, /* Data is being sent over */
 	CMD_DATA            = 0x71, /* Simple 1byte data command */
 	CMD_INFO			= 0x72, /* PKG_DATA_MAX bytes of text */
+	CMD_MEMDATA_RLE		= 0x73, /* <length><PackBits[length]>, a CMD_MEMDATA block compressed */
+	CMD_NOTBLANK		= 0x74, /* <offset[4]>, first byte that isn't the fill value */
+	CMD_CHIPSTATUS		= 0x75, /* <mask><errorcode[CHIPS_MAX]>, of the chips of CMD_TARGETS */
 
 	/* get data from pc and write to eeprom */
-	CMD_WRITEMEM		= 0x80
+	CMD_WRITEMEM		= 0x80, /* <memtype><offset[4]><length[4]>, starts RX process */
+	CMD_FILL			= 0x81, /* <memtype><offset[4]><length[4]><pattern><verify>, no data follows */
+	CMD_STORE			= 0x82  /* <memtype><offset[4]><length[4]>, as CMD_WRITEMEM into the image store */
 };
 // TODO: make commands objects of a command class
 
@@ -51,6 +68,30 @@ enum commands_e	: uint8_t {
 #define PKG_MINSIZE 5
 #define PKG_DATA_MAX 256
 
+/*
+ * cmdHasData() of variable length packages: the first data byte is the
+ * number of bytes after it, so they carry at most PKG_DATA_MAX - 1.
+ */
+#define PKG_VARLEN (-1)
+
+/*
+ * READMEM / WRITEMEM data: memtype, then offset and length in bytes,
+ * both big endian and multiple of PKG_DATA_MAX.
+ */
+#define XFER_REQUEST_SIZE 9
+/* The same followed by the fill value */
+#define BLANKCHECK_REQUEST_SIZE (XFER_REQUEST_SIZE + 1)
+#define FILL_REQUEST_SIZE (XFER_REQUEST_SIZE + 2)
+
+/* Chips on a multi-chip fixture, one per value of the A2..A0 straps */
+#define CHIPS_MAX 8
+#define CHIPSTATUS_SIZE (1 + CHIPS_MAX)
+/* I2C buses of the programmer, a socket on each */
+#define CHANNELS 2
+
+/* Largest image CMD_STORE takes: 24 KiB of flash, less a block for its header */
+#define STORE_CAPACITY (24 * 1024 - PKG_DATA_MAX)
+
 
 struct package_t {
 	commands_e cmd;
@@ -60,11 +101,6 @@ struct package_t {
 	uint8_t *data;
 };
 
-struct pkgdata_t {
-	commands_e cmd;
-	QByteArray data;
-};
-
 enum errorcode_e {
 	ERROR_NONE,
 	ERROR_UNKNOWN,   /* Implies CMD_DISCONNECT */
@@ -82,24 +118,41 @@ class EEPROM
 public:
 	EEPROM();
 
-	static void setMem_24LC16(void);
-	static void setMem_X24645(void);
-	static void setMem_24LC256(void);
-	static bool setTargetMem(memtype_e memtype);
-	static bool setTargetMem(QString memtype);
+#define MEMORY_TABLE_INFO(id, name, address7, size, pageSz, addrSz, twcMs) \
+	{MEMTYPE_##id, name, address7, size, pageSz, addrSz, twcMs},
+
+	static constexpr MemoryInfo memoryTable[MEMTYPE_mAX] = {
+		MEMORY_TABLE(MEMORY_TABLE_INFO)
+	};
+
+#undef MEMORY_TABLE_INFO
 
-	static memtype_e getMemType(void) {return m_memtype;}
-	static qint64 getMemSize(void);
+	void setMem_24LC16(void);
+	void setMem_X24645(void);
+	void setMem_24LC256(void);
+	bool setTargetMem(memtype_e memtype);
+	bool setTargetMem(QString memtype);
+
+	const MemoryInfo &getMemInfo(void) const {return *m_mem;}
+	memtype_e getMemType(void) const {return m_mem->type;}
+	qint64 getMemSize(void) const {return m_mem->size;}
+
+	static const MemoryInfo *findMemInfo(const QString &name);
+	static QStringList getMemNames(void);
 	static qint64 getMemSize(memtype_e);
 	static QString getErrorMsg(errorcode_e);
 	static QString getCommandName(commands_e cmd);
 
 	static int cmdHasData(commands_e command);
-
-protected:
-
-	static memtype_e m_memtype;
-	static int m_memsize;
+	static QByteArray xferRequest(memtype_e type, quint32 offset, quint32 length);
+	static QByteArray blankCheckRequest(memtype_e type, quint32 offset, quint32 length, uint8_t fill);
+	static QByteArray fillRequest(memtype_e type, quint32 offset, quint32 length, uint8_t pattern, bool verify);
+	// 16 bytes per line, "ADDR: XX XX ... "
+	static QByteArray hexDump(const QByteArray &data);
+
+private:
+	// Points into memoryTable, so it is never modified, only replaced.
+	const MemoryInfo *m_mem = &memoryTable[MEMTYPE_NONE];
 };
 
 #endif // EEPROM_H
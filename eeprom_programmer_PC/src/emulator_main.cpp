@@ -0,0 +1,117 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "deviceemulator.h"
+#include "sigwatch.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+
+#include <signal.h>
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("EEPROM Programmer emulator");
+	QCoreApplication::setApplicationVersion("1.0.0");
+
+	QTextStream out(stdout);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Emulates a programmer on a pseudo-terminal.");
+	parser.addHelpOption();
+	parser.addVersionOption();
+	parser.addOptions({
+			{"chip",
+							"Only accept memory <type>, as a wrong chip in the socket would.", "type"},
+			{"image",
+							"Initial memory content.", "file"},
+			{"link",
+							"Also make the port reachable as symlink <path>.", "path"},
+			{"bandwidth",
+							"Link speed in bytes per second, 0 for unlimited (1000000).", "bytes", "1000000"},
+			{"latency",
+							"Extra delay before every answer, in microseconds.", "us", "0"},
+			{"twc",
+							"Page write cycle in ms, instead of the one of the chip.", "ms"},
+			{"corrupt",
+							"Chance [0..1] of flipping a bit in a package sent to the host.", "rate", "0"},
+			{"drop",
+							"Chance [0..1] of losing a package, either way.", "rate", "0"},
+			{"seed",
+							"Seed for the fault injection.", "n", "1"},
+		});
+	parser.process(app);
+
+	DeviceEmulator emulator;
+
+	LinkOptions link;
+	link.bandwidth = parser.value("bandwidth").toDouble();
+	link.latencyUs = parser.value("latency").toInt();
+	if(parser.isSet("twc"))
+		link.twcMs = parser.value("twc").toInt();
+	link.corruptRate = parser.value("corrupt").toDouble();
+	link.dropRate = parser.value("drop").toDouble();
+	link.seed = parser.value("seed").toUInt();
+	emulator.setLinkOptions(link);
+
+	if(parser.isSet("chip")) {
+		const MemoryInfo *mem = EEPROM::findMemInfo(parser.value("chip"));
+		if(!mem || mem->type == MEMTYPE_NONE) {
+			out << "Error: unknown memory type. Use one of: "
+				<< EEPROM::getMemNames().join(" - ") << Qt::endl;
+			return 1;
+		}
+		emulator.setChip(mem->type);
+	}
+
+	if(parser.isSet("image") && !emulator.loadImage(parser.value("image"))) {
+		out << "Error: could not load image: " << emulator.errorString() << Qt::endl;
+		return 1;
+	}
+
+	if(!emulator.open()) {
+		out << "Error: " << emulator.errorString() << Qt::endl;
+		return 1;
+	}
+
+	const QString linkPath = parser.value("link");
+	if(!linkPath.isEmpty()) {
+		QFile::remove(linkPath);
+		if(!QFile::link(emulator.portName(), linkPath)) {
+			out << "Error: could not create " << linkPath << Qt::endl;
+			return 1;
+		}
+	}
+
+	// Scripts wait for this line
+	out << "Emulating a programmer on " << emulator.portName() << Qt::endl;
+
+	UnixSignalWatcher sigwatch;
+	sigwatch.watchForSignal(SIGINT);
+	sigwatch.watchForSignal(SIGTERM);
+	QObject::connect(&sigwatch, SIGNAL(unixSignal(int)), &app, SLOT(quit()));
+
+	const int ret = app.exec();
+
+	if(!linkPath.isEmpty())
+		QFile::remove(linkPath);
+	return ret;
+}
@@ -0,0 +1,375 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "jobscheduler.h"
+
+#include <QJsonObject>
+#include <QtAlgorithms>
+
+
+JobScheduler::JobScheduler(QObject *parent)
+	: QObject(parent)
+	, m_keepAlive(this)
+{
+	m_clock.start();
+	m_keepAlive.setSingleShot(false);
+	connect(&m_keepAlive, &QTimer::timeout,
+					this, &JobScheduler::keepAlive);
+}
+
+JobScheduler::~JobScheduler()
+{
+	qDeleteAll(m_workers);
+}
+
+// Pings while idle, 0 to stop. Has to be below the TIMEOUT_MS of the uC.
+void JobScheduler::setKeepAlive(int ms)
+{
+	if(ms > 0)
+		m_keepAlive.start(ms);
+	else
+		m_keepAlive.stop();
+}
+
+bool JobScheduler::isLinkError(errorcode_e err)
+{
+	return err == ERROR_UNKNOWN || err == ERROR_MAX_RETRY
+		|| err == ERROR_TIMEOUT || err == ERROR_COMM;
+}
+
+void JobScheduler::complete(const std::shared_ptr<XferRequest::State> &state, const XferResult &result)
+{
+	// A removed session may still finish what it had on the wire
+	if(!state->done)
+		state->complete(result);
+}
+
+// Null if the session went away, or was replaced by a new one on the same port
+JobScheduler::Worker *JobScheduler::worker(quint64 id, const QString &port) const
+{
+	Worker *w = m_workers.value(port);
+	return w && w->id == id ? w : nullptr;
+}
+
+void JobScheduler::addSession(MemoryComm *session)
+{
+	Worker *w = new Worker;
+	w->id = m_nextId++;
+	w->port = session->getSerialPortOptions().name;
+	w->session = session;
+	w->memtype = session->getMemType();
+	w->addedNs = m_clock.nsecsElapsed();
+
+	removeSession(w->port);
+	m_workers.insert(w->port, w);
+
+	// Take work off the others right away, or get connected for the first job
+	fill(w);
+	if(w->running.isEmpty())
+		warmUp(w);
+}
+
+void JobScheduler::removeSession(const QString &portName)
+{
+	Worker *w = m_workers.take(portName);
+	if(!w)
+		return;
+
+	const QList<std::shared_ptr<XferRequest::State>> running = w->running;
+	const QQueue<Queued> queue = w->queue;
+	delete w;
+
+	// From the event loop, whoever is waiting may submit again
+	const XferResult lost{ERROR_COMM, QByteArray(), portName};
+	for(const std::shared_ptr<XferRequest::State> &state : running) {
+		QMetaObject::invokeMethod(this, [state, lost]() {
+			complete(state, lost);
+		}, Qt::QueuedConnection);
+	}
+
+	for(const Queued &queued : queue) {
+		if(queued.job.port.isEmpty() && !m_workers.isEmpty()) {
+			placeFor(queued.job)->queue.enqueue(queued);
+			continue;
+		}
+		auto state = queued.state;
+		QMetaObject::invokeMethod(this, [state, lost]() {
+			complete(state, lost);
+		}, Qt::QueuedConnection);
+	}
+
+	for(Worker *other : m_workers)
+		fill(other);
+}
+
+XferRequest JobScheduler::submit(const SchedulerJob &job)
+{
+	XferRequest request;
+
+	errorcode_e err = ERROR_NONE;
+	if(job.memtype <= MEMTYPE_NONE || job.memtype >= MEMTYPE_mAX)
+		err = ERROR_MEMID;
+	else if(m_workers.isEmpty() || (!job.port.isEmpty() && !m_workers.contains(job.port)))
+		err = ERROR_COMM;
+
+	if(err != ERROR_NONE) {
+		auto state = request.m_state;
+		QMetaObject::invokeMethod(this, [state, err]() {
+			complete(state, XferResult{err, QByteArray(), QString(), 0, -1});
+		}, Qt::QueuedConnection);
+		return request;
+	}
+
+	Worker *w = placeFor(job);
+	w->queue.enqueue(Queued{job, request.m_state});
+	fill(w);
+	return request;
+}
+
+// Pinned jobs go where they're told, the rest to the least loaded session,
+// one that won't need a MEMID first if there's a tie
+JobScheduler::Worker *JobScheduler::placeFor(const SchedulerJob &job)
+{
+	if(!job.port.isEmpty())
+		return m_workers.value(job.port);
+
+	Worker *best = nullptr;
+	qsizetype bestLoad = 0;
+	for(Worker *w : m_workers) {
+		const qsizetype load = w->queue.size() + w->running.size();
+		if(!best || load < bestLoad
+				|| (load == bestLoad && w->memtype == job.memtype && best->memtype != job.memtype)) {
+			best = w;
+			bestLoad = load;
+		}
+	}
+	return best;
+}
+
+// Take a job from the back of the longest queue, one for the chip the
+// thief has selected if there's any
+bool JobScheduler::steal(Worker *thief)
+{
+	Worker *victim = nullptr;
+	qsizetype longest = 0;
+	for(Worker *w : m_workers) {
+		if(w == thief || w->queue.size() <= longest)
+			continue;
+		for(const Queued &queued : w->queue) {
+			if(queued.job.port.isEmpty()) {
+				victim = w;
+				longest = w->queue.size();
+				break;
+			}
+		}
+	}
+	if(!victim)
+		return false;
+
+	qsizetype pick = -1;
+	for(qsizetype i = victim->queue.size() - 1; i >= 0; --i) {
+		const SchedulerJob &job = victim->queue[i].job;
+		if(!job.port.isEmpty())
+			continue;
+		if(pick < 0)
+			pick = i;
+		if(job.memtype == thief->memtype) {
+			pick = i;
+			break;
+		}
+	}
+
+	++thief->steals;
+	dispatch(thief, victim->queue.takeAt(pick));
+	return true;
+}
+
+void JobScheduler::fill(Worker *w)
+{
+	while(w->running.size() < m_depth) {
+		if(!w->queue.isEmpty())
+			dispatch(w, w->queue.dequeue());
+		else if(!steal(w))
+			break;
+	}
+}
+
+void JobScheduler::dispatch(Worker *w, Queued queued)
+{
+	MemoryComm *session = w->session;
+	const SchedulerJob &job = queued.job;
+	const quint64 id = w->id;
+	const QString port = w->port;
+
+	// Handshake or chip change, queued on the session right before the job
+	auto setupError = std::make_shared<errorcode_e>(ERROR_NONE);
+	auto onSetup = [this, id, port, setupError](const XferResult &result) {
+		if(result.ok())
+			return;
+		*setupError = result.error;
+		if(Worker *w = worker(id, port))
+			w->connected = false;
+	};
+	if(!w->connected) {
+		session->setTargetMem(job.memtype);
+		session->connectDevice().onFinished(onSetup);
+		w->connected = true;
+	}
+	else if(job.memtype != session->getMemType()) {
+		session->selectMemory(job.memtype).onFinished(onSetup);
+	}
+	w->memtype = job.memtype;
+
+	XferRequest request;
+	qint64 bytes = 0;
+	switch(job.operation)
+	{
+	case MemoryComm::OP_TX:
+		request = session->write(job.data, job.offset);
+		bytes = job.data.size();
+		break;
+	case MemoryComm::OP_PING:
+		request = session->ping();
+		break;
+	case MemoryComm::OP_BLANKCHECK:
+		request = session->blankCheck(job.fill);
+		break;
+	case MemoryComm::OP_FILL:
+		request = session->fill(job.offset, job.length, job.fill, job.verify);
+		bytes = job.length;
+		break;
+	default:
+		request = session->readRange(job.offset, job.length);
+		bytes = job.length;
+		break;
+	}
+
+	if(w->running.isEmpty())
+		w->busySinceNs = m_clock.nsecsElapsed();
+	w->running.append(queued.state);
+
+	auto state = queued.state;
+	request.onFinished([this, id, port, state, setupError, bytes](const XferResult &result) {
+		XferResult out = result;
+		// What went wrong first, a failed MEMID makes the job time out
+		if(!out.ok() && *setupError != ERROR_NONE)
+			out.error = *setupError;
+		finish(id, port, state, out, bytes);
+	});
+}
+
+void JobScheduler::finish(quint64 id, const QString &port, std::shared_ptr<XferRequest::State> state,
+						  XferResult result, qint64 bytes)
+{
+	result.port = port;
+
+	if(Worker *w = worker(id, port)) {
+		w->running.removeOne(state);
+		if(w->running.isEmpty())
+			w->busyNs += m_clock.nsecsElapsed() - w->busySinceNs;
+		if(result.ok()) {
+			++w->jobs;
+			w->bytes += bytes;
+		}
+		else if(isLinkError(result.error)) {
+			w->connected = false;
+		}
+	}
+
+	complete(state, result);
+
+	// The callback may have submitted or removed sessions
+	if(Worker *w = worker(id, port))
+		fill(w);
+	checkAllDone();
+}
+
+void JobScheduler::warmUp(Worker *w)
+{
+	if(!w->running.isEmpty() || !w->queue.isEmpty() || w->session->pendingJobs() > 0)
+		return;
+
+	const quint64 id = w->id;
+	const QString port = w->port;
+	XferRequest request;
+	if(w->connected) {
+		request = w->session->ping();
+	}
+	else if(w->memtype != MEMTYPE_NONE) {
+		w->session->setTargetMem(w->memtype);
+		request = w->session->connectDevice();
+		w->connected = true;
+	}
+	else {
+		// No chip to select yet, the first job will connect
+		return;
+	}
+
+	request.onFinished([this, id, port](const XferResult &result) {
+		if(Worker *w = worker(id, port); w && !result.ok())
+			w->connected = false;
+	});
+}
+
+void JobScheduler::keepAlive()
+{
+	for(Worker *w : m_workers)
+		warmUp(w);
+}
+
+int JobScheduler::pendingJobs() const
+{
+	int pending = 0;
+	for(const Worker *w : m_workers)
+		pending += int(w->queue.size() + w->running.size());
+	return pending;
+}
+
+void JobScheduler::checkAllDone()
+{
+	if(pendingJobs() == 0)
+		emit allDone();
+}
+
+QJsonArray JobScheduler::utilization() const
+{
+	const qint64 now = m_clock.nsecsElapsed();
+
+	QJsonArray table;
+	for(const Worker *w : m_workers) {
+		qint64 busy = w->busyNs;
+		if(!w->running.isEmpty())
+			busy += now - w->busySinceNs;
+		const qint64 wall = now - w->addedNs;
+
+		QJsonObject json;
+		json["port"] = w->port;
+		json["memtype"] = EEPROM::memoryTable[w->memtype].name;
+		json["connected"] = w->connected;
+		json["queued"] = int(w->queue.size());
+		json["running"] = int(w->running.size());
+		json["jobs"] = w->jobs;
+		json["bytes"] = w->bytes;
+		json["steals"] = w->steals;
+		json["busy_ms"] = double(busy) / 1e6;
+		json["utilization"] = wall > 0 ? double(busy) / double(wall) : 0.0;
+		table.append(json);
+	}
+	return table;
+}
@@ -0,0 +1,114 @@
+#ifndef JOBSCHEDULER_H
+#define JOBSCHEDULER_H
+
+#include "memorycomm.h"
+#include "xferrequest.h"
+
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QMap>
+#include <QObject>
+#include <QQueue>
+#include <QTimer>
+
+#include <memory>
+
+/* One unit of work for whichever programmer gets it */
+struct SchedulerJob {
+	MemoryComm::operations_e operation = MemoryComm::OP_RX;	/* OP_RX, OP_TX, OP_PING, OP_BLANKCHECK or OP_FILL */
+	memtype_e memtype = MEMTYPE_NONE;
+	quint32 offset = 0;
+	quint32 length = 0;		/* reads */
+	QByteArray data;		/* writes */
+	uint8_t fill = 0xFF;	/* blank checks (always the whole memory) and fills */
+	bool verify = false;	/* fills */
+	QString port;			/* only this programmer may run it, empty for any */
+};
+
+/*
+ * Spreads jobs for different chips over several programmer sessions.
+ *
+ * Each session has its own queue: a new job goes to the least loaded
+ * one, preferring a session that already has its chip selected. A
+ * session that runs out of work steals from the longest queue, again
+ * preferring jobs for the chip it has selected, so no programmer sits
+ * idle while another one has a backlog. Sessions are handshaken and
+ * switched between chips as needed, and pinged while idle so the uC
+ * keeps them connected.
+ */
+class JobScheduler : public QObject
+{
+	Q_OBJECT
+public:
+	explicit JobScheduler(QObject *parent = nullptr);
+	~JobScheduler();
+
+	// The session must be open, it isn't owned
+	void addSession(MemoryComm *session);
+	// Its queued jobs go to the others, the ones on the wire fail
+	void removeSession(const QString &portName);
+	bool hasSession(const QString &portName) const {return m_workers.contains(portName);};
+	int sessionCount(void) const {return m_workers.size();};
+
+	// Jobs each session gets ahead, so it never waits for us between two
+	void setDepth(int jobs) {m_depth = qMax(1, jobs);};
+	void setKeepAlive(int ms);
+
+	// The result says which port ran the job
+	XferRequest submit(const SchedulerJob &job);
+	int pendingJobs(void) const;
+
+	// Per session: jobs, bytes, steals, busy time and its share of the
+	// time since the session was added
+	QJsonArray utilization(void) const;
+
+signals:
+	void allDone(void);
+
+private slots:
+	void keepAlive(void);
+
+private:
+	struct Queued {
+		SchedulerJob job;
+		std::shared_ptr<XferRequest::State> state;
+	};
+
+	struct Worker {
+		quint64 id = 0;
+		QString port;
+		MemoryComm *session = nullptr;
+		memtype_e memtype = MEMTYPE_NONE;	/* of the last job handed to the session */
+		bool connected = false;				/* past MEMID, as far as we know */
+		QQueue<Queued> queue;
+		QList<std::shared_ptr<XferRequest::State>> running;
+
+		qint64 addedNs = 0;
+		qint64 busySinceNs = 0;
+		qint64 busyNs = 0;
+		qint64 jobs = 0;
+		qint64 bytes = 0;
+		qint64 steals = 0;
+	};
+
+	Worker *placeFor(const SchedulerJob &job);
+	bool steal(Worker *thief);
+	void fill(Worker *worker);
+	void dispatch(Worker *worker, Queued queued);
+	void finish(quint64 id, const QString &port, std::shared_ptr<XferRequest::State> state,
+				XferResult result, qint64 bytes);
+	Worker *worker(quint64 id, const QString &port) const;
+	void warmUp(Worker *worker);
+	void checkAllDone(void);
+
+	static void complete(const std::shared_ptr<XferRequest::State> &state, const XferResult &result);
+	static bool isLinkError(errorcode_e err);
+
+	QMap<QString, Worker*> m_workers;	/* by port name */
+	quint64 m_nextId = 1;
+	int m_depth = 2;
+	QElapsedTimer m_clock;
+	QTimer m_keepAlive;
+};
+
+#endif // JOBSCHEDULER_H
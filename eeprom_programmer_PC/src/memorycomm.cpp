@@ -18,94 +18,162 @@
  */
 
 #include "memorycomm.h"
+#include "packbits.h"
 
+// Bytes per CMD_BLANKCHECK / CMD_FILL, small enough to be answered within
+// their timeout by any chip: 100 kHz reads, or page writes at tWC (X24645).
+#define BLANKCHECK_SPAN 0x8000U
+#define FILL_SPAN 0x2000U
 
-MemoryComm::MemoryComm(int &argc, char **argv, FILE* outStream)
-	: QCoreApplication(argc, argv)
+static quint32 get_u32(const uint8_t *p)
+{
+	return (quint32(p[0]) << 24) | (quint32(p[1]) << 16) |
+		   (quint32(p[2]) <<  8) |  quint32(p[3]);
+}
+
+MemoryComm::MemoryComm(FILE* outStream, QObject *parent)
+	: QObject(parent)
 	, m_buffer()
-	, m_pkg(pkgdata_t({CMD_NONE,m_buffer}))
 	, m_standardOutput(outStream)
-	, m_serialPortWriter(&m_serialPort, outStream)
-	, m_serialPortReader(&m_serialPort, outStream)
+	, m_ioThread(this)
+	, m_io(new SerialPortIo(outStream))
 {
-//	m_pkg.cmd = CMD_NONE;
-//	m_pkg.data = &m_buffer;
-
+	m_ioThread.setObjectName("serial-io");
+	m_io->moveToThread(&m_ioThread);
+	m_ioThread.start();
 	setSignals();
 }
 
 void MemoryComm::setSignals()
 {
-	connect(&m_serialPortReader, &SerialPortReader::packageReady,
-						   this, &MemoryComm::handlePackageReceived);
+	connect(m_io, &SerialPortIo::eventsReady,
+			this, &MemoryComm::handleIoEvents, Qt::QueuedConnection);
+}
+
+void MemoryComm::callIo(const std::function<void()> &f) const
+{
+	if(m_io->thread() == QThread::currentThread())
+		f();
+	else
+		QMetaObject::invokeMethod(m_io, f, Qt::BlockingQueuedConnection);
+}
+
+void MemoryComm::setSerialPortOptions(const SerialPortOptions& op)
+{
+	m_serialPortOptions = op;
+	callIo([this, op]() {
+		QSerialPort &serialPort = m_io->serialPort();
+		serialPort.setPortName(op.name);
+		serialPort.setBaudRate(op.baudrate);
+		serialPort.setDataBits(op.databits);
+		serialPort.setParity(op.parity);
+		serialPort.setStopBits(op.stopbits);
+		serialPort.setFlowControl(op.flowcontrol);
+#ifdef Q_OS_LINUX
+		RawSerialPort &rawPort = m_io->rawPort();
+		rawPort.setPortName(op.name);
+		rawPort.setBaudRate(op.baudrate);
+		rawPort.setDataBits(op.databits);
+		rawPort.setParity(op.parity);
+		rawPort.setStopBits(op.stopbits);
+		rawPort.setFlowControl(op.flowcontrol);
+#endif
+		m_io->setTransport(op.transport);
+	});
+	placeIo();
+}
 
-	connect(&m_serialPortReader, &SerialPortReader::timeout,
-						   this, &MemoryComm::handleRxTimedOut);
+// A replayed trace runs on timers of the session's thread, so the I/O
+// object moves over there while it's in use, and back afterwards
+void MemoryComm::setDevice(QIODevice *device)
+{
+	m_replaying = device;
+	placeIo();
+	callIo([this, device]() { m_io->setDevice(device); });
+	m_txInFlight = 0;
+}
 
-	connect(&m_serialPortWriter, &SerialPortWriter::packageSent,
-						   this, &MemoryComm::handlePackageSent);
+// The io_uring transport shares one thread among all sessions, the
+// ports have to live on it
+void MemoryComm::placeIo()
+{
+	QThread *target = &m_ioThread;
+	if(m_replaying)
+		target = thread();
+#ifdef Q_OS_LINUX
+	else if(m_serialPortOptions.transport == TRANSPORT_URING && UringLoop::instance())
+		target = UringLoop::instance()->thread();
+#endif
+	callIo([this, target]() { m_io->moveToThread(target); });
+}
 
-	connect(               qApp, &QCoreApplication::aboutToQuit,
-						   this, &MemoryComm::handleAppQuit);
+bool MemoryComm::open()
+{
+	bool ok = false;
+	callIo([this, &ok]() { ok = m_io->open(); });
+	return ok;
 }
 
+bool MemoryComm::isOpen() const
+{
+	bool open = false;
+	callIo([this, &open]() { open = m_io->device()->isOpen(); });
+	return open;
+}
 
-void MemoryComm::setSerialPortOptions(SerialPortOptions& op)
+QString MemoryComm::errorString() const
 {
-	m_serialPort.setPortName(op.name);
-	m_serialPort.setBaudRate(op.baudrate);
-	m_serialPort.setDataBits(op.databits);
-	m_serialPort.setParity(op.parity);
-	m_serialPort.setStopBits(op.stopbits);
-	m_serialPort.setFlowControl(op.flowcontrol);
+	QString error;
+	callIo([this, &error]() { error = m_io->device()->errorString(); });
+	return error;
 }
 
 MemoryComm::~MemoryComm()
 {
 	qDebug() << "MemoryComm destructor.";
 
-	if(m_serialPort.isOpen()) {
-		qDebug() << "SerialPort is still open.";
-		m_serialPort.close();
-	}
+	// Nobody will be around to resume
+	m_jobs.clear();
+	m_jobActive = false;
+
+	callIo([this]() {
+		QSerialPort &serialPort = m_io->serialPort();
+		if(serialPort.isOpen()) {
+			qDebug() << "SerialPort is still open.";
+			serialPort.close();
+		}
+#ifdef Q_OS_LINUX
+		// Gives its slot back, on the ring's thread
+		m_io->uringPort().close();
+#endif
+		// The ring's thread keeps running, delete it from here
+		m_io->moveToThread(thread());
+	});
+	m_ioThread.quit();
+	m_ioThread.wait();
+	delete m_io;
 }
 
-void MemoryComm::handleAppQuit()
+// Say goodbye to the uC and release the port
+void MemoryComm::close()
 {
-	qDebug() << "MemoryComm::HandleAppQuit()";
-	if(m_serialPort.isOpen()) {
+	qDebug() << "MemoryComm::close()";
+	if(isOpen()) {
 		qDebug() << "SerialPort connected. Sending CMD_DISCONNECT...";
 		sendCommand(CMD_DISCONNECT);
-		while(m_serialPortWriter.busy() == true)
-			if(m_serialPort.waitForBytesWritten(100) == false)
-				break;
-		// TODO: this doesn't seems to return on time on linux.
-		// Nor does the signal bytesWritten get emmited.
-		m_serialPort.close();
+		// Writes out what's queued before closing
+		callIo([this]() { m_io->close(); });
+		m_txInFlight = 0;
 	}
 	else {
 		qDebug() << "SerialPort not connected.";
 	}
 }
 
-#ifdef _WIN32
-bool MemoryComm::handleSignal(int signal)
-{
-	qDebug() << "Handling signal " << signal;
-	if(signal & DEFAULT_SIGNALS) {
-		QTimer::singleShot(0, qApp, SLOT(quit()));
-		// The thread is going to stop soon, so don't propagate this signal further
-		return true;
-	}
-	else {
-		// Let the signal propagate as though we had not been there
-		return false;
-	}
-}
-#endif
-
 void MemoryComm::clearBuffers() {
-	m_serialPortReader.clearBuffer();
+	IoRequest request;
+	request.kind = IoRequest::CLEAR_INPUT;
+	m_io->post(request);
 	m_buffer.clear();
 }
 
@@ -126,11 +194,22 @@ bool MemoryComm::sendCommand(commands_e cmd, const QByteArray& data) {
 
 	m_lastTxCmd = cmd;
 
-	qint64 ret = m_serialPortWriter.send(cmd, data);
+	// One frame on its way at a time, like the writer itself
+	IoRequest request;
+	request.kind = IoRequest::FRAME;
+	request.cmd = cmd;
+	request.data = data.left(PKG_DATA_MAX);
+	request.rxTimeoutMs = rxTimeout(cmd);
+	if(request.rxTimeoutMs >= 0)
+		request.seq = ++m_timeoutSeq;
 
-	bool success = ret != -1;
+	bool success = m_txInFlight == 0 && m_io->post(request);
 	if(success) {
-		setRxTimeout(cmd);
+		++m_txInFlight;
+		if(m_trace)
+			m_trace->record(TraceRecord::HOST_TO_DEVICE, cmd, request.data);
+		m_stats.commandSent(cmd, PKG_MINSIZE + request.data.size());
+		m_jobWireBytes += PKG_MINSIZE + request.data.size();
 	}
 	else {
 		qDebug() << "Error sending command" << EEPROM::getCommandName(cmd);
@@ -139,94 +218,431 @@ bool MemoryComm::sendCommand(commands_e cmd, const QByteArray& data) {
 	return success;
 }
 
-bool MemoryComm::readMem() {
+XferRequest MemoryComm::enqueue(Job job)
+{
+	XferRequest request;
+	job.state = request.m_state;
+	job.memtype = getMemType();
+	m_jobs.enqueue(job);
+	scheduleNextJob();
+	return request;
+}
+
+// A job that can't even start: report it from the event loop like any other
+XferRequest MemoryComm::rejected(errorcode_e err)
+{
+	XferRequest request;
+	auto state = request.m_state;
+	QMetaObject::invokeMethod(this, [state, err]() {
+		state->complete(XferResult{err, QByteArray(), QString(), 0, -1});
+	}, Qt::QueuedConnection);
+	return request;
+}
+
+XferRequest MemoryComm::connectDevice()
+{
+	Job job;
+	job.operation = OP_CONNECT;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::probe()
+{
+	Job job;
+	job.operation = OP_CONNECT;
+	job.initOnly = true;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::selectMemory(memtype_e type)
+{
+	if(type == MEMTYPE_NONE || !setTargetMem(type))
+		return rejected(ERROR_MEMID);
+
+	Job job;
+	job.operation = OP_MEMID;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::ping()
+{
+	Job job;
+	job.operation = OP_PING;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::selectTargets(quint8 mask)
+{
+	Job job;
+	job.operation = OP_TARGETS;
+	job.targets = mask;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::selectChannels(quint8 mask)
+{
+	if(mask == 0 || mask >= (1U << CHANNELS))
+		return rejected(ERROR_MEMID);
+	Job job;
+	job.operation = OP_CHANNEL;
+	job.targets = mask;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::chipStatus()
+{
+	Job job;
+	job.operation = OP_CHIPSTATUS;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::readAll()
+{
+	return readRange(0, quint32(getMemSize()));
+}
+
+XferRequest MemoryComm::readRange(quint32 offset, quint32 length)
+{
+	const quint64 memsize = quint64(getMemSize());
+	if(length == 0 || quint64(offset) + length > memsize)
+		return rejected(ERROR_MEMIDX);
+
+	// The uC only moves whole blocks, widen the range and trim the answer
+	const quint32 mask = PKG_DATA_MAX - 1;
+	const quint32 first = offset & ~mask;
+	const quint64 last = (quint64(offset) + length + mask) & ~quint64(mask);
+
+	Job job;
+	job.operation = OP_RX;
+	job.offset = first;
+	job.length = quint32(qMin(last, memsize) - first);
+	job.skip = offset - first;
+	job.keep = length;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::blankCheck(uint8_t fill)
+{
+	if(getMemSize() == 0)
+		return rejected(ERROR_MEMID);
+
+	Job job;
+	job.operation = OP_BLANKCHECK;
+	job.offset = 0;
+	job.length = quint32(getMemSize());
+	job.fill = fill;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::fill(quint32 offset, quint32 length, uint8_t pattern, bool verify)
+{
+	const quint64 end = quint64(offset) + quint64(length);
+	if(length == 0 || offset % PKG_DATA_MAX || length % PKG_DATA_MAX
+			|| end > quint64(getMemSize()))
+		return rejected(ERROR_MEMIDX);
+
+	Job job;
+	job.operation = OP_FILL;
+	job.offset = offset;
+	job.length = length;
+	job.fill = pattern;
+	job.verify = verify;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::write(const QByteArray& image, quint32 offset)
+{
+	const quint64 end = quint64(offset) + quint64(image.size());
+	if(image.isEmpty() || offset % PKG_DATA_MAX || image.size() % PKG_DATA_MAX
+			|| end > quint64(getMemSize()))
+		return rejected(ERROR_MEMIDX);
+
+	Job job;
+	job.operation = OP_TX;
+	job.offset = offset;
+	job.length = quint32(image.size());
+	job.data = image;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::store(const QByteArray& image)
+{
+	if(image.isEmpty() || image.size() % PKG_DATA_MAX || image.size() > STORE_CAPACITY
+			|| image.size() > getMemSize())
+		return rejected(ERROR_MEMIDX);
+
+	Job job;
+	job.operation = OP_STORE;
+	job.length = quint32(image.size());
+	job.data = image;
+	return enqueue(job);
+}
+
+XferRequest MemoryComm::loopback(const QByteArray& data)
+{
+	if(data.isEmpty() || data.size() % PKG_DATA_MAX)
+		return rejected(ERROR_MEMIDX);
+
+	Job job;
+	job.operation = OP_LOOPBACK;
+	job.length = quint32(data.size());
+	job.data = data;
+	return enqueue(job);
+}
+
+// Start the next job once control is back in the event loop, so that
+// nothing runs from inside the caller or a signal handler
+void MemoryComm::scheduleNextJob()
+{
+	if(m_jobActive || m_jobScheduled || m_jobs.isEmpty())
+		return;
+	m_jobScheduled = true;
+	QMetaObject::invokeMethod(this, [this]() { startNextJob(); }, Qt::QueuedConnection);
+}
+
+void MemoryComm::startNextJob()
+{
+	m_jobScheduled = false;
+	// The writer may still be busy with the tail of the previous job,
+	// handlePackageSent() will call us again
+	if(m_jobActive || m_jobs.isEmpty() || m_txInFlight > 0)
+		return;
+
+	m_job = m_jobs.dequeue();
+	m_jobActive = true;
+	m_jobWireBytes = 0;
+	m_mismatchAt = -1;
+
+	bool sent = false;
+	switch(m_job.operation)
+	{
+	case OP_CONNECT:
+		m_operation = OP_CONNECT;
+		m_commState = COMM_INIT_WAIT;
+		sent = sendCommand(CMD_INIT);
+		break;
+	case OP_MEMID:
+		m_operation = OP_MEMID;
+		m_commState = COMM_MEMID_WAIT;
+		sent = sendCommand(CMD_MEMID, m_job.memtype);
+		break;
+	case OP_PING:
+		m_operation = OP_PING;
+		m_commState = COMM_PING_WAIT;
+		sent = sendCommand(CMD_PING);
+		break;
+	case OP_TARGETS:
+		m_operation = OP_TARGETS;
+		m_commState = COMM_TARGETS_WAIT;
+		sent = sendCommand(CMD_TARGETS, m_job.targets);
+		break;
+	case OP_CHANNEL:
+		m_operation = OP_CHANNEL;
+		m_commState = COMM_CHANNEL_WAIT;
+		sent = sendCommand(CMD_CHANNEL, m_job.targets);
+		break;
+	case OP_CHIPSTATUS:
+		m_operation = OP_CHIPSTATUS;
+		m_commState = COMM_CHIPSTATUS_WAIT;
+		sent = sendCommand(CMD_GETSTATUS);
+		break;
+	case OP_RX:
+		sent = readMem(m_job.offset, m_job.length);
+		break;
+	case OP_TX:
+	case OP_STORE:
+		sent = writeMem(m_job.data, m_job.offset);
+		break;
+	case OP_BLANKCHECK:
+		m_operation = OP_BLANKCHECK;
+		m_commState = COMM_BLANKCHECK_WAIT;
+		m_memindex = 0;
+		m_xferLength = m_job.length;
+		sent = sendSpan();
+		break;
+	case OP_FILL:
+		m_operation = OP_FILL;
+		m_commState = COMM_FILL_WAIT;
+		m_memindex = 0;
+		m_xferLength = m_job.length;
+		sent = sendSpan();
+		break;
+	case OP_LOOPBACK:
+		m_operation = OP_LOOPBACK;
+		m_commState = COMM_LOOPBACK_WAIT;
+		m_buffer.clear();
+		m_memBuffer = m_job.data;
+		m_memindex = 0;
+		m_xferLength = m_job.length;
+		sent = sendLoopbackBlock();
+		break;
+	default:
+		break;
+	}
+
+	if(!sent)
+		finishJob(ERROR_COMM);
+}
+
+void MemoryComm::finishJob(errorcode_e err, const QByteArray& data)
+{
+	if(!m_jobActive)
+		return;
+
+	if(err != ERROR_NONE)
+		stopRxTimeout();
+
+	m_commState = COMM_IDLE;
+	m_operation = OP_NONE;
+	m_pending.clear();
+
+	XferResult result{err, QByteArray(), QString(), m_jobWireBytes, m_mismatchAt};
+	if(err == ERROR_NONE && m_job.operation == OP_RX)
+		result.data = data.mid(int(m_job.skip), int(m_job.keep));
+	else if(err == ERROR_NONE && m_job.operation == OP_CHIPSTATUS)
+		result.data = data;
+
+	auto state = m_job.state;
+	m_job = Job();
+	m_jobActive = false;
+
+	// Resume the caller from the event loop, before the next job starts
+	QMetaObject::invokeMethod(this, [state, result]() {
+		state->complete(result);
+	}, Qt::QueuedConnection);
+
+	scheduleNextJob();
+}
+
+bool MemoryComm::readMem(quint32 offset, quint32 length) {
 
 	m_buffer.clear();
 
 	m_operation = OP_RX;
 	m_commState = COMM_READMEM_WAIT_OK;
+	m_xferLength = length;
+
+	const commands_e cmd = m_serialPortOptions.compression ? CMD_READMEM_RLE : CMD_READMEM;
+	return sendCommand(cmd, xferRequest(m_job.memtype, offset, length));
+}
 
-	return sendCommand(CMD_READMEM, m_memtype);
+// Blank checks and fills go in spans so each answer comes within the RX
+// timeout, whatever the chip size: a few bytes every span.
+quint32 MemoryComm::spanLength() const
+{
+	const quint32 span = m_operation == OP_FILL ? FILL_SPAN : BLANKCHECK_SPAN;
+	return qMin<quint32>(span, m_xferLength - m_memindex);
+}
+
+bool MemoryComm::sendSpan()
+{
+	const quint32 offset = m_job.offset + m_memindex;
+	if(m_operation == OP_FILL)
+		return sendCommand(CMD_FILL, fillRequest(m_job.memtype, offset, spanLength(),
+												 m_job.fill, m_job.verify));
+	return sendCommand(CMD_BLANKCHECK, blankCheckRequest(m_job.memtype, offset,
+														 spanLength(), m_job.fill));
 }
 
-bool MemoryComm::writeMem(const QByteArray& memBuffer) {
+// A read block into m_buffer, CMD_MEMDATA_RLE expanded right there.
+// false if it doesn't decode to a whole block.
+bool MemoryComm::appendBlock(package_t *pkg)
+{
+	if(pkg->cmd == CMD_MEMDATA) {
+		m_buffer.append((char*)(pkg->data), pkg->datalen);
+		return true;
+	}
+
+	const qsizetype at = m_buffer.size();
+	m_buffer.resize(at + PKG_DATA_MAX);
+	const int n = pkg->datalen > 0
+			? PackBits::decode(pkg->data + 1, pkg->datalen - 1, (uint8_t*)(m_buffer.data() + at), PKG_DATA_MAX)
+			: -1;
+	if(n != PKG_DATA_MAX) {
+		m_buffer.resize(at);
+		return false;
+	}
+	return true;
+}
+
+bool MemoryComm::writeMem(const QByteArray& memBuffer, quint32 offset) {
 
 	m_operation = OP_TX;
 	m_commState = COMM_WRITEMEM_WAIT_OK;
 	m_memindex = 0;
+	m_xferLength = quint32(memBuffer.size());
 	m_memBuffer = memBuffer; // CHECK HOW THIS WORKS
 
-	m_buffer.clear();
-	m_serialPortReader.clearBuffer();
-	m_serialPort.clear(QSerialPort::Input);
+	clearBuffers();
 
-	return sendCommand(CMD_WRITEMEM, m_memtype);
+	// The blocks of a store go the same way, into the programmer's flash
+	const commands_e cmd = m_job.operation == OP_STORE ? CMD_STORE : CMD_WRITEMEM;
+	return sendCommand(cmd, xferRequest(m_job.memtype, offset, m_xferLength));
 }
 
 bool MemoryComm::sendMemoryBlock() {
-	int memidx = m_memindex;
+	quint32 memidx = m_memindex;
 	m_memindex += PKG_DATA_MAX;
 
-	return sendCommand(CMD_MEMDATA, m_memBuffer.mid(memidx, PKG_DATA_MAX));
-}
-
-bool MemoryComm::sendCommand_memid() {
-	return sendCommand(CMD_MEMID, m_memtype);
+	const QByteArray block = m_memBuffer.mid(memidx, PKG_DATA_MAX);
+	m_stats.addPayload(block.size());
+	if(m_serialPortOptions.compression) {
+		// Raw unless it saves something, length byte included
+		const QByteArray packed = PackBits::encode(block);
+		if(packed.size() + 1 < block.size())
+			return sendCommand(CMD_MEMDATA_RLE, QByteArray(1, char(packed.size())) + packed);
+	}
+	return sendCommand(CMD_MEMDATA, block);
 }
 
-
-bool MemoryComm::sendCommand_ping(void) {
-	return sendCommand(CMD_PING);
+bool MemoryComm::sendLoopbackBlock()
+{
+	const QByteArray block = m_memBuffer.mid(m_memindex, PKG_DATA_MAX);
+	m_memindex += PKG_DATA_MAX;
+	return sendCommand(CMD_LOOPBACK, block);
 }
 
 void MemoryComm::handleRxCrcError()
 {
+	m_stats.countCrcError();
 	// see m_lastRxCmd and m_lastTxCmd
 }
 
-void MemoryComm::reconnect(void) {
-/*	m_serialPort.close();
-	if (!m_serialPort.open(QIODevice::ReadWrite)) {
-		m_standardOutput << "Unable to open serial port. Aborting." << Qt::endl;
-		QCoreApplication::exit(1);
-	}*/
-}
-
 void MemoryComm::handleRxTimedOut() {
 
-	// chequear si no estaba esperando nada no le des bola a este timeout
+	m_stats.countTimeout();
 
 	if(m_operation == OP_RX) {
 		m_standardOutput << "Reading from memory timed out." << Qt::endl;
-		reconnect();
 	}
 	else if(m_operation == OP_TX) {
 		m_standardOutput << "Writing to memory timed out." << Qt::endl;
-		reconnect();
 	}
 	else {
-		m_standardOutput << "RX timed out." << Qt::endl;
+		qDebug() << "RX timed out.";
 	}
-	m_operation = OP_NONE;
+	finishJob(ERROR_TIMEOUT);
 }
 
+// Unexpected answer: end the job with the uC error, if it sent one
 void MemoryComm::errorReceived(package_t *pkg)
 {
-	if(pkg->cmd == CMD_ERR) {
-		m_standardOutput << "ReadMem: uC error: "
-						 << EEPROM::getErrorMsg(errorcode_e(pkg->data[0]))
-						 << Qt::endl;
-	}
-	m_commState = COMM_IDLE;
-	m_operation = OP_NONE;
-	// forward error to application
-	packageReady(pkg);
+	errorcode_e err = ERROR_COMM;
+	if(pkg->cmd == CMD_ERR && pkg->datalen > 0)
+		err = errorcode_e(pkg->data[0]);
+	finishJob(err == ERROR_NONE ? ERROR_UNKNOWN : err);
 }
 
 void MemoryComm::handlePackageReceived(package_t *pkg)
 {
 	qDebug() << "Received command" << EEPROM::getCommandName(pkg->cmd);
 
+	if(m_trace)
+		m_trace->record(TraceRecord::DEVICE_TO_HOST, pkg->cmd,
+						QByteArray((const char*)(pkg->data), pkg->datalen));
+	m_stats.answerReceived(pkg->cmd, PKG_MINSIZE + pkg->datalen);
+	m_jobWireBytes += PKG_MINSIZE + pkg->datalen;
+
 	if(!CRC16::check(pkg))
 	{
 		handleRxCrcError();
@@ -236,8 +652,59 @@ void MemoryComm::handlePackageReceived(package_t *pkg)
 		switch(m_commState)
 		{
 		case COMM_IDLE: // not in transfer
-			// just forward package to application
-			packageReady(pkg);
+			qDebug() << "Ignoring unexpected" << EEPROM::getCommandName(pkg->cmd);
+			break;
+
+		case COMM_INIT_WAIT:
+			if(pkg->cmd == CMD_INIT && m_job.initOnly) {
+				finishJob(ERROR_NONE);
+			}
+			else if(pkg->cmd == CMD_INIT) {
+				m_commState = COMM_MEMID_WAIT;
+				if(!sendCommand(CMD_MEMID, m_job.memtype))
+					finishJob(ERROR_COMM);
+			}
+			else {
+				errorReceived(pkg);
+			}
+			break;
+
+		case COMM_MEMID_WAIT:
+		case COMM_PING_WAIT:
+			if((m_commState == COMM_MEMID_WAIT && pkg->cmd == CMD_OK)
+					|| (m_commState == COMM_PING_WAIT && pkg->cmd == CMD_TXRX_ACK))
+				finishJob(ERROR_NONE);
+			else
+				errorReceived(pkg);
+			break;
+
+		case COMM_TARGETS_WAIT:
+		case COMM_CHANNEL_WAIT:
+			if(pkg->cmd == CMD_OK)
+				finishJob(ERROR_NONE);
+			else
+				errorReceived(pkg);
+			break;
+
+		case COMM_LOOPBACK_WAIT:
+			if(pkg->cmd == CMD_LOOPBACK) {
+				m_buffer.append(reinterpret_cast<const char*>(pkg->data), pkg->datalen);
+				m_stats.addPayload(pkg->datalen);
+				if(quint32(m_buffer.size()) >= m_xferLength)
+					finishJob(ERROR_NONE, m_buffer);
+				else if(!sendLoopbackBlock())
+					finishJob(ERROR_COMM);
+			}
+			else {
+				errorReceived(pkg);
+			}
+			break;
+
+		case COMM_CHIPSTATUS_WAIT:
+			if(pkg->cmd == CMD_CHIPSTATUS)
+				finishJob(ERROR_NONE, QByteArray(reinterpret_cast<const char*>(pkg->data), pkg->datalen));
+			else
+				errorReceived(pkg);
 			break;
 
 		case COMM_READMEM_WAIT_OK: // readmem sent, waiting confirmation
@@ -251,21 +718,24 @@ void MemoryComm::handlePackageReceived(package_t *pkg)
 			break;
 
 		case COMM_READMEM_WAIT_DATA:
-			if(pkg->cmd == CMD_MEMDATA)
+			if(pkg->cmd == CMD_MEMDATA || pkg->cmd == CMD_MEMDATA_RLE)
 			{
-				m_buffer.append((char*)(pkg->data), pkg->datalen);
-				qDebug("Received %lld bytes out of %d", m_buffer.size(), m_memsize);
-				if(m_buffer.size() < m_memsize) {
+				const qint64 before = m_buffer.size();
+				if(!appendBlock(pkg)) {
+					// Corrupted on the way, the firmware sends it again
+					m_stats.countCrcError();
+					sendCommand(CMD_TXRX_ERR);
+					break;
+				}
+				m_stats.addPayload(m_buffer.size() - before);
+				qDebug("Received %lld bytes out of %u", qint64(m_buffer.size()), m_xferLength);
+				if(m_buffer.size() < m_xferLength) {
 					sendCommand(CMD_TXRX_ACK);
 					m_pending.append(CMD_READNEXT);
 				}
 				else {
-					m_commState = COMM_IDLE;
-					m_operation = OP_NONE;
 					sendCommand(CMD_TXRX_DONE);
-					pkg->data = (uint8_t*)(m_buffer.data());
-					pkg->datalen = m_buffer.size();
-					packageReady(pkg);
+					finishJob(ERROR_NONE, m_buffer);
 				}
 			}
 			else {
@@ -282,26 +752,40 @@ void MemoryComm::handlePackageReceived(package_t *pkg)
 				errorReceived(pkg);
 			}
 			break;
+
+		case COMM_BLANKCHECK_WAIT:
+		case COMM_FILL_WAIT:
+			if(pkg->cmd == CMD_OK) {
+				m_stats.addPayload(spanLength());
+				m_memindex += spanLength();
+				if(m_memindex >= m_xferLength)
+					finishJob(ERROR_NONE);
+				else if(!sendSpan())
+					finishJob(ERROR_COMM);
+			}
+			else if(pkg->cmd == CMD_NOTBLANK && pkg->datalen == 4) {
+				// Not blank is an answer, a fill that didn't take a failure
+				m_mismatchAt = qint64(get_u32(pkg->data));
+				finishJob(m_commState == COMM_FILL_WAIT ? ERROR_WRITEMEM : ERROR_NONE);
+			}
+			else {
+				errorReceived(pkg);
+			}
+			break;
+
 		case COMM_WRITEMEM_WAIT_ACK:
-			qDebug("Sent %d bytes out of %d", m_memindex, m_memsize);
+			qDebug("Sent %u bytes out of %u", m_memindex, m_xferLength);
 			if(pkg->cmd == CMD_TXRX_ACK) {
-				if(m_memindex >= m_memsize) {
+				if(m_memindex >= m_xferLength) {
 					// uC is doing some unintelligent thing
-					setPackageError(pkg, ERROR_MEMIDX);
-					errorReceived(pkg);
+					finishJob(ERROR_MEMIDX);
 				}
-				else {
-					if(!sendMemoryBlock()) {
-						setPackageError(pkg, ERROR_COMM);
-						errorReceived(pkg);
-					}
+				else if(!sendMemoryBlock()) {
+					finishJob(ERROR_COMM);
 				}
 			}
-			else if(pkg->cmd == CMD_TXRX_DONE && m_memindex == m_memsize) {
-
-				m_commState = COMM_IDLE;
-				m_operation = OP_NONE;
-				packageReady(pkg);
+			else if(pkg->cmd == CMD_TXRX_DONE && m_memindex == m_xferLength) {
+				finishJob(ERROR_NONE);
 			}
 			else {
 				errorReceived(pkg);
@@ -314,23 +798,6 @@ void MemoryComm::handlePackageReceived(package_t *pkg)
 }
 // TODO: split in methods.
 
-void MemoryComm::setPackageError(package_t *pkg, errorcode_e err)
-{
-	pkg->cmd = CMD_ERR;
-	pkg->datalen = 1;
-	m_buffer[0] = err;
-	pkg->data = (uint8_t*)(m_buffer.data());
-}
-
-void MemoryComm::packageReady(package_t *pkg)
-{
-	m_pkg.cmd = pkg->cmd;
-	QByteArray data((char*)(pkg->data), pkg->datalen);
-	m_pkg.data = data;
-
-	handleXfer(&m_pkg);
-}
-
 void MemoryComm::handlePackageSent(commands_e cmd)
 {
 	qDebug() << "Finished sending command: " << EEPROM::getCommandName(cmd);
@@ -341,10 +808,14 @@ void MemoryComm::handlePackageSent(commands_e cmd)
 		sendCommand(commands_e(command));
 		// TODO: this doesn't account for command data
 	}
+	else {
+		scheduleNextJob();
+	}
 }
 
-// when we send <cmd>, expect an answer in X time
-void MemoryComm::setRxTimeout(commands_e cmd)
+// when we send <cmd>, expect an answer in X time.
+// 0 stops the timeout, -1 leaves it as it is.
+int MemoryComm::rxTimeout(commands_e cmd)
 {
 	switch(cmd)
 	{
@@ -355,33 +826,86 @@ void MemoryComm::setRxTimeout(commands_e cmd)
 		break;
 
 	case CMD_INIT:
-		m_serialPortReader.startRxTimeout(2000);
-		break;
+		return 2000;
 	case CMD_PING:
 	case CMD_MEMID:
 	case CMD_DATA:
-		m_serialPortReader.startRxTimeout(200);
-		break;
+	case CMD_TARGETS:	/* probes CHIPS_MAX chips at most */
+	case CMD_GETSTATUS:
+	case CMD_CHANNEL:
+		return 200;
 
 	case CMD_DISCONNECT:
 	case CMD_OK:
 	case CMD_ERR:
 	case CMD_TXRX_DONE:
-		m_serialPortReader.stopRxTimeout();
-		break;
+	case CMD_NOTBLANK:
+	case CMD_CHIPSTATUS:
+		return 0;
 
 	case CMD_TXRX_ACK:
 	case CMD_TXRX_ERR:
 	case CMD_READNEXT:
 	case CMD_MEMDATA:
+	case CMD_MEMDATA_RLE:
 	case CMD_INFO:
-		m_serialPortReader.startRxTimeout(1500);
-		break;
+	case CMD_LOOPBACK:
+		return 1500;
 
 	case CMD_READMEM:
+	case CMD_READMEM_RLE:
 	case CMD_WRITEMEM:
-		m_serialPortReader.startRxTimeout(7000);
-		break;
+	case CMD_STORE:			/* erases a flash page */
+	case CMD_BLANKCHECK:	/* a BLANKCHECK_SPAN at 100 kHz is ~3 s */
+	case CMD_FILL:			/* a verified FILL_SPAN on an X24645 is ~4 s */
+		return 7000;
 	// TODO: check all this timing thing
 	}
+	return -1;
+}
+
+// A timeout already on its way from the I/O thread no longer counts
+void MemoryComm::stopRxTimeout()
+{
+	++m_timeoutSeq;
+	IoRequest request;
+	request.kind = IoRequest::STOP_TIMEOUT;
+	m_io->post(request);
+}
+
+void MemoryComm::handleIoEvents()
+{
+	m_io->rearm();
+
+	IoEvent event;
+	while(m_io->takeEvent(event)) {
+		switch(event.kind)
+		{
+		case IoEvent::PACKAGE: {
+			package_t pkg = {};
+			pkg.cmd = event.cmd;
+			pkg.datalen = uint16_t(event.data.size());
+			pkg.crc = event.crc;
+			pkg.data = reinterpret_cast<uint8_t*>(event.data.data());
+			handlePackageReceived(&pkg);
+			break;
+		}
+		case IoEvent::SENT:
+			m_txInFlight = qMax(0, m_txInFlight - 1);
+			handlePackageSent(event.cmd);
+			break;
+		case IoEvent::SEND_FAILED:
+			m_txInFlight = qMax(0, m_txInFlight - 1);
+			qDebug() << "Error sending command" << EEPROM::getCommandName(event.cmd);
+			finishJob(ERROR_COMM);
+			break;
+		case IoEvent::TIMEOUT:
+			if(event.seq == m_timeoutSeq)
+				handleRxTimedOut();
+			break;
+		case IoEvent::IO_ERROR:
+			emit portError();
+			break;
+		}
+	}
 }
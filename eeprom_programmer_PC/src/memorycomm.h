@@ -2,34 +2,45 @@
 #define MEMORYCOMM_H
 
 #include "eeprom.h"
-#include "serialportreader.h"
-#include "serialportwriter.h"
+#include "serialportio.h"
+#include "sessionstats.h"
+#include "trace.h"
+#include "xferrequest.h"
+#include <QObject>
+#include <QQueue>
 #include <QSerialPort>
-#include <QCoreApplication>
+#include <QThread>
+
+#include <functional>
 
 #ifdef _WIN32
-#include "signalhandler.h"
 #define SERIALPORTNAME "COM0"
 #else
 #define SERIALPORTNAME "ttyACM0"
 #endif
 
 
+/*
+ * One programmer session: runs the transfer protocol on whatever thread
+ * the object lives in, while the serial port and its reader / writer run
+ * on an I/O thread of the session's own (see SerialPortIo).
+ * Several sessions can coexist in the same process.
+ *
+ * Work is submitted as jobs: each call below queues one and returns an
+ * XferRequest right away. Jobs run one at a time, in the order they were
+ * queued, so callers never have to guard against overlapping transfers.
+ * A job works on the memory that was the target when it was queued.
+ *
+ *     XferResult r = co_await session.readRange(0, 0x100);
+ */
 class MemoryComm
-		: public QCoreApplication
+		: public QObject
 		, public EEPROM
-#ifdef _WIN32
-		, public SignalHandler
-#endif
 {
 	Q_OBJECT
 public:
-	explicit MemoryComm(int &argc, char **argv, FILE* outStream);
+	explicit MemoryComm(FILE* outStream = stdout, QObject *parent = nullptr);
 	~MemoryComm();
-	bool handleSignal(int signal);
-
-	SerialPortWriter& getSerialPortWriter(void) {return m_serialPortWriter;};
-	SerialPortReader& getSerialPortReader(void) {return m_serialPortReader;};
 
 	struct SerialPortOptions {
 		QString name							= SERIALPORTNAME;
@@ -38,56 +49,160 @@ public:
 		QSerialPort::Parity parity				= QSerialPort::NoParity;
 		QSerialPort::StopBits stopbits			= QSerialPort::OneStop;
 		QSerialPort::FlowControl flowcontrol	= QSerialPort::NoFlowControl;
+		transport_e transport					= TRANSPORT_QT;
+		// Write blocks as CMD_MEMDATA_RLE when that's shorter, firmware
+		// without that command needs it off
+		bool compression						= true;
 	};
 
 	enum operations_e {
 		OP_NONE = CMD_NONE,
+		OP_CONNECT = CMD_INIT,
+		OP_MEMID = CMD_MEMID,
 		OP_PING = CMD_PING,
 		OP_TX = CMD_WRITEMEM,
-		OP_RX = CMD_READMEM
+		OP_RX = CMD_READMEM,
+		OP_BLANKCHECK = CMD_BLANKCHECK,
+		OP_FILL = CMD_FILL,
+		OP_TARGETS = CMD_TARGETS,
+		OP_CHIPSTATUS = CMD_GETSTATUS,
+		OP_CHANNEL = CMD_CHANNEL,
+		OP_STORE = CMD_STORE,
+		OP_LOOPBACK = CMD_LOOPBACK
 	};
 
 	enum comm_states_e {
 		COMM_IDLE,
+		COMM_INIT_WAIT,
+		COMM_MEMID_WAIT,
+		COMM_PING_WAIT,
 		COMM_READMEM_WAIT_OK,
 		COMM_READMEM_WAIT_DATA,
 		COMM_WRITEMEM_WAIT_OK,
-		COMM_WRITEMEM_WAIT_ACK
+		COMM_WRITEMEM_WAIT_ACK,
+		COMM_BLANKCHECK_WAIT,
+		COMM_FILL_WAIT,
+		COMM_TARGETS_WAIT,
+		COMM_CHIPSTATUS_WAIT,
+		COMM_CHANNEL_WAIT,
+		COMM_LOOPBACK_WAIT
 	};
 
-protected:
-	void setSerialPortOptions(SerialPortOptions& op);
-
-	bool writeMem(const QByteArray& memBuffer);
-	bool readMem(void);
-	bool sendCommand_ping(void);
-	bool sendCommand_memid(void);
-	bool sendCommand(commands_e cmd);
-	bool sendCommand(commands_e cmd, uint8_t data);
-	bool sendCommand(commands_e cmd, const QByteArray& data);
+	void setSerialPortOptions(const SerialPortOptions& op);
+	const SerialPortOptions &getSerialPortOptions(void) const {return m_serialPortOptions;};
+
+	// Talk through another device instead of the serial port,
+	// e.g. a TraceReplayDevice. The session doesn't take ownership.
+	// The device is used from the session's thread, not the I/O one.
+	void setDevice(QIODevice *device);
+	// Log every package to recorder (not owned), nullptr to stop
+	void setTraceRecorder(TraceRecorder *recorder) {m_trace = recorder;};
+
+	SessionStats &stats(void) {return m_stats;};
+	const SessionStats &stats(void) const {return m_stats;};
+
+	bool open(void);
+	void close(void);
+	bool isOpen(void) const;
+	QString errorString(void) const;
+
+	// INIT handshake followed by MEMID with the selected target
+	XferRequest connectDevice(void);
+	// INIT handshake only: is there a programmer on the other end?
+	XferRequest probe(void);
+	// MEMID only, on a connected device: another chip in the socket.
+	// Also makes type the target of the jobs queued after this one.
+	XferRequest selectMemory(memtype_e type);
+	XferRequest ping(void);
+	// Any range inside the memory
+	XferRequest readRange(quint32 offset, quint32 length);
+	XferRequest readAll(void);
+	// offset and image size must be multiple of PKG_DATA_MAX
+	XferRequest write(const QByteArray& image, quint32 offset = 0);
+	// Is the whole memory fill? Done by the uC, see XferResult::mismatchAt.
+	XferRequest blankCheck(uint8_t fill = 0xFF);
+	// Written by the uC, nothing but the request crosses the link. Same
+	// rules as write(); verify makes the uC read it back (ERROR_WRITEMEM
+	// and XferResult::mismatchAt if it didn't take).
+	XferRequest fill(quint32 offset, quint32 length, uint8_t pattern = 0xFF, bool verify = false);
+	// Multi-chip fixtures: bit n of mask writes the chip strapped as n
+	// too, 0 goes back to one chip. Written blocks go to all of them, page
+	// writes interleaved; reads and the rest use the first one still good.
+	// Reset by a MEMID, connectDevice() and selectMemory() included.
+	XferRequest selectTargets(quint8 mask);
+	// In data: the mask, then an errorcode_e per chip since selectTargets()
+	XferRequest chipStatus(void);
+	// Programmers with a socket per I2C bus: bit n of mask selects the
+	// socket of channel n. Written blocks go to all of them at the same
+	// time, the rest to the first one. Needs a MEMID first, the other
+	// sockets take the same memory type; connectDevice() goes back to 1.
+	XferRequest selectChannels(quint8 mask);
+	// Image for the programmer to write on its own, chip after chip, each
+	// time its START input goes low. Replaces the one it had; goes to
+	// the channels selected now. Up to STORE_CAPACITY, the rest of the
+	// memory is written blank.
+	XferRequest store(const QByteArray& image);
+	// Sends data a block at a time and waits for the uC to echo each one,
+	// no chip involved: the USB link alone. The echoes come back in data.
+	// Size must be a multiple of PKG_DATA_MAX.
+	XferRequest loopback(const QByteArray& data);
+
+	int pendingJobs(void) const {return m_jobs.size() + (m_jobActive ? 1 : 0);};
 
 	void clearBuffers(void);
 
-	void reconnect(void);
-	virtual void handleXfer(pkgdata_t *pkg) = 0;
+signals:
+	/* The port failed and the session can't go on */
+	void portError(void);
 
 private:
+	struct Job {
+		operations_e operation = OP_NONE;
+		quint32 offset = 0;		/* memory range on the wire */
+		quint32 length = 0;
+		quint32 skip = 0;		/* bytes of a read the caller didn't ask for */
+		quint32 keep = 0;
+		bool initOnly = false;	/* OP_CONNECT without MEMID */
+		uint8_t fill = 0xFF;	/* OP_BLANKCHECK, OP_FILL */
+		bool verify = false;	/* OP_FILL */
+		quint8 targets = 0;		/* OP_TARGETS, OP_CHANNEL */
+		memtype_e memtype = MEMTYPE_NONE;	/* target when queued */
+		QByteArray data;
+		std::shared_ptr<XferRequest::State> state;
+	};
+
+	XferRequest enqueue(Job job);
+	XferRequest rejected(errorcode_e err);
+	void scheduleNextJob(void);
+	void startNextJob(void);
+	void finishJob(errorcode_e err, const QByteArray& data = QByteArray());
+
 	void setSignals();
-	void packageReady(package_t *pkg);
+	bool writeMem(const QByteArray& memBuffer, quint32 offset);
+	bool readMem(quint32 offset, quint32 length);
 	bool sendMemoryBlock();
-	void setPackageError(package_t *pkg, errorcode_e err);
-
-signals:
+	bool sendLoopbackBlock(void);
+	bool appendBlock(package_t *pkg);
+	bool sendSpan(void);
+	quint32 spanLength(void) const;
+	bool sendCommand(commands_e cmd);
+	bool sendCommand(commands_e cmd, uint8_t data);
+	bool sendCommand(commands_e cmd, const QByteArray& data);
+	void stopRxTimeout(void);
+	static int rxTimeout(commands_e cmd);
+	// Run f on the I/O thread and wait for it
+	void callIo(const std::function<void()> &f) const;
+	// Move m_io to the thread its transport runs on
+	void placeIo(void);
 
 private slots:
+	void handleIoEvents(void);
 	void handlePackageReceived(package_t *pkg);
-	void setRxTimeout(commands_e);
 	void handleRxTimedOut(void);
 
 	void handleRxCrcError(void);
 
 	void handlePackageSent(commands_e cmd);
-	void handleAppQuit(void);
 
 
 	// Member variables definitions:
@@ -96,25 +211,34 @@ private:
 	commands_e m_lastRxCmd = CMD_NONE;
 	QByteArray m_buffer;
 	QByteArray m_memBuffer;
-	int m_memindex = 0;
-	pkgdata_t m_pkg;
+	quint32 m_memindex = 0;	/* bytes sent, relative to the transfer start */
+	quint32 m_xferLength = 0;	/* bytes to be transferred */
 
 	operations_e m_operation = OP_NONE;
 	comm_states_e m_commState = COMM_IDLE;
 
 	QByteArray m_pending;
 
+	QQueue<Job> m_jobs;
+	Job m_job;					/* the one on the wire */
+	bool m_jobActive = false;
+	bool m_jobScheduled = false;
+	qint64 m_jobWireBytes = 0;	/* of m_job, both ways */
+	qint64 m_mismatchAt = -1;	/* of m_job, if a blank check or fill */
+
 	void errorReceived(package_t *pkg);
 
-protected:
 	QTextStream m_standardOutput;
 
-	QSerialPort m_serialPort;
 	SerialPortOptions m_serialPortOptions;
-	// Create Writer and Reader classes as members,
-	// since they can't be child classes
-	SerialPortWriter m_serialPortWriter;
-	SerialPortReader m_serialPortReader;
+	TraceRecorder *m_trace = nullptr;
+	SessionStats m_stats;
+
+	QThread m_ioThread;
+	SerialPortIo *m_io;			/* lives in m_ioThread, unless replaying or on io_uring */
+	bool m_replaying = false;
+	int m_txInFlight = 0;		/* frames posted and not written yet */
+	quint32 m_timeoutSeq = 0;	/* of the RX timeout that counts */
 };
 
 #endif // MEMORYCOMM_H
@@ -0,0 +1,246 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Microbenchmarks for the code that runs once per byte or per block on
+ * the PC side: package parsing and building, CRC16, the hex dump of -r,
+ * the block slicing of a write and its PackBits compression. Each one
+ * is timed in ns per byte it handles, best of RUNS.
+ */
+
+#include "crc16.h"
+#include "eeprom.h"
+#include "packageparser.h"
+#include "packbits.h"
+#include "serialportwriter.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QTextStream>
+
+#include <functional>
+#include <limits>
+
+#define RUNS 5
+#define MIN_RUN_NS 100000000LL	/* 100 ms */
+
+// Keeps the compiler from dropping the work
+static volatile quint64 sink;
+
+static QByteArray randomBytes(int size)
+{
+	QRandomGenerator random(1);
+	QByteArray data(size, 0);
+	for(int i = 0; i < size; ++i)
+		data[i] = char(random.generate());
+	return data;
+}
+
+// What the programmer sends back for a read: MEMDATA blocks
+static QByteArray memdataStream(int blocks)
+{
+	const QByteArray image = randomBytes(blocks * PKG_DATA_MAX);
+	QByteArray stream;
+	for(int i = 0; i < blocks; ++i)
+		stream.append(SerialPortWriter::buildPackage(CMD_MEMDATA, image.mid(i * PKG_DATA_MAX, PKG_DATA_MAX)));
+	return stream;
+}
+
+// What it sends during a write: one ACK per block
+static QByteArray ackStream(int packages)
+{
+	QByteArray stream;
+	for(int i = 0; i < packages; ++i)
+		stream.append(SerialPortWriter::buildPackage(CMD_TXRX_ACK, QByteArray()));
+	return stream;
+}
+
+class MicroBench
+{
+public:
+	explicit MicroBench(const QString &filter) : m_filter(filter), m_out(stdout) {};
+
+	// f handles bytes bytes per call
+	void run(const QString &name, qint64 bytes, const std::function<void(void)> &f);
+
+	const QJsonArray &results(void) const {return m_results;};
+
+private:
+	QString m_filter;
+	QTextStream m_out;
+	QJsonArray m_results;
+};
+
+void MicroBench::run(const QString &name, qint64 bytes, const std::function<void(void)> &f)
+{
+	if(!name.contains(m_filter))
+		return;
+
+	// Enough calls to fill MIN_RUN_NS
+	QElapsedTimer timer;
+	qint64 calls = 1;
+	qint64 ns;
+	for(;;) {
+		timer.start();
+		for(qint64 i = 0; i < calls; ++i)
+			f();
+		ns = timer.nsecsElapsed();
+		if(ns >= MIN_RUN_NS / 10)
+			break;
+		calls *= 2;
+	}
+	calls = qMax<qint64>(1, calls * MIN_RUN_NS / qMax<qint64>(ns, 1));
+
+	double best = std::numeric_limits<double>::max();
+	for(int run = 0; run < RUNS; ++run) {
+		timer.start();
+		for(qint64 i = 0; i < calls; ++i)
+			f();
+		best = qMin(best, double(timer.nsecsElapsed()) / double(calls * bytes));
+	}
+
+	m_out << QString("%1 %2 ns/byte %3 MB/s")
+			 .arg(name, -36).arg(best, 9, 'f', 3).arg(1000.0 / best, 9, 'f', 1) << Qt::endl;
+
+	QJsonObject json;
+	json["name"] = name;
+	json["bytes"] = bytes;
+	json["ns_per_byte"] = best;
+	m_results.append(json);
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("EEPROM Programmer microbenchmarks");
+	QCoreApplication::setApplicationVersion("1.0.0");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Times the per byte and per block hot paths of the PC side.");
+	parser.addHelpOption();
+	parser.addVersionOption();
+	parser.addOptions({
+			{"filter",
+							"Only run the benchmarks whose name contains <text>.", "text"},
+			{"json",
+							"Also write the results to <file> as JSON.", "file"},
+		});
+	parser.process(app);
+
+	MicroBench bench(parser.value("filter"));
+
+	// SerialPortReader::processRx(): the package parser, fed the way the
+	// port hands bytes over. 64 is a full speed USB packet.
+	const QByteArray readStream = memdataStream(64);
+	const QByteArray writeStream = ackStream(512);
+	const QList<int> bursts = {1, 64, 512, 4096};
+	for(int burst : bursts) {
+		for(const QByteArray *stream : {&readStream, &writeStream}) {
+			const QString name = QString("parse/%1/burst%2")
+					.arg(stream == &readStream ? "memdata" : "ack").arg(burst);
+			bench.run(name, stream->size(), [stream, burst]() {
+				PackageParser parser;
+				QByteArray in;
+				quint64 packages = 0;
+				for(int i = 0; i < stream->size(); i += burst) {
+					in.append(stream->constData() + i, qMin(burst, int(stream->size()) - i));
+					while(parser.parse(in))
+						++packages;
+				}
+				sink = sink + packages;
+			});
+		}
+	}
+
+	// SerialPortWriter::sendPackage(): frame assembly
+	const QByteArray block = randomBytes(PKG_DATA_MAX);
+	const QByteArray request = EEPROM::xferRequest(MEMTYPE_24LC256, 0, 0x8000);
+	bench.run("build/memdata", block.size() + PKG_MINSIZE, [&block]() {
+		sink = sink + SerialPortWriter::buildPackage(CMD_MEMDATA, block).size();
+	});
+	bench.run("build/readmem", request.size() + PKG_MINSIZE, [&request]() {
+		sink = sink + SerialPortWriter::buildPackage(CMD_READMEM, request).size();
+	});
+	bench.run("build/ack", PKG_MINSIZE, []() {
+		sink = sink + SerialPortWriter::buildPackage(CMD_TXRX_ACK, QByteArray()).size();
+	});
+
+	// CRC16 over a request, a block and a whole page of blocks
+	for(int size : {XFER_REQUEST_SIZE, PKG_DATA_MAX, 4096}) {
+		const QByteArray data = randomBytes(size);
+		bench.run(QString("crc16/%1").arg(size), size, [data]() {
+			sink = sink + CRC16::gen(data);
+		});
+	}
+
+	// App::printData(): hex dump of the smallest and largest chip
+	for(memtype_e type : {MEMTYPE_24LC16, MEMTYPE_24LC256}) {
+		const QByteArray image = randomBytes(int(EEPROM::getMemSize(type)));
+		bench.run(QString("hexdump/%1").arg(image.size()), image.size(), [image]() {
+			sink = sink + EEPROM::hexDump(image).size();
+		});
+	}
+
+	// MemoryComm::sendMemoryBlock(): slicing a write image into blocks,
+	// alone and followed by the framing
+	const QByteArray image = randomBytes(int(EEPROM::getMemSize(MEMTYPE_24LC256)));
+	bench.run("slice/mid", image.size(), [&image]() {
+		for(int i = 0; i < image.size(); i += PKG_DATA_MAX)
+			sink = sink + image.mid(i, PKG_DATA_MAX).size();
+	});
+	bench.run("slice/mid+build", image.size(), [&image]() {
+		for(int i = 0; i < image.size(); i += PKG_DATA_MAX)
+			sink = sink + SerialPortWriter::buildPackage(CMD_MEMDATA, image.mid(i, PKG_DATA_MAX)).size();
+	});
+
+	// MemoryComm::sendMemoryBlock() with compression: PackBits of a block
+	// that doesn't pay (random) and of a blank one
+	const QByteArray blank(PKG_DATA_MAX, char(0xFF));
+	for(const QByteArray *data : {&block, &blank}) {
+		const QString kind = data == &block ? "random" : "blank";
+		bench.run("packbits/encode/" + kind, data->size(), [data]() {
+			sink = sink + PackBits::encode(*data).size();
+		});
+		const QByteArray packed = PackBits::encode(*data);
+		bench.run("packbits/decode/" + kind, data->size(), [packed]() {
+			uint8_t out[PKG_DATA_MAX];
+			sink = sink + quint64(PackBits::decode(reinterpret_cast<const uint8_t*>(packed.constData()),
+												  int(packed.size()), out, PKG_DATA_MAX));
+		});
+	}
+
+	if(parser.isSet("json")) {
+		QFile file(parser.value("json"));
+		if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+			QTextStream(stderr) << "Error: could not write " << file.fileName() << Qt::endl;
+			return 1;
+		}
+		QJsonObject json;
+		json["runs"] = RUNS;
+		json["results"] = bench.results();
+		file.write(QJsonDocument(json).toJson());
+	}
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "packageparser.h"
+#include "crc16.h"
+
+
+void PackageParser::clear()
+{
+	m_state = 0;
+	m_pkgData.clear();
+}
+
+bool PackageParser::parse(QByteArray &in)
+{
+	while(!in.isEmpty())
+	{
+		uint8_t byte;
+		switch(m_state)
+		{
+		case 0: /* <STX> */
+			byte = in[0];
+			in.remove(0,1);
+			if(byte == CMD_STARTXFER)
+				++m_state;
+			break;
+
+		case 1: /* <COMMAND> */
+			byte = in[0];
+			m_pkg.cmd = static_cast<commands_e>(char(byte));
+			in.remove(0,1);
+			m_pkgData.clear();
+			m_varlen = EEPROM::cmdHasData(m_pkg.cmd) == PKG_VARLEN;
+			// Variable length: the length byte first, then we know
+			m_pkg.datalen = m_varlen ? 1 : qMin(EEPROM::cmdHasData(m_pkg.cmd), PKG_DATA_MAX);
+			if(m_pkg.datalen != 0)
+				++m_state;
+			else
+				m_state = 3;
+			break;
+
+		case 2: /* <DATA> */
+			qint64 bytesLeft;
+			bytesLeft = m_pkg.datalen - m_pkgData.size();
+			m_pkgData.append(in.left(bytesLeft));
+			in.remove(0, bytesLeft);
+			if(m_varlen && m_pkgData.size() == 1) {
+				m_varlen = false;
+				m_pkg.datalen = 1 + uint8_t(m_pkgData[0]);
+			}
+			if(m_pkgData.size() == m_pkg.datalen) {
+				m_pkg.data = (uint8_t *)(m_pkgData.data());
+				++m_state;
+			}
+			break;
+
+		case 3: /* <CHECKSUM> */
+			if(in.length() < 2) {
+				return false;
+			}
+			else {
+				QByteArray tmp = in.left(2);
+				in.remove(0,2);
+				m_pkg.crc = CRC16::arrayToWord(tmp);
+				++m_state;
+			}
+			break;
+
+		case 4: /* <ETX> */
+			byte = in[0];
+			in.remove(0,1);
+			m_state = 0;
+			if(byte == CMD_ENDXFER)
+				return true;
+			break;
+
+		default:
+			m_state = 0;
+			break;
+		}
+	}
+	return false;
+}
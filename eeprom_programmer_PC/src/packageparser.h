@@ -0,0 +1,33 @@
+#ifndef PACKAGEPARSER_H
+#define PACKAGEPARSER_H
+
+#include <QByteArray>
+
+#include "eeprom.h"
+
+/*
+ * Byte stream to packages:
+ * <STX><COMMAND>[<DATA><DATA>...]<CHECKSUM[1]><CHECKSUM[0]><ETX>
+ * Shared by the host side reader and the device emulator.
+ */
+class PackageParser
+{
+public:
+	PackageParser() = default;
+
+	void clear(void);
+
+	// Consume bytes from the front of in. Returns true when a whole package
+	// is ready in package(), false when it needs more bytes.
+	bool parse(QByteArray &in);
+
+	package_t *package(void) {return &m_pkg;};
+
+private:
+	int m_state = 0;
+	bool m_varlen = false;		/* waiting for the length byte */
+	package_t m_pkg = {};
+	QByteArray m_pkgData;
+};
+
+#endif // PACKAGEPARSER_H
@@ -0,0 +1,111 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "packbits.h"
+
+#include <cstring>
+
+#define RUN_MIN 3		/* shorter repeats go as literals */
+#define RUN_MAX 128
+#define LITERAL_MAX 128
+
+
+QByteArray PackBits::encode(const QByteArray &data)
+{
+	const uint8_t *in = reinterpret_cast<const uint8_t*>(data.constData());
+	const int size = data.size();
+
+	QByteArray out;
+	out.reserve(size + size / LITERAL_MAX + 1);
+
+	int literal = 0;	/* start of the pending literal, up to i */
+	int i = 0;
+	while(i < size) {
+		int run = 1;
+		while(i + run < size && run < RUN_MAX && in[i + run] == in[i])
+			++run;
+
+		if(run < RUN_MIN) {
+			i += run;
+			if(i - literal < LITERAL_MAX)
+				continue;
+			// A full one, the rest of the run starts the next
+			const int over = i - literal - LITERAL_MAX;
+			i -= over;
+		}
+
+		while(literal < i) {
+			const int n = qMin(i - literal, LITERAL_MAX);
+			out.append(char(n - 1));
+			out.append(reinterpret_cast<const char*>(in + literal), n);
+			literal += n;
+		}
+		if(run >= RUN_MIN) {
+			out.append(char(1 - run));
+			out.append(char(in[i]));
+			i += run;
+			literal = i;
+		}
+	}
+	while(literal < size) {
+		const int n = qMin(size - literal, LITERAL_MAX);
+		out.append(char(n - 1));
+		out.append(reinterpret_cast<const char*>(in + literal), n);
+		literal += n;
+	}
+	return out;
+}
+
+int PackBits::decode(const uint8_t *in, int size, uint8_t *out, int maxSize)
+{
+	int o = 0;
+	int i = 0;
+	while(i < size) {
+		const int n = int8_t(in[i++]);
+		if(n >= 0) {
+			const int count = n + 1;
+			if(i + count > size || o + count > maxSize)
+				return -1;
+			memcpy(out + o, in + i, size_t(count));
+			i += count;
+			o += count;
+		}
+		else if(n != -128) {
+			const int count = 1 - n;
+			if(i >= size || o + count > maxSize)
+				return -1;
+			memset(out + o, in[i++], size_t(count));
+			o += count;
+		}
+	}
+	return o;
+}
+
+bool PackBits::decode(const QByteArray &in, QByteArray &out, int maxSize)
+{
+	out.resize(maxSize);
+	const int n = decode(reinterpret_cast<const uint8_t*>(in.constData()), in.size(),
+						 reinterpret_cast<uint8_t*>(out.data()), maxSize);
+	if(n < 0) {
+		out.clear();
+		return false;
+	}
+	out.resize(n);
+	return true;
+}
@@ -0,0 +1,27 @@
+#ifndef PACKBITS_H
+#define PACKBITS_H
+
+#include <QByteArray>
+
+#include <cstdint>
+
+/*
+ * PackBits run length coding, as in TIFF: a header byte n followed by
+ * n + 1 literal bytes for n in 0..127, or by one byte to repeat 1 - n
+ * times for n in -127..-1. -128 is a no-op.
+ *
+ * Cheap enough for the firmware to decode a block as it arrives, see
+ * CMD_MEMDATA_RLE, and it never grows a block by more than one byte in
+ * 128. Mostly blank images shrink to a few bytes per block.
+ */
+class PackBits
+{
+public:
+	static QByteArray encode(const QByteArray &data);
+
+	// Bytes written to out, -1 if in is malformed or needs more than maxSize
+	static int decode(const uint8_t *in, int size, uint8_t *out, int maxSize);
+	static bool decode(const QByteArray &in, QByteArray &out, int maxSize);
+};
+
+#endif // PACKBITS_H
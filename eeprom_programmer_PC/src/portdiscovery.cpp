@@ -0,0 +1,184 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "portdiscovery.h"
+
+#include <QElapsedTimer>
+
+#include <vector>
+
+
+PortDiscovery::PortDiscovery(FILE* outStream, QObject *parent)
+	: QObject(parent)
+	, m_outStream(outStream)
+	, m_pollTimer(this)
+{
+	m_pollTimer.setSingleShot(false);
+	connect(&m_pollTimer, &QTimer::timeout,
+					this, &PortDiscovery::poll);
+}
+
+PortDiscovery::~PortDiscovery()
+{
+	// Let the programmers know we're gone instead of waiting for them to time out
+	for(MemoryComm *session : m_sessions)
+		session->close();
+}
+
+QList<QSerialPortInfo> PortDiscovery::candidates()
+{
+	QList<QSerialPortInfo> ports;
+	for(const QSerialPortInfo &info : QSerialPortInfo::availablePorts()) {
+		if(info.hasVendorIdentifier() && info.vendorIdentifier() == PROGRAMMER_VID
+				&& info.hasProductIdentifier() && info.productIdentifier() == PROGRAMMER_PID)
+			ports.append(info);
+	}
+	return ports;
+}
+
+Task<ProgrammerInfo> PortDiscovery::probe(QSerialPortInfo info)
+{
+	ProgrammerInfo programmer;
+	programmer.portName = info.portName();
+	programmer.serialNumber = info.serialNumber();
+	programmer.description = info.description();
+
+	MemoryComm::SerialPortOptions options = m_options;
+	options.name = info.portName();
+
+	MemoryComm *session = new MemoryComm(m_outStream, this);
+	session->setSerialPortOptions(options);
+
+	if(!session->open()) {
+		programmer.error = ERROR_COMM;
+		programmer.errorString = session->errorString();
+		delete session;
+		co_return programmer;
+	}
+
+	QElapsedTimer elapsed;
+	elapsed.start();
+	XferResult result = co_await session->probe();
+	programmer.handshakeMs = elapsed.elapsed();
+
+	if(!result.ok()) {
+		programmer.error = result.error;
+		session->deleteLater();
+		co_return programmer;
+	}
+
+	programmer.session = session;
+	m_sessions.insert(programmer.portName, session);
+
+	const QString portName = programmer.portName;
+	connect(session, &MemoryComm::portError,
+				this, [this, portName]() { detach(portName); });
+
+	emit programmerAttached(session);
+	co_return programmer;
+}
+
+Task<QList<ProgrammerInfo>> PortDiscovery::probeAll(bool retryFailed)
+{
+	// Start them all before waiting for any
+	std::vector<Task<ProgrammerInfo>> probes;
+	for(const QSerialPortInfo &info : candidates()) {
+		const QString name = info.portName();
+		if(m_sessions.contains(name) || m_probing.contains(name))
+			continue;
+		if(!retryFailed && m_rejected.contains(name))
+			continue;
+		m_rejected.remove(name);
+		m_probing.insert(name);
+		probes.push_back(probe(info));
+	}
+
+	for(Task<ProgrammerInfo> &task : probes) {
+		ProgrammerInfo programmer = co_await task;
+		m_probing.remove(programmer.portName);
+		m_known.insert(programmer.portName, programmer);
+		if(!programmer.ready())
+			m_rejected.insert(programmer.portName);
+	}
+
+	QList<ProgrammerInfo> table;
+	for(const ProgrammerInfo &programmer : m_known) {
+		if(programmer.ready() && !m_sessions.contains(programmer.portName))
+			continue;	// gone since
+		table.append(programmer);
+	}
+	co_return table;
+}
+
+void PortDiscovery::startWatching(int intervalMs)
+{
+	m_pollTimer.start(intervalMs);
+	poll();
+}
+
+void PortDiscovery::stopWatching()
+{
+	m_pollTimer.stop();
+}
+
+void PortDiscovery::poll()
+{
+	QSet<QString> present;
+	for(const QSerialPortInfo &info : candidates())
+		present.insert(info.portName());
+
+	for(const QString &name : m_sessions.keys()) {
+		if(!present.contains(name))
+			detach(name);
+	}
+
+	// A port that comes back is probed again
+	for(const QString &name : m_rejected.values()) {
+		if(!present.contains(name)) {
+			m_rejected.remove(name);
+			m_known.remove(name);
+		}
+	}
+
+	bool newPorts = false;
+	for(const QString &name : present) {
+		if(!m_sessions.contains(name) && !m_rejected.contains(name))
+			newPorts = true;
+	}
+
+	if(newPorts && m_poll.isDone())
+		m_poll = pollNewPorts();
+}
+
+Task<> PortDiscovery::pollNewPorts()
+{
+	co_await probeAll(false);
+}
+
+void PortDiscovery::detach(const QString &portName)
+{
+	MemoryComm *session = m_sessions.take(portName);
+	m_known.remove(portName);
+	if(!session)
+		return;
+
+	qDebug() << "Programmer on" << portName << "detached.";
+	emit programmerDetached(portName);
+	session->deleteLater();
+}
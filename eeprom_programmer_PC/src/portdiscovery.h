@@ -0,0 +1,79 @@
+#ifndef PORTDISCOVERY_H
+#define PORTDISCOVERY_H
+
+#include "memorycomm.h"
+#include "task.h"
+
+#include <QObject>
+#include <QMap>
+#include <QSet>
+#include <QSerialPortInfo>
+#include <QTimer>
+
+/* USB CDC identifiers of the programmer, see usbd_desc.c */
+#define PROGRAMMER_VID 1155		/* USBD_VID */
+#define PROGRAMMER_PID 22336	/* USBD_PID_FS */
+
+struct ProgrammerInfo {
+	QString portName;
+	QString serialNumber;
+	QString description;
+	errorcode_e error = ERROR_NONE;
+	QString errorString;	/* why the port couldn't be opened */
+	qint64 handshakeMs = 0;
+	MemoryComm *session = nullptr;	/* open and past CMD_INIT, null if the probe failed */
+
+	bool ready(void) const {return session != nullptr;}
+};
+
+/*
+ * Finds the programmers plugged to this computer.
+ *
+ * Every port with the programmer VID/PID is opened at the same time and
+ * gets a CMD_INIT, so the whole table is ready after one handshake.
+ * Programmers that answer are kept open as sessions owned by this object,
+ * and with startWatching() new ones are attached as they get plugged.
+ */
+class PortDiscovery : public QObject
+{
+	Q_OBJECT
+public:
+	explicit PortDiscovery(FILE* outStream = stdout, QObject *parent = nullptr);
+	~PortDiscovery();
+
+	static QList<QSerialPortInfo> candidates(void);
+
+	// Baudrate and friends for the sessions, the port name is ignored
+	void setSerialPortOptions(const MemoryComm::SerialPortOptions& op) {m_options = op;};
+
+	// Probe the ports not attached yet, the table also lists the attached ones
+	Task<QList<ProgrammerInfo>> probeAll(bool retryFailed = true);
+
+	void startWatching(int intervalMs = 1000);
+	void stopWatching(void);
+
+	QList<MemoryComm*> sessions(void) const {return m_sessions.values();};
+
+signals:
+	void programmerAttached(MemoryComm *session);
+	void programmerDetached(const QString &portName);
+
+private:
+	Task<ProgrammerInfo> probe(QSerialPortInfo info);
+	Task<> pollNewPorts(void);
+	void poll(void);
+	void detach(const QString &portName);
+
+	FILE* m_outStream;
+	MemoryComm::SerialPortOptions m_options;
+
+	QMap<QString, MemoryComm*> m_sessions;	/* by port name */
+	QMap<QString, ProgrammerInfo> m_known;	/* last probe result of every port */
+	QSet<QString> m_probing;
+	QSet<QString> m_rejected;	/* didn't answer, not probed again until replugged */
+
+	QTimer m_pollTimer;
+	Task<> m_poll;
+};
+
+#endif // PORTDISCOVERY_H
@@ -0,0 +1,398 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "rawserialport.h"
+#include "crc16.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+static speed_t toSpeed(qint32 baudrate)
+{
+	switch(baudrate)
+	{
+	case 1200:		return B1200;
+	case 2400:		return B2400;
+	case 4800:		return B4800;
+	case 9600:		return B9600;
+	case 19200:		return B19200;
+	case 38400:		return B38400;
+	case 57600:		return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	case 460800:	return B460800;
+	case 921600:	return B921600;
+	default:		return B0;
+	}
+}
+
+RawSerialPort::RawSerialPort(QObject *parent)
+	: QIODevice(parent)
+{
+}
+
+RawSerialPort::~RawSerialPort()
+{
+	close();
+}
+
+bool RawSerialPort::openPort()
+{
+	const QString path = m_portName.startsWith('/') ? m_portName : "/dev/" + m_portName;
+	m_fd = ::open(QFile::encodeName(path).constData(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(m_fd < 0) {
+		setErrorString(QString::fromLocal8Bit(strerror(errno)));
+		return false;
+	}
+
+	// Nobody else gets to open it, not even another one of us
+	if(::ioctl(m_fd, TIOCEXCL) < 0 || ::flock(m_fd, LOCK_EX | LOCK_NB) < 0) {
+		setErrorString(QString("%1 is in use").arg(path));
+		closePort();
+		return false;
+	}
+	if(!configure()) {
+		closePort();
+		return false;
+	}
+	return true;
+}
+
+void RawSerialPort::closePort()
+{
+	if(m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+}
+
+bool RawSerialPort::open(OpenMode mode)
+{
+	if(isOpen() || !openPort())
+		return false;
+
+	m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event port = {};
+	port.events = EPOLLIN;
+	port.data.fd = m_fd;
+	struct epoll_event wake = {};
+	wake.events = EPOLLIN;
+	wake.data.fd = m_eventFd;
+	if(m_epollFd < 0 || m_eventFd < 0
+			|| epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_fd, &port) < 0
+			|| epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_eventFd, &wake) < 0) {
+		setErrorString(QString::fromLocal8Bit(strerror(errno)));
+		close();
+		return false;
+	}
+
+	m_notifier = new QSocketNotifier(m_epollFd, QSocketNotifier::Read, this);
+	connect(m_notifier, &QSocketNotifier::activated,
+			this, &RawSerialPort::handleEvents);
+
+	return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+bool RawSerialPort::configure()
+{
+	struct termios tio;
+	if(tcgetattr(m_fd, &tio) < 0) {
+		setErrorString(QString::fromLocal8Bit(strerror(errno)));
+		return false;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~tcflag_t(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+	tio.c_iflag &= ~tcflag_t(IXON | IXOFF | IXANY);
+
+	switch(m_databits)
+	{
+	case QSerialPort::Data5:	tio.c_cflag |= CS5; break;
+	case QSerialPort::Data6:	tio.c_cflag |= CS6; break;
+	case QSerialPort::Data7:	tio.c_cflag |= CS7; break;
+	default:					tio.c_cflag |= CS8; break;
+	}
+	if(m_parity == QSerialPort::EvenParity)
+		tio.c_cflag |= PARENB;
+	else if(m_parity == QSerialPort::OddParity)
+		tio.c_cflag |= PARENB | PARODD;
+	if(m_stopbits == QSerialPort::TwoStop)
+		tio.c_cflag |= CSTOPB;
+	if(m_flowcontrol == QSerialPort::HardwareControl)
+		tio.c_cflag |= CRTSCTS;
+	else if(m_flowcontrol == QSerialPort::SoftwareControl)
+		tio.c_iflag |= IXON | IXOFF;
+
+	// read() returns whatever is there, right away
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+
+	const speed_t speed = toSpeed(m_baudrate);
+	if(speed == B0) {
+		setErrorString(QString("unsupported baud rate %1").arg(m_baudrate));
+		return false;
+	}
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	if(tcsetattr(m_fd, TCSANOW, &tio) < 0) {
+		setErrorString(QString::fromLocal8Bit(strerror(errno)));
+		return false;
+	}
+
+	// No 16 ms latency timer on real UARTs. Not there on CDC ACM or ptys.
+	struct serial_struct serial;
+	if(::ioctl(m_fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		::ioctl(m_fd, TIOCSSERIAL, &serial);
+	}
+	return true;
+}
+
+void RawSerialPort::close()
+{
+	if(isOpen())
+		QIODevice::close();
+
+	delete m_notifier;
+	m_notifier = nullptr;
+	for(int *fd : {&m_epollFd, &m_eventFd}) {
+		if(*fd >= 0)
+			::close(*fd);
+		*fd = -1;
+	}
+	closePort();
+	m_watchingWritable = false;
+	m_writeBuffer.clear();
+	m_written = 0;
+}
+
+void RawSerialPort::fail(const QString &what)
+{
+	setErrorString(QString("%1 %2: %3").arg(what, m_portName, QString::fromLocal8Bit(strerror(errno))));
+	// Level triggered, a hangup would wake us forever
+	if(m_notifier)
+		m_notifier->setEnabled(false);
+	emit errorOccurred();
+}
+
+qint64 RawSerialPort::bytesAvailable() const
+{
+	int pending = 0;
+	if(m_fd >= 0)
+		::ioctl(m_fd, FIONREAD, &pending);
+	return QIODevice::bytesAvailable() + pending;
+}
+
+qint64 RawSerialPort::readData(char *data, qint64 maxSize)
+{
+	const ssize_t n = ::read(m_fd, data, size_t(maxSize));
+	if(n >= 0)
+		return n;
+	if(errno == EAGAIN || errno == EINTR)
+		return 0;
+	fail("read from");
+	return -1;
+}
+
+qint64 RawSerialPort::writeData(const char *data, qint64 maxSize)
+{
+	// Behind what's already waiting, or it would go out of order
+	if(!m_writeBuffer.isEmpty()) {
+		m_writeBuffer.append(data, maxSize);
+		return maxSize;
+	}
+
+	ssize_t n = ::write(m_fd, data, size_t(maxSize));
+	if(n < 0) {
+		if(errno != EAGAIN && errno != EINTR) {
+			fail("write to");
+			return -1;
+		}
+		n = 0;
+	}
+	if(n < maxSize) {
+		m_writeBuffer.append(data + n, maxSize - n);
+		watchWritable(true);
+	}
+	wrote(n);
+	return maxSize;
+}
+
+qint64 RawSerialPort::writeFrame(commands_e cmd, const QByteArray &data)
+{
+	const uint16_t crc = data.isEmpty() ? CRC16::gen(uint8_t(cmd)) : CRC16::gen(uint8_t(cmd), data);
+	const char head[2] = {char(CMD_STARTXFER), char(cmd)};
+	const char tail[3] = {char(crc >> 8), char(crc & 0xFF), char(CMD_ENDXFER)};
+	struct iovec iov[3] = {
+		{const_cast<char*>(head), sizeof head},
+		{const_cast<char*>(data.constData()), size_t(data.size())},
+		{const_cast<char*>(tail), sizeof tail}
+	};
+	const qint64 size = qint64(sizeof head + sizeof tail) + data.size();
+
+	ssize_t n = 0;
+	if(m_writeBuffer.isEmpty()) {
+		n = ::writev(m_fd, iov, 3);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EINTR) {
+				fail("write to");
+				return -1;
+			}
+			n = 0;
+		}
+	}
+
+	// Whatever the kernel didn't take waits for EPOLLOUT
+	if(n < size) {
+		qint64 skip = n;
+		for(const struct iovec &part : iov) {
+			const qint64 len = qint64(part.iov_len);
+			if(skip < len)
+				m_writeBuffer.append(static_cast<const char*>(part.iov_base) + skip, len - skip);
+			skip = qMax<qint64>(0, skip - len);
+		}
+		watchWritable(true);
+	}
+	wrote(n);
+	return size;
+}
+
+void RawSerialPort::clearInput()
+{
+	if(m_fd >= 0)
+		tcflush(m_fd, TCIFLUSH);
+}
+
+bool RawSerialPort::flushWriteBuffer()
+{
+	while(!m_writeBuffer.isEmpty()) {
+		const ssize_t n = ::write(m_fd, m_writeBuffer.constData(), size_t(m_writeBuffer.size()));
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				return true;
+			fail("write to");
+			return false;
+		}
+		m_writeBuffer.remove(0, int(n));
+		wrote(n);
+	}
+	watchWritable(false);
+	return true;
+}
+
+// Reported from the event loop, never from inside write()
+void RawSerialPort::wrote(qint64 bytes)
+{
+	if(bytes <= 0)
+		return;
+	if(m_written == 0)
+		eventfd_write(m_eventFd, 1);
+	m_written += bytes;
+}
+
+void RawSerialPort::emitBytesWritten()
+{
+	eventfd_t count;
+	eventfd_read(m_eventFd, &count);
+	if(m_written == 0)
+		return;
+	const qint64 bytes = m_written;
+	m_written = 0;
+	emit bytesWritten(bytes);
+}
+
+void RawSerialPort::watchWritable(bool on)
+{
+	if(on == m_watchingWritable)
+		return;
+	m_watchingWritable = on;
+	struct epoll_event port = {};
+	port.events = EPOLLIN | (on ? uint32_t(EPOLLOUT) : 0u);
+	port.data.fd = m_fd;
+	epoll_ctl(m_epollFd, EPOLL_CTL_MOD, m_fd, &port);
+}
+
+void RawSerialPort::handleEvents()
+{
+	struct epoll_event events[2];
+	const int n = epoll_wait(m_epollFd, events, 2, 0);
+
+	bool readable = false;
+	bool hangup = false;
+	for(int i = 0; i < n; ++i) {
+		if(events[i].data.fd != m_fd)
+			continue;	/* the eventfd, bytesWritten() below */
+		if(events[i].events & EPOLLOUT)
+			flushWriteBuffer();
+		if(events[i].events & EPOLLIN)
+			readable = true;
+		if(events[i].events & (EPOLLHUP | EPOLLERR))
+			hangup = true;
+	}
+
+	emitBytesWritten();
+	if(readable)
+		emit readyRead();
+	if(hangup && isOpen()) {
+		errno = EIO;
+		fail("lost");
+	}
+}
+
+bool RawSerialPort::waitForReadyRead(int msecs)
+{
+	struct pollfd port = {m_fd, POLLIN, 0};
+	if(m_fd < 0 || ::poll(&port, 1, msecs) <= 0 || !(port.revents & POLLIN))
+		return false;
+	emit readyRead();
+	return true;
+}
+
+bool RawSerialPort::waitForBytesWritten(int msecs)
+{
+	QElapsedTimer timer;
+	timer.start();
+	while(m_fd >= 0 && !m_writeBuffer.isEmpty()) {
+		const int left = msecs < 0 ? -1 : qMax(0, msecs - int(timer.elapsed()));
+		struct pollfd port = {m_fd, POLLOUT, 0};
+		if(::poll(&port, 1, left) <= 0 || !flushWriteBuffer())
+			return false;
+	}
+	if(m_written == 0)
+		return false;
+	emitBytesWritten();
+	return true;
+}
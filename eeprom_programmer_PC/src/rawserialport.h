@@ -0,0 +1,97 @@
+#ifndef RAWSERIALPORT_H
+#define RAWSERIALPORT_H
+
+#include "eeprom.h"
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QSerialPort>
+#include <QSocketNotifier>
+
+/*
+ * Serial port on raw termios, Linux only: what QSerialPort can't do.
+ *
+ * The port is opened exclusively (TIOCEXCL plus flock), with VMIN = 0 and
+ * VTIME = 0 and ASYNC_LOW_LATENCY where the driver supports it. It's
+ * unbuffered: reads go straight from the kernel into the caller's array,
+ * sized by FIONREAD. Packages go out with one writev() of header, data
+ * and trailer, see writeFrame().
+ *
+ * The port and an eventfd are watched by one epoll set, and the epoll fd
+ * is the only thing the Qt event loop sees. The eventfd defers
+ * bytesWritten() to the event loop, like QSerialPort does, so nobody gets
+ * it from inside their own write().
+ */
+class RawSerialPort : public QIODevice
+{
+	Q_OBJECT
+public:
+	explicit RawSerialPort(QObject *parent = nullptr);
+	~RawSerialPort();
+
+	// Applied on open(), same meaning as in QSerialPort
+	void setPortName(const QString &name) {m_portName = name;};
+	QString portName(void) const {return m_portName;};
+	void setBaudRate(qint32 baudrate) {m_baudrate = baudrate;};
+	void setDataBits(QSerialPort::DataBits databits) {m_databits = databits;};
+	void setParity(QSerialPort::Parity parity) {m_parity = parity;};
+	void setStopBits(QSerialPort::StopBits stopbits) {m_stopbits = stopbits;};
+	void setFlowControl(QSerialPort::FlowControl flowcontrol) {m_flowcontrol = flowcontrol;};
+
+	bool open(OpenMode mode) override;
+	void close(void) override;
+	bool isSequential(void) const override {return true;};
+	qint64 bytesAvailable(void) const override;
+	qint64 bytesToWrite(void) const override {return m_writeBuffer.size();};
+	bool waitForReadyRead(int msecs) override;
+	bool waitForBytesWritten(int msecs) override;
+
+	// <STX><CMD>[data]<CRC><ETX> without assembling it first.
+	// Returns the package size, or -1.
+	virtual qint64 writeFrame(commands_e cmd, const QByteArray &data);
+	// Drop what was received and not read yet
+	void clearInput(void);
+
+signals:
+	// Hangup or read / write failure, the port is useless now
+	void errorOccurred(void);
+
+protected:
+	qint64 readData(char *data, qint64 maxSize) override;
+	qint64 writeData(const char *data, qint64 maxSize) override;
+
+	// Opened, locked and configured m_fd, with nothing watching it yet
+	bool openPort(void);
+	void closePort(void);
+	// Sets the error string from errno and emits errorOccurred()
+	void fail(const QString &what);
+
+	int m_fd = -1;
+
+private slots:
+	void handleEvents(void);
+
+private:
+	bool configure(void);
+	bool flushWriteBuffer(void);
+	void wrote(qint64 bytes);
+	void emitBytesWritten(void);
+	void watchWritable(bool on);
+
+	QString m_portName;
+	qint32 m_baudrate = QSerialPort::Baud115200;
+	QSerialPort::DataBits m_databits = QSerialPort::Data8;
+	QSerialPort::Parity m_parity = QSerialPort::NoParity;
+	QSerialPort::StopBits m_stopbits = QSerialPort::OneStop;
+	QSerialPort::FlowControl m_flowcontrol = QSerialPort::NoFlowControl;
+
+	int m_epollFd = -1;
+	int m_eventFd = -1;
+	QSocketNotifier *m_notifier = nullptr;
+	bool m_watchingWritable = false;
+
+	QByteArray m_writeBuffer;	/* what the kernel didn't take yet */
+	qint64 m_written = 0;		/* for the next bytesWritten() */
+};
+
+#endif // RAWSERIALPORT_H
@@ -0,0 +1,251 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "serialportio.h"
+
+
+SerialPortIo::SerialPortIo(FILE* outStream, QObject *parent)
+	: QObject(parent)
+	, m_serialPort(this)
+#ifdef Q_OS_LINUX
+	, m_rawPort(this)
+	, m_uringPort(this)
+#endif
+	, m_device(&m_serialPort)
+	, m_serialPortWriter(&m_serialPort, outStream, this)
+	, m_serialPortReader(&m_serialPort, outStream, this)
+{
+	connect(&m_serialPortReader, &SerialPortReader::packageReady,
+			this, &SerialPortIo::handlePackageReady);
+	connect(&m_serialPortReader, &SerialPortReader::timeout,
+			this, &SerialPortIo::handleTimeout);
+	connect(&m_serialPortReader, &SerialPortReader::ioError,
+			this, &SerialPortIo::handleIoError);
+	connect(&m_serialPortWriter, &SerialPortWriter::packageSent,
+			this, &SerialPortIo::handlePackageSent);
+	connect(&m_serialPortWriter, &SerialPortWriter::ioError,
+			this, &SerialPortIo::handleIoError);
+#ifdef Q_OS_LINUX
+	connect(&m_rawPort, &RawSerialPort::errorOccurred,
+			this, &SerialPortIo::handleIoError);
+	connect(&m_uringPort, &RawSerialPort::errorOccurred,
+			this, &SerialPortIo::handleIoError);
+	// Straight from the registered buffer into the parser
+	m_uringPort.setReceiver([this](const char *data, qint64 size) {
+		m_serialPortReader.feed(data, size);
+	});
+#endif
+}
+
+QStringList SerialPortIo::transportNames()
+{
+#ifdef Q_OS_LINUX
+	return {"qt", "termios", "uring"};
+#else
+	return {"qt"};
+#endif
+}
+
+bool SerialPortIo::findTransport(const QString &name, transport_e &transport)
+{
+	if(name == "qt")
+		transport = TRANSPORT_QT;
+	else if(name == "termios")
+		transport = TRANSPORT_TERMIOS;
+	else if(name == "uring")
+		transport = TRANSPORT_URING;
+	else
+		return false;
+	return transportNames().contains(name);
+}
+
+QIODevice *SerialPortIo::portDevice()
+{
+#ifdef Q_OS_LINUX
+	if(m_transport == TRANSPORT_TERMIOS)
+		return &m_rawPort;
+	if(m_transport == TRANSPORT_URING)
+		return &m_uringPort;
+#endif
+	return &m_serialPort;
+}
+
+bool SerialPortIo::setTransport(transport_e transport)
+{
+#ifndef Q_OS_LINUX
+	if(transport != TRANSPORT_QT)
+		return false;
+#endif
+	if(transport == m_transport)
+		return true;
+	m_transport = transport;
+	if(!m_replay)
+		setDevice(nullptr);
+	return true;
+}
+
+void SerialPortIo::setDevice(QIODevice *device)
+{
+	m_replay = device;
+	m_device = device ? device : portDevice();
+	m_serialPortWriter.setDevice(m_device);
+	m_serialPortReader.setDevice(m_device);
+	m_backlog.clear();
+}
+
+bool SerialPortIo::open()
+{
+	return m_device->isOpen() || m_device->open(QIODevice::ReadWrite);
+}
+
+void SerialPortIo::close()
+{
+	if(!m_device->isOpen())
+		return;
+
+	takeRequests();
+	runRequests();
+	while(m_serialPortWriter.busy() || !m_backlog.isEmpty()) {
+		// bytesWritten comes from in here and sends the next one
+		if(m_device->waitForBytesWritten(100) == false)
+			break;
+	}
+	// TODO: this doesn't seems to return on time on linux.
+	// Nor does the signal bytesWritten get emmited.
+	m_backlog.clear();
+	m_serialPortReader.stopRxTimeout();
+	m_device->close();
+}
+
+bool SerialPortIo::post(IoRequest request)
+{
+	if(!m_requests.push(std::move(request)))
+		return false;
+	if(!m_requestsPending.exchange(true, std::memory_order_acq_rel)) {
+		QMetaObject::invokeMethod(this, [this]() {
+			takeRequests();
+			runRequests();
+		}, Qt::QueuedConnection);
+	}
+	return true;
+}
+
+bool SerialPortIo::takeEvent(IoEvent &event)
+{
+	return m_events.pop(event);
+}
+
+// Clear the flag first: anything pushed after that rings again
+void SerialPortIo::takeRequests()
+{
+	m_requestsPending.store(false, std::memory_order_release);
+	IoRequest request;
+	while(m_requests.pop(request))
+		m_backlog.enqueue(std::move(request));
+}
+
+// In order, a frame waits for the one before it to be written
+void SerialPortIo::runRequests()
+{
+	while(!m_backlog.isEmpty()) {
+		IoRequest &request = m_backlog.head();
+		if(request.kind == IoRequest::FRAME && m_serialPortWriter.busy())
+			return;
+
+		switch(request.kind)
+		{
+		case IoRequest::FRAME:
+			if(m_serialPortWriter.send(request.cmd, request.data) == -1) {
+				IoEvent event;
+				event.kind = IoEvent::SEND_FAILED;
+				event.cmd = request.cmd;
+				postEvent(std::move(event));
+				break;
+			}
+			if(request.rxTimeoutMs > 0) {
+				m_timeoutSeq = request.seq;
+				m_serialPortReader.startRxTimeout(request.rxTimeoutMs);
+			}
+			else if(request.rxTimeoutMs == 0) {
+				m_serialPortReader.stopRxTimeout();
+			}
+			break;
+		case IoRequest::STOP_TIMEOUT:
+			m_serialPortReader.stopRxTimeout();
+			break;
+		case IoRequest::CLEAR_INPUT:
+			m_serialPortReader.clearBuffer();
+			if(m_device == &m_serialPort)
+				m_serialPort.clear(QSerialPort::Input);
+#ifdef Q_OS_LINUX
+			else if(RawSerialPort *rawPort = qobject_cast<RawSerialPort*>(m_device))
+				rawPort->clearInput();
+#endif
+			break;
+		}
+		m_backlog.dequeue();
+	}
+}
+
+void SerialPortIo::postEvent(IoEvent event)
+{
+	// Only if the session stopped reading: the package is lost and the
+	// job times out, like it would with a dropped byte
+	if(!m_events.push(std::move(event))) {
+		qDebug() << "SerialPortIo: event queue full, dropped" << ++m_dropped;
+		return;
+	}
+	if(!m_eventsPending.exchange(true, std::memory_order_acq_rel))
+		emit eventsReady();
+}
+
+void SerialPortIo::handlePackageReady(package_t *pkg)
+{
+	IoEvent event;
+	event.kind = IoEvent::PACKAGE;
+	event.cmd = pkg->cmd;
+	event.data = QByteArray((const char*)(pkg->data), pkg->datalen);
+	event.crc = pkg->crc;
+	postEvent(std::move(event));
+}
+
+void SerialPortIo::handlePackageSent(commands_e cmd)
+{
+	IoEvent event;
+	event.kind = IoEvent::SENT;
+	event.cmd = cmd;
+	postEvent(std::move(event));
+
+	runRequests();
+}
+
+void SerialPortIo::handleTimeout()
+{
+	IoEvent event;
+	event.kind = IoEvent::TIMEOUT;
+	event.seq = m_timeoutSeq;
+	postEvent(std::move(event));
+}
+
+void SerialPortIo::handleIoError()
+{
+	IoEvent event;
+	event.kind = IoEvent::IO_ERROR;
+	postEvent(std::move(event));
+}
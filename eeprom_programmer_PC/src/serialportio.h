@@ -0,0 +1,142 @@
+#ifndef SERIALPORTIO_H
+#define SERIALPORTIO_H
+
+#include "eeprom.h"
+#include "serialportreader.h"
+#include "serialportwriter.h"
+#include "spscqueue.h"
+
+#include <QByteArray>
+#include <QObject>
+#include <QQueue>
+#include <QSerialPort>
+#include <QStringList>
+
+#ifdef Q_OS_LINUX
+#include "rawserialport.h"
+#include "uringserialport.h"
+#endif
+
+#include <atomic>
+
+/* What talks to the serial port */
+enum transport_e {
+	TRANSPORT_QT,		/* QSerialPort */
+	TRANSPORT_TERMIOS,	/* RawSerialPort: termios, epoll and writev, Linux only */
+	TRANSPORT_URING		/* UringSerialPort: one io_uring for all ports, Linux only */
+};
+
+/* Session to I/O thread */
+struct IoRequest {
+	enum Kind {
+		FRAME,			/* send a package */
+		STOP_TIMEOUT,
+		CLEAR_INPUT		/* drop whatever was received and not parsed yet */
+	};
+
+	Kind kind = FRAME;
+	commands_e cmd = CMD_NONE;
+	QByteArray data;		/* at most PKG_DATA_MAX bytes */
+	int rxTimeoutMs = -1;	/* started once the frame is written, 0 stops it, -1 leaves it */
+	quint32 seq = 0;		/* of that timeout, echoed back if it fires */
+};
+
+/* I/O thread to session */
+struct IoEvent {
+	enum Kind {
+		PACKAGE,		/* one parsed from the port */
+		SENT,			/* a frame left completely */
+		SEND_FAILED,	/* the device didn't take it */
+		TIMEOUT,
+		IO_ERROR
+	};
+
+	Kind kind = PACKAGE;
+	commands_e cmd = CMD_NONE;
+	QByteArray data;
+	quint16 crc = 0;
+	quint32 seq = 0;		/* timeouts: of the frame that started it */
+};
+
+/*
+ * Serial port, framing and RX timeout of one session, on a thread of
+ * their own so nothing the session's thread does (printing a large hex
+ * dump to a slow terminal, for instance) delays reading the port or
+ * makes a timeout fire while the answer is sitting unread.
+ *
+ * The session talks to it through two lock-free single producer, single
+ * consumer queues: requests in, events out. Each side is woken with a
+ * queued call only when its queue goes from empty to not empty.
+ */
+class SerialPortIo : public QObject
+{
+	Q_OBJECT
+public:
+	explicit SerialPortIo(FILE* outStream = stdout, QObject *parent = nullptr);
+
+	// Everything below but post() and takeEvent() must run on the
+	// object's thread
+	QSerialPort &serialPort(void) {return m_serialPort;};
+#ifdef Q_OS_LINUX
+	RawSerialPort &rawPort(void) {return m_rawPort;};
+	// Only usable from the UringLoop's thread, see MemoryComm
+	UringSerialPort &uringPort(void) {return m_uringPort;};
+#endif
+	// Which port device to use when not replaying. false if it isn't
+	// available on this system.
+	bool setTransport(transport_e transport);
+	// nullptr for the port
+	void setDevice(QIODevice *device);
+	QIODevice *device(void) const {return m_device;};
+
+	static QStringList transportNames(void);
+	static bool findTransport(const QString &name, transport_e &transport);
+
+	bool open(void);
+	// Sends whatever is queued and closes the device
+	void close(void);
+
+	// Session side. false if the queue is full.
+	bool post(IoRequest request);
+	// Session side, after eventsReady()
+	bool takeEvent(IoEvent &event);
+	void rearm(void) {m_eventsPending.store(false, std::memory_order_release);};
+
+signals:
+	// Once per batch of events, the session empties the queue
+	void eventsReady(void);
+
+private slots:
+	void handlePackageReady(package_t *pkg);
+	void handlePackageSent(commands_e cmd);
+	void handleTimeout(void);
+	void handleIoError(void);
+
+private:
+	void takeRequests(void);
+	void runRequests(void);
+	void postEvent(IoEvent event);
+	QIODevice *portDevice(void);
+
+	QSerialPort m_serialPort;
+#ifdef Q_OS_LINUX
+	RawSerialPort m_rawPort;
+	UringSerialPort m_uringPort;
+#endif
+	transport_e m_transport = TRANSPORT_QT;
+	QIODevice *m_replay = nullptr;
+	QIODevice *m_device;		/* the port of m_transport, unless replaying */
+	SerialPortWriter m_serialPortWriter;
+	SerialPortReader m_serialPortReader;
+
+	SpscQueue<IoRequest, 64> m_requests;
+	SpscQueue<IoEvent, 256> m_events;
+	std::atomic<bool> m_requestsPending{false};
+	std::atomic<bool> m_eventsPending{false};
+
+	QQueue<IoRequest> m_backlog;	/* taken, waiting for the writer */
+	quint32 m_timeoutSeq = 0;
+	qint64 m_dropped = 0;
+};
+
+#endif // SERIALPORTIO_H
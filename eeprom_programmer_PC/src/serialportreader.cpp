@@ -1,17 +1,14 @@
 #include "serialportreader.h"
 
 
-SerialPortReader::SerialPortReader(QSerialPort *serialPort,
+SerialPortReader::SerialPortReader(QIODevice *device,
 								   FILE* outStream,
 								   QObject *parent)
 	: QObject(parent)
-	, m_serialPort(serialPort)
 	, m_standardOutput(outStream)
+	, m_timer(this)
 {
-	connect(m_serialPort, &QSerialPort::readyRead,
-			this, &SerialPortReader::handleReadyRead);
-	connect(m_serialPort, &QSerialPort::errorOccurred,
-			this, &SerialPortReader::handleError);
+	setDevice(device);
 	connect(&m_timer, &QTimer::timeout,
 			this, &SerialPortReader::handleTimeout);
 
@@ -20,9 +17,25 @@ SerialPortReader::SerialPortReader(QSerialPort *serialPort,
 	m_timer.setSingleShot(true);
 }
 
+void SerialPortReader::setDevice(QIODevice *device)
+{
+	if(m_device)
+		disconnect(m_device, nullptr, this, nullptr);
+
+	m_device = device;
+	clearBuffer();
+
+	connect(m_device, &QIODevice::readyRead,
+			this, &SerialPortReader::handleReadyRead);
+	if(QSerialPort *serialPort = qobject_cast<QSerialPort*>(m_device)) {
+		connect(serialPort, &QSerialPort::errorOccurred,
+				this, &SerialPortReader::handleError);
+	}
+}
+
 void SerialPortReader::clearBuffer() {
 	m_readData.clear();
-	m_state = 0;
+	m_parser.clear();
 }
 
 void SerialPortReader::startRxTimeout(int time_ms) {
@@ -43,20 +56,25 @@ void SerialPortReader::handleError(QSerialPort::SerialPortError serialPortError)
 	if (serialPortError == QSerialPort::ReadError) {
 		m_standardOutput << QObject::tr("An I/O error occurred while reading "
 										"the data from port %1, error: %2")
-							.arg(m_serialPort->portName(), m_serialPort->errorString())
+							.arg(qobject_cast<QSerialPort*>(m_device)->portName(), m_device->errorString())
 						 << Qt::endl;
-		QCoreApplication::exit(1);
+		emit ioError();
 	}
 }
 
 void SerialPortReader::handleReadyRead()
 {
 //	qDebug() << QObject::tr("Received %1 bytes of data")
-//						.arg(m_serialPort->bytesAvailable());
+//						.arg(m_device->bytesAvailable());
+
+	const QByteArray recv = m_device->readAll();
+	feed(recv.constData(), recv.length());
+}
 
-	QByteArray recv = m_serialPort->readAll();
-	m_received += recv.length();
-	m_readData.append(recv);
+void SerialPortReader::feed(const char *data, qint64 size)
+{
+	m_received += size;
+	m_readData.append(data, int(size));
 	m_available = m_readData.length();
 
 	// restart timeout each time we get something
@@ -67,79 +85,15 @@ void SerialPortReader::handleReadyRead()
 
 void SerialPortReader::processRx(void)
 {
-	bool pkg_ready = false;
-
-	while(!m_readData.isEmpty())
+	while(m_parser.parse(m_readData))
 	{
-		uint8_t byte;
-		switch(m_state)
-		{
-		case 0: /* <STX> */
-			byte = m_readData[0];
-			m_readData.remove(0,1);
-			if(byte == CMD_STARTXFER)
-				++m_state;
-			break;
-
-		case 1: /* <COMMAND> */
-			byte = m_readData[0];
-			m_pkg.cmd = static_cast<commands_e>(char(byte));
-			m_readData.remove(0,1);
-			m_pkgData.clear();
-			m_pkg.datalen = qMin(EEPROM::cmdHasData(m_pkg.cmd), PKG_DATA_MAX);
-			if(m_pkg.datalen != 0)
-				++m_state;
-			else
-				m_state = 3;
-			break;
-
-		case 2: /* <DATA> */
-			qint64 bytesLeft;
-			bytesLeft = m_pkg.datalen - m_pkgData.size();
-			m_pkgData.append(m_readData.left(bytesLeft));
-			m_readData.remove(0, bytesLeft);
-			if(m_pkgData.size() == m_pkg.datalen) {
-				m_pkg.data = (uint8_t *)(m_pkgData.data());
-				++m_state;
-			}
-			break;
-
-		case 3: /* <CHECKSUM> */
-			if(m_readData.length() < 2) {
-				return;
-			}
-			else {
-				QByteArray tmp = m_readData.left(2);
-				m_readData.remove(0,2);
-				m_pkg.crc = CRC16::arrayToWord(tmp);
-				++m_state;
-			}
-			break;
-
-		case 4: /* <ETX> */
-			byte = m_readData[0];
-			m_readData.remove(0,1);
-			if(byte == CMD_ENDXFER)
-				pkg_ready = true;
-
-			[[fallthrough]];
-		default:
-			m_state = 0;
-			break;
+		if(m_readData.isEmpty()) {
+//			qDebug("No more data, stopping Rx timer");
+			m_timer.stop();
 		}
-
-		if(pkg_ready)
-		{
-			if(m_readData.isEmpty()) {
-//				qDebug("No more data, stopping Rx timer");
-				m_timer.stop();
-			}
-			else {
-//				qDebug("More data coming, not stoping timer");
-			}
-			emit packageReady(&m_pkg);
-			pkg_ready = false;
+		else {
+//			qDebug("More data coming, not stoping timer");
 		}
+		emit packageReady(m_parser.package());
 	}
 }
-
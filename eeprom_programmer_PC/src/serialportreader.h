@@ -1,7 +1,6 @@
 #ifndef SERIALPORTREADER_H
 #define SERIALPORTREADER_H
 
-#include <QCoreApplication>
 #include <QByteArray>
 #include <QSerialPort>
 #include <QStringList>
@@ -10,6 +9,7 @@
 
 #include "eeprom.h"
 #include "crc16.h"
+#include "packageparser.h"
 
 class SerialPortWriter;
 
@@ -20,18 +20,24 @@ class SerialPortReader : public QObject
 protected:
 
 public:
-	SerialPortReader(QSerialPort *serialPort,
+	SerialPortReader(QIODevice *device,
 					 FILE* outStream,
 					 QObject *parent = nullptr);
 
 	virtual ~SerialPortReader() {qDebug() << "Data received: " << m_received; };
 
+	// Read from another device (a QSerialPort, or a trace being replayed)
+	void setDevice(QIODevice *device);
+
 	void clearBuffer();
+	// Bytes that didn't come through readyRead(), see UringSerialPort
+	void feed(const char *data, qint64 size);
 	qint64 getAvailable() const {return m_available;} // se usa esto????
 
 signals:
 	void packageReady(package_t* pkg);
 	void timeout(void);
+	void ioError(void);
 //	void crcError(void);
 //	void targetReportsRxStatus(int status);
 //	void rxInProgress(void);
@@ -48,17 +54,14 @@ private slots:
 private:
 
 	void processRx(void);
-	int cmdHasData(uint8_t command);
 
-	QSerialPort *m_serialPort = nullptr;
+	QIODevice *m_device = nullptr;
 	SerialPortWriter *m_serialPortWriter = nullptr;
 	QTextStream m_standardOutput;
 	QTimer m_timer;
 
-	int m_state = 0;
-	package_t m_pkg;
+	PackageParser m_parser;
 	QByteArray m_readData;
-	QByteArray m_pkgData;
 	qint64 m_received = 0;
 	qint64 m_available = 0; // se usa??
 };
@@ -1,35 +1,57 @@
 #include "serialportwriter.h"
+#ifdef Q_OS_LINUX
+#include "rawserialport.h"
+#endif
 
 
 
-SerialPortWriter::SerialPortWriter(QSerialPort *serialPort,
+SerialPortWriter::SerialPortWriter(QIODevice *device,
 								   FILE* outStream,
 								   QObject *parent)
 	: QObject(parent)
 	, m_standardOutput(outStream)
-	, m_serialPort(serialPort)
+	, m_timer(this)
 {
-	setSignals();
+	setDevice(device);
+	connect(&m_timer, &QTimer::timeout,
+			this, &SerialPortWriter::handleTimeout); // is this being used?
 
 	m_timer.setSingleShot(true);
 }
 
-void SerialPortWriter::setSignals()
+void SerialPortWriter::setDevice(QIODevice *device)
 {
-	connect(m_serialPort, &QSerialPort::bytesWritten,
+	if(m_device)
+		disconnect(m_device, nullptr, this, nullptr);
+
+	m_device = device;
+#ifdef Q_OS_LINUX
+	m_rawPort = qobject_cast<RawSerialPort*>(device);
+#endif
+	m_busy = false;
+	m_package.clear();
+	m_packageBytesWritten = 0;
+
+	connect(m_device, &QIODevice::bytesWritten,
 			this, &SerialPortWriter::handleBytesWritten);
-	connect(m_serialPort, &QSerialPort::errorOccurred,
-			this, &SerialPortWriter::handleError);
-	connect(&m_timer, &QTimer::timeout,
-			this, &SerialPortWriter::handleTimeout); // is this being used?
+	if(QSerialPort *serialPort = qobject_cast<QSerialPort*>(m_device)) {
+		connect(serialPort, &QSerialPort::errorOccurred,
+				this, &SerialPortWriter::handleError);
+	}
+}
+
+QString SerialPortWriter::portName() const
+{
+	QSerialPort *serialPort = qobject_cast<QSerialPort*>(m_device);
+	return serialPort ? serialPort->portName() : m_device->objectName();
 }
 
 void SerialPortWriter::handleTimeout()
 {
 	m_standardOutput << QObject::tr("Operation timed out for port %1: %2")
-						.arg(m_serialPort->portName(), m_serialPort->errorString())
+						.arg(portName(), m_device->errorString())
 					 << Qt::endl;
-	QCoreApplication::exit(1);
+	emit ioError();
 }
 
 void SerialPortWriter::handleError(QSerialPort::SerialPortError serialPortError)
@@ -37,9 +59,9 @@ void SerialPortWriter::handleError(QSerialPort::SerialPortError serialPortError)
 	if (serialPortError == QSerialPort::WriteError) {
 		m_standardOutput << QObject::tr("An I/O error occurred while writing"
 										" the data to port %1: %2")
-							.arg(m_serialPort->portName(), m_serialPort->errorString())
+							.arg(portName(), m_device->errorString())
 						 << Qt::endl;
-		QCoreApplication::exit(1);
+		emit ioError();
 	}
 }
 
@@ -49,7 +71,7 @@ void SerialPortWriter::handleBytesWritten(qint64 bytes)
 	m_totalBytesSent += bytes;
 	m_packageBytesWritten += bytes;
 
-	if (m_packageBytesWritten == m_package.size())
+	if (m_packageBytesWritten == m_packageSize)
 	{
 		m_packageBytesWritten = 0;
 		m_package.clear();
@@ -62,33 +84,46 @@ void SerialPortWriter::handleBytesWritten(qint64 bytes)
 
 qint64 SerialPortWriter::write()
 {
-	const qint64 bytesWritten = m_serialPort->write(m_package);
+#ifdef Q_OS_LINUX
+	const qint64 bytesWritten = m_rawPort ? m_rawPort->writeFrame(m_cmd, m_packageData)
+										  : m_device->write(m_package);
+#else
+	const qint64 bytesWritten = m_device->write(m_package);
+#endif
 
 	if (bytesWritten == -1) {
 		m_standardOutput << QObject::tr("Failed to write the data to port %1: %2")
-							.arg(m_serialPort->portName(), m_serialPort->errorString())
+							.arg(portName(), m_device->errorString())
 						 << Qt::endl;
 	}
 	else {
-		m_timer.start(2000+m_package.size()); /* internal timer for LOCAL timeout */
+		m_timer.start(2000+m_packageSize); /* internal timer for LOCAL timeout */
 	}
 	return bytesWritten;
 }
 
-qint64 SerialPortWriter::sendPackage(void)
+QByteArray SerialPortWriter::buildPackage(commands_e cmd, const QByteArray &data)
 {
-	m_busy = true;
-	m_package.clear();
-	m_package.append(char(CMD_STARTXFER));
-	m_package.append(m_cmd);
-	if(!m_packageData.isEmpty()) {
-		m_package.append(m_packageData);
-		m_package.append(CRC16::genByteArray(m_cmd, m_packageData));
+	QByteArray package;
+	package.append(char(CMD_STARTXFER));
+	package.append(cmd);
+	if(!data.isEmpty()) {
+		package.append(data);
+		package.append(CRC16::genByteArray(cmd, data));
 	}
 	else {
-		m_package.append(CRC16::genByteArray(m_cmd));
+		package.append(CRC16::genByteArray(cmd));
 	}
-	m_package.append(char(CMD_ENDXFER));
+	package.append(char(CMD_ENDXFER));
+	return package;
+}
+
+qint64 SerialPortWriter::sendPackage(void)
+{
+	m_busy = true;
+	m_packageSize = PKG_MINSIZE + m_packageData.size();
+	if(!m_rawPort)
+		m_package = buildPackage(m_cmd, m_packageData);
 
 	return write();
 }
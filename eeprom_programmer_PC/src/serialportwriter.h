@@ -6,33 +6,40 @@
 #include <QSerialPort>
 #include <QTextStream>
 #include <QTimer>
-#include <QCoreApplication>
 #include <QDebug>
 
 #include "eeprom.h"
 #include "crc16.h"
 
 class SerialPortReader;
+class RawSerialPort;
 
 class SerialPortWriter : public QObject
 {
 	Q_OBJECT
 public:
-	explicit SerialPortWriter(QSerialPort *serialPort,
+	explicit SerialPortWriter(QIODevice *device,
 							  FILE* outStream,
 							  QObject *parent = nullptr);
 
 	virtual ~SerialPortWriter() {qDebug() << "Data sent:     " << m_totalBytesSent; };
 
+	// Write to another device (a QSerialPort, or a trace being replayed)
+	void setDevice(QIODevice *device);
+
 	qint64 send(commands_e cmd);
 	qint64 send(commands_e cmd, const QByteArray &data);
 	inline qint64 getBytesSent() const {return m_totalBytesSent;};
 
 	bool busy(void) const;
 
+	// <STX><CMD>[data]<CRC><ETX>
+	static QByteArray buildPackage(commands_e cmd, const QByteArray &data);
+
 signals:
 //	void txXferComplete(int status);
 	void packageSent(commands_e);
+	void ioError(void);
 
 public slots:
 //	void handleTargetReportRxStatus(int status);
@@ -49,10 +56,12 @@ private:
 	qint64 sendPackage(void);
 
 	QTextStream m_standardOutput;
-	QSerialPort *m_serialPort = nullptr;
+	QIODevice *m_device = nullptr;
+	RawSerialPort *m_rawPort = nullptr;	/* m_device, if it's one */
 	QTimer m_timer;
 
 	QByteArray m_package;				/* current package with command, data, chksum... */
+	qint64 m_packageSize = 0;			/* not built for a RawSerialPort, which takes the parts */
 	QByteArray m_packageData;			/* current package data */
 	QByteArray m_data;					/* whole message data */
 	commands_e m_cmd;
@@ -63,7 +72,7 @@ private:
 	int m_tries = 0;
 	void transmitNextPackage();
 	void targetRxError();
-	void setSignals();
+	QString portName(void) const;
 };
 
 #endif // SERIALPORTWRITER_H
@@ -0,0 +1,205 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "sessionstats.h"
+
+#include <QTextStream>
+#include <QtAlgorithms>
+
+
+int LatencyHistogram::bucketIndex(quint64 value)
+{
+	if(value < SUB_BUCKETS)
+		return int(value);
+
+	const int msb = 63 - int(qCountLeadingZeroBits(value));
+	const int magnitude = msb - SUB_BUCKET_BITS;
+	if(magnitude >= MAGNITUDES)
+		return BUCKETS - 1;
+
+	const int sub = int(value >> magnitude) & (SUB_BUCKETS - 1);
+	return SUB_BUCKETS + magnitude * SUB_BUCKETS + sub;
+}
+
+quint64 LatencyHistogram::bucketUpper(int index)
+{
+	if(index < SUB_BUCKETS)
+		return quint64(index);
+
+	const int magnitude = (index - SUB_BUCKETS) / SUB_BUCKETS;
+	const int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+	const quint64 lower = quint64(SUB_BUCKETS + sub) << magnitude;
+	return lower + (quint64(1) << magnitude) - 1;
+}
+
+void LatencyHistogram::record(qint64 us)
+{
+	if(us < 0)
+		us = 0;
+
+	++m_counts[size_t(bucketIndex(quint64(us)))];
+	if(m_count == 0 || us < m_min)
+		m_min = us;
+	if(us > m_max)
+		m_max = us;
+	++m_count;
+	m_sum += quint64(us);
+}
+
+// p in [0, 100]
+qint64 LatencyHistogram::percentile(double p) const
+{
+	if(m_count == 0)
+		return 0;
+
+	quint64 rank = quint64(p / 100.0 * double(m_count) + 0.5);
+	rank = qBound<quint64>(1, rank, m_count);
+
+	quint64 seen = 0;
+	for(int i = 0; i < BUCKETS; ++i) {
+		seen += m_counts[size_t(i)];
+		if(seen >= rank)
+			return qMin(qint64(bucketUpper(i)), m_max);
+	}
+	return m_max;
+}
+
+QJsonObject LatencyHistogram::toJson() const
+{
+	QJsonObject json;
+	json["count"] = qint64(m_count);
+	json["min_us"] = min();
+	json["mean_us"] = mean();
+	json["p50_us"] = percentile(50);
+	json["p90_us"] = percentile(90);
+	json["p99_us"] = percentile(99);
+	json["p999_us"] = percentile(99.9);
+	json["max_us"] = max();
+	return json;
+}
+
+
+void SessionStats::commandSent(commands_e cmd, qint64 wireBytes)
+{
+	++m_packagesSent;
+	m_bytesSent += wireBytes;
+	m_waiting = cmd;
+	m_sentAtNs = m_clock.nsecsElapsed();
+}
+
+void SessionStats::answerReceived(commands_e cmd, qint64 wireBytes)
+{
+	Q_UNUSED(cmd);
+	++m_packagesReceived;
+	m_bytesReceived += wireBytes;
+
+	if(m_waiting != CMD_NONE) {
+		m_latency[m_waiting].record((m_clock.nsecsElapsed() - m_sentAtNs) / 1000);
+		m_waiting = CMD_NONE;
+	}
+}
+
+void SessionStats::beginPhase(Phase phase)
+{
+	m_phaseStartNs[phase] = m_clock.nsecsElapsed();
+}
+
+void SessionStats::endPhase(Phase phase)
+{
+	m_phaseNs[phase] += m_clock.nsecsElapsed() - m_phaseStartNs[phase];
+}
+
+// Memory content moved per second of transfer and verify
+double SessionStats::megabytesPerSecond() const
+{
+	const qint64 ns = m_phaseNs[PHASE_TRANSFER] + m_phaseNs[PHASE_VERIFY];
+	if(ns <= 0)
+		return 0.0;
+	return double(m_payloadBytes) * 1000.0 / double(ns);
+}
+
+const char *SessionStats::phaseName(Phase phase)
+{
+	switch(phase)
+	{
+	case PHASE_HANDSHAKE:	return "handshake";
+	case PHASE_TRANSFER:	return "transfer";
+	case PHASE_VERIFY:		return "verify";
+	default:				return "?";
+	}
+}
+
+QString SessionStats::toText() const
+{
+	QString text;
+	QTextStream out(&text);
+
+	out << "Session statistics" << Qt::endl;
+	for(int i = 0; i < PHASE_MAX; ++i) {
+		out << QString("  %1 %2 ms")
+				.arg(phaseName(Phase(i)), -10)
+				.arg(double(m_phaseNs[size_t(i)]) / 1e6, 10, 'f', 1)
+			<< Qt::endl;
+	}
+	out << QString("  Payload    %1 bytes, %2 MB/s")
+			.arg(m_payloadBytes).arg(megabytesPerSecond(), 0, 'f', 3) << Qt::endl;
+	out << QString("  Packages   %1 sent (%2 bytes), %3 received (%4 bytes)")
+			.arg(m_packagesSent).arg(m_bytesSent)
+			.arg(m_packagesReceived).arg(m_bytesReceived) << Qt::endl;
+	out << QString("  Errors     %1 retries, %2 timeouts, %3 CRC errors")
+			.arg(m_retries).arg(m_timeouts).arg(m_crcErrors) << Qt::endl;
+
+	out << QString("  %1 %2 %3 %4 %5 %6 %7")
+			.arg("Latency (us)", -16).arg("count", 8).arg("min", 8)
+			.arg("p50", 8).arg("p99", 8).arg("p99.9", 8).arg("max", 8) << Qt::endl;
+	for(auto it = m_latency.constBegin(); it != m_latency.constEnd(); ++it) {
+		const LatencyHistogram &h = it.value();
+		out << QString("  %1 %2 %3 %4 %5 %6 %7")
+				.arg(EEPROM::getCommandName(it.key()), -16)
+				.arg(h.count(), 8).arg(h.min(), 8)
+				.arg(h.percentile(50), 8).arg(h.percentile(99), 8)
+				.arg(h.percentile(99.9), 8).arg(h.max(), 8) << Qt::endl;
+	}
+	return text;
+}
+
+QJsonObject SessionStats::toJson() const
+{
+	QJsonObject phases;
+	for(int i = 0; i < PHASE_MAX; ++i)
+		phases[phaseName(Phase(i))] = double(m_phaseNs[size_t(i)]) / 1e6;
+
+	QJsonObject latency;
+	for(auto it = m_latency.constBegin(); it != m_latency.constEnd(); ++it)
+		latency[EEPROM::getCommandName(it.key())] = it.value().toJson();
+
+	QJsonObject json;
+	json["phases_ms"] = phases;
+	json["payload_bytes"] = m_payloadBytes;
+	json["payload_mb_s"] = megabytesPerSecond();
+	json["packages_sent"] = m_packagesSent;
+	json["packages_received"] = m_packagesReceived;
+	json["bytes_sent"] = m_bytesSent;
+	json["bytes_received"] = m_bytesReceived;
+	json["retries"] = m_retries;
+	json["timeouts"] = m_timeouts;
+	json["crc_errors"] = m_crcErrors;
+	json["latency"] = latency;
+	return json;
+}
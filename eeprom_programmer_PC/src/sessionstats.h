@@ -0,0 +1,106 @@
+#ifndef SESSIONSTATS_H
+#define SESSIONSTATS_H
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QMap>
+#include <QString>
+
+#include <array>
+
+#include "eeprom.h"
+
+/*
+ * Log-linear latency histogram in the HDR style: exact up to 16 us, then
+ * 16 buckets per power of two, so any value is kept within ~6%.
+ * Recording is a couple of shifts and an increment.
+ */
+class LatencyHistogram
+{
+public:
+	void record(qint64 us);
+
+	quint64 count(void) const {return m_count;};
+	qint64 min(void) const {return m_count ? m_min : 0;};
+	qint64 max(void) const {return m_max;};
+	double mean(void) const {return m_count ? double(m_sum) / double(m_count) : 0.0;};
+	qint64 percentile(double p) const;
+
+	QJsonObject toJson(void) const;
+
+private:
+	enum {
+		SUB_BUCKET_BITS = 4,
+		SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+		MAGNITUDES = 36,	/* up to 2^40 us */
+		BUCKETS = SUB_BUCKETS + MAGNITUDES * SUB_BUCKETS
+	};
+
+	static int bucketIndex(quint64 value);
+	static quint64 bucketUpper(int index);
+
+	std::array<quint64, BUCKETS> m_counts{};
+	quint64 m_count = 0;
+	quint64 m_sum = 0;
+	qint64 m_min = 0;
+	qint64 m_max = 0;
+};
+
+/*
+ * Counters for one programmer session: latency from sending a command
+ * to its answer, per command, wire and payload bytes, the things that
+ * went wrong and where the time went.
+ */
+class SessionStats
+{
+public:
+	enum Phase {
+		PHASE_HANDSHAKE,
+		PHASE_TRANSFER,
+		PHASE_VERIFY,
+		PHASE_MAX
+	};
+
+	SessionStats() {m_clock.start();};
+
+	// Called by MemoryComm
+	void commandSent(commands_e cmd, qint64 wireBytes);
+	void answerReceived(commands_e cmd, qint64 wireBytes);
+	void addPayload(qint64 bytes) {m_payloadBytes += bytes;};
+	void countTimeout(void) {++m_timeouts;};
+	void countCrcError(void) {++m_crcErrors;};
+
+	// Called by whoever drives the session
+	void countRetry(void) {++m_retries;};
+	void beginPhase(Phase phase);
+	void endPhase(Phase phase);
+
+	qint64 phaseNs(Phase phase) const {return m_phaseNs[phase];};
+	double megabytesPerSecond(void) const;
+
+	QString toText(void) const;
+	QJsonObject toJson(void) const;
+
+	static const char *phaseName(Phase phase);
+
+private:
+	QElapsedTimer m_clock;
+
+	QMap<commands_e, LatencyHistogram> m_latency;	/* by the command sent */
+	commands_e m_waiting = CMD_NONE;
+	qint64 m_sentAtNs = 0;
+
+	qint64 m_packagesSent = 0;
+	qint64 m_packagesReceived = 0;
+	qint64 m_bytesSent = 0;
+	qint64 m_bytesReceived = 0;
+	qint64 m_payloadBytes = 0;
+	qint64 m_retries = 0;
+	qint64 m_timeouts = 0;
+	qint64 m_crcErrors = 0;
+
+	std::array<qint64, PHASE_MAX> m_phaseNs{};
+	std::array<qint64, PHASE_MAX> m_phaseStartNs{};
+};
+
+#endif // SESSIONSTATS_H
@@ -0,0 +1,72 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+/*
+ * Lock-free ring for exactly one producer thread and one consumer thread.
+ * push() fails when the ring is full, pop() when it's empty; neither
+ * ever blocks. Each side keeps its own index on a separate cache line,
+ * plus a copy of the other side's, so they only touch each other's line
+ * when the ring looks full or empty.
+ */
+template<typename T, std::size_t Capacity>
+class SpscQueue
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+				  "SpscQueue capacity must be a power of two");
+
+public:
+	SpscQueue() = default;
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue &operator=(const SpscQueue&) = delete;
+
+	// Producer thread only
+	bool push(T item) {
+		const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+		if(tail - m_headCache == Capacity) {
+			m_headCache = m_head.load(std::memory_order_acquire);
+			if(tail - m_headCache == Capacity)
+				return false;
+		}
+		m_ring[tail & MASK] = std::move(item);
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	};
+
+	// Consumer thread only
+	bool pop(T &item) {
+		const std::size_t head = m_head.load(std::memory_order_relaxed);
+		if(head == m_tailCache) {
+			m_tailCache = m_tail.load(std::memory_order_acquire);
+			if(head == m_tailCache)
+				return false;
+		}
+		// Move out through a temporary so the slot doesn't keep anything alive
+		item = T(std::move(m_ring[head & MASK]));
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	};
+
+	// From either side it's only a snapshot
+	bool isEmpty(void) const {
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	};
+
+	static constexpr std::size_t capacity(void) {return Capacity;};
+
+private:
+	static constexpr std::size_t MASK = Capacity - 1;
+	static constexpr std::size_t CACHE_LINE = 64;
+
+	T m_ring[Capacity];
+
+	alignas(CACHE_LINE) std::atomic<std::size_t> m_head{0};	/* consumer */
+	std::size_t m_tailCache = 0;
+	alignas(CACHE_LINE) std::atomic<std::size_t> m_tail{0};	/* producer */
+	std::size_t m_headCache = 0;
+};
+
+#endif // SPSCQUEUE_H
@@ -0,0 +1,120 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <QTimer>
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+/*
+ * Minimal C++20 coroutine support on top of the Qt event loop.
+ *
+ * A Task starts running as soon as it's called and can be co_await'ed
+ * from another coroutine. If the Task object is dropped before the
+ * coroutine finishes, the coroutine keeps going and frees itself.
+ */
+
+namespace detail {
+
+struct TaskPromiseBase {
+	std::coroutine_handle<> continuation;
+	bool detached = false;
+
+	std::suspend_never initial_suspend() const noexcept { return {}; }
+	void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+	std::optional<T> value;
+
+	void return_value(T v) { value = std::move(v); }
+	T result() { return std::move(*value); }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+	void return_void() {}
+	void result() {}
+};
+
+template<typename Promise>
+struct TaskFinalAwaiter {
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+		Promise &p = h.promise();
+		if(p.continuation)
+			return p.continuation;
+		if(p.detached)
+			h.destroy();
+		return std::noop_coroutine();
+	}
+	void await_resume() const noexcept {}
+};
+
+} // namespace detail
+
+template<typename T = void>
+class Task
+{
+public:
+	struct promise_type : detail::TaskPromise<T> {
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		detail::TaskFinalAwaiter<promise_type> final_suspend() const noexcept { return {}; }
+	};
+
+	Task() = default;
+	Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+	Task &operator=(Task &&other) noexcept {
+		if(this != &other) {
+			release();
+			m_handle = std::exchange(other.m_handle, {});
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task &operator=(const Task&) = delete;
+	~Task() { release(); }
+
+	bool isDone(void) const { return !m_handle || m_handle.done(); }
+
+	bool await_ready() const noexcept { return m_handle.done(); }
+	void await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		m_handle.promise().continuation = awaiting;
+	}
+	T await_resume() { return m_handle.promise().result(); }
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+
+	void release() {
+		if(!m_handle)
+			return;
+		if(m_handle.done())
+			m_handle.destroy();
+		else
+			m_handle.promise().detached = true;
+		m_handle = {};
+	}
+
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+/* co_await delay(ms): resume from the event loop after ms milliseconds */
+struct Delay {
+	int ms;
+
+	bool await_ready() const noexcept { return ms < 0; }
+	void await_suspend(std::coroutine_handle<> h) const {
+		QTimer::singleShot(ms, [h]() { h.resume(); });
+	}
+	void await_resume() const noexcept {}
+};
+
+inline Delay delay(int ms) { return Delay{ms}; }
+
+#endif // TASK_H
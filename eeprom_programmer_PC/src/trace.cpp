@@ -0,0 +1,228 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "trace.h"
+#include "serialportwriter.h"
+
+#include <QDebug>
+#include <QTimer>
+#include <QtEndian>
+
+#include <cstring>
+
+#define TRACE_HEADER_SIZE 12
+#define TRACE_RECORD_SIZE 12	/* without payload */
+
+
+bool TraceRecorder::open(const QString &fileName)
+{
+	close();
+	m_file.setFileName(fileName);
+	if(!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+
+	char header[TRACE_HEADER_SIZE] = {0};
+	memcpy(header, TRACE_MAGIC, 8);
+	qToLittleEndian<quint16>(TRACE_VERSION, header + 8);
+	m_file.write(header, TRACE_HEADER_SIZE);
+
+	m_clock.start();
+	return true;
+}
+
+void TraceRecorder::close()
+{
+	if(m_file.isOpen())
+		m_file.close();
+}
+
+void TraceRecorder::record(TraceRecord::Direction direction, commands_e cmd, const QByteArray &data)
+{
+	if(!m_file.isOpen())
+		return;
+
+	char head[TRACE_RECORD_SIZE];
+	qToLittleEndian<quint64>(quint64(m_clock.nsecsElapsed()), head);
+	head[8] = char(direction);
+	head[9] = char(cmd);
+	qToLittleEndian<quint16>(quint16(data.size()), head + 10);
+
+	m_file.write(head, TRACE_RECORD_SIZE);
+	m_file.write(data);
+}
+
+bool TraceRecorder::load(const QString &fileName, QList<TraceRecord> &records, QString &error)
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::ReadOnly)) {
+		error = file.errorString();
+		return false;
+	}
+
+	const QByteArray content = file.readAll();
+	const char *p = content.constData();
+	const char *end = p + content.size();
+
+	if(content.size() < TRACE_HEADER_SIZE || memcmp(p, TRACE_MAGIC, 8) != 0) {
+		error = "not a trace file";
+		return false;
+	}
+	if(qFromLittleEndian<quint16>(p + 8) != TRACE_VERSION) {
+		error = "unsupported trace version";
+		return false;
+	}
+	p += TRACE_HEADER_SIZE;
+
+	records.clear();
+	while(p < end) {
+		if(end - p < TRACE_RECORD_SIZE) {
+			error = "truncated record";
+			return false;
+		}
+		TraceRecord record;
+		record.ns = qFromLittleEndian<quint64>(p);
+		record.direction = TraceRecord::Direction(uint8_t(p[8]));
+		record.cmd = commands_e(uint8_t(p[9]));
+		const quint16 length = qFromLittleEndian<quint16>(p + 10);
+		p += TRACE_RECORD_SIZE;
+
+		if(end - p < length) {
+			error = "truncated record";
+			return false;
+		}
+		record.data = QByteArray(p, length);
+		p += length;
+		records.append(record);
+	}
+	return true;
+}
+
+
+TraceReplayDevice::TraceReplayDevice(QObject *parent)
+	: QIODevice(parent)
+{
+	setObjectName("replay");
+}
+
+bool TraceReplayDevice::load(const QString &fileName)
+{
+	QList<TraceRecord> records;
+	QString error;
+	if(!TraceRecorder::load(fileName, records, error)) {
+		setErrorString(QString("%1: %2").arg(fileName, error));
+		return false;
+	}
+
+	m_expected.clear();
+	m_replies.clear();
+	quint64 last = 0;
+	for(const TraceRecord &record : records) {
+		if(record.direction == TraceRecord::HOST_TO_DEVICE) {
+			m_expected.append(record);
+		}
+		else {
+			Reply reply;
+			reply.record = record;
+			reply.afterTx = m_expected.size();
+			reply.delayNs = qint64(record.ns - last);
+			m_replies.append(reply);
+		}
+		last = record.ns;
+	}
+	setObjectName(fileName);
+	return true;
+}
+
+bool TraceReplayDevice::open(OpenMode mode)
+{
+	m_rxBuffer.clear();
+	m_txSeen = 0;
+	m_nextReply = 0;
+	m_mismatches = 0;
+	m_scheduled = false;
+
+	if(!QIODevice::open(mode))
+		return false;
+	deliverNext();
+	return true;
+}
+
+qint64 TraceReplayDevice::bytesAvailable() const
+{
+	return m_rxBuffer.size() + QIODevice::bytesAvailable();
+}
+
+qint64 TraceReplayDevice::readData(char *data, qint64 maxSize)
+{
+	const qint64 n = qMin(maxSize, qint64(m_rxBuffer.size()));
+	memcpy(data, m_rxBuffer.constData(), size_t(n));
+	m_rxBuffer.remove(0, int(n));
+	return n;
+}
+
+// SerialPortWriter hands over a whole package per write
+qint64 TraceReplayDevice::writeData(const char *data, qint64 size)
+{
+	const commands_e cmd = size > 1 ? commands_e(uint8_t(data[1])) : CMD_NONE;
+
+	if(m_txSeen >= m_expected.size()) {
+		++m_mismatches;
+		qWarning() << "Replay: host sent" << EEPROM::getCommandName(cmd) << "past the end of the trace";
+	}
+	else if(m_expected[m_txSeen].cmd != cmd) {
+		++m_mismatches;
+		qWarning() << "Replay: host sent" << EEPROM::getCommandName(cmd) << "instead of"
+				   << EEPROM::getCommandName(m_expected[m_txSeen].cmd);
+	}
+	++m_txSeen;
+
+	QMetaObject::invokeMethod(this, [this, size]() {
+		emit bytesWritten(size);
+		deliverNext();
+	}, Qt::QueuedConnection);
+	return size;
+}
+
+void TraceReplayDevice::deliverNext()
+{
+	if(m_scheduled || m_nextReply >= m_replies.size())
+		return;
+
+	const Reply &reply = m_replies[m_nextReply];
+	// The device doesn't answer before it's been asked
+	if(reply.afterTx > m_txSeen)
+		return;
+
+	int delayMs = 0;
+	if(m_timing == ORIGINAL_TIMING)
+		delayMs = int((reply.delayNs + 500000) / 1000000);
+
+	m_scheduled = true;
+	QTimer::singleShot(delayMs, Qt::PreciseTimer, this, [this]() {
+		m_scheduled = false;
+		const TraceRecord &record = m_replies[m_nextReply++].record;
+		m_rxBuffer.append(SerialPortWriter::buildPackage(record.cmd, record.data));
+		emit readyRead();
+
+		if(m_nextReply == m_replies.size())
+			emit replayFinished();
+		else
+			deliverNext();
+	});
+}
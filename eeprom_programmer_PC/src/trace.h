@@ -0,0 +1,113 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QIODevice>
+#include <QList>
+
+#include "eeprom.h"
+
+/*
+ * Session traces: every package that goes through a MemoryComm, in both
+ * directions, with the time it was seen.
+ *
+ * File layout, little endian:
+ *     "EEPTRACE" <u16 version> <u16 reserved>
+ *     records: <u64 ns> <u8 direction> <u8 cmd> <u16 length> [payload]
+ * Timestamps come from a monotonic clock, counted from the start of the
+ * recording.
+ */
+
+#define TRACE_MAGIC "EEPTRACE"
+#define TRACE_VERSION 1
+
+struct TraceRecord {
+	enum Direction {
+		HOST_TO_DEVICE = 0,
+		DEVICE_TO_HOST = 1
+	};
+
+	quint64 ns = 0;
+	Direction direction = HOST_TO_DEVICE;
+	commands_e cmd = CMD_NONE;
+	QByteArray data;
+};
+
+class TraceRecorder
+{
+public:
+	TraceRecorder() = default;
+	~TraceRecorder() {close();};
+
+	bool open(const QString &fileName);
+	void close(void);
+	bool isOpen(void) const {return m_file.isOpen();};
+	QString errorString(void) const {return m_file.errorString();};
+
+	void record(TraceRecord::Direction direction, commands_e cmd, const QByteArray &data);
+
+	static bool load(const QString &fileName, QList<TraceRecord> &records, QString &error);
+
+private:
+	QFile m_file;
+	QElapsedTimer m_clock;
+};
+
+/*
+ * Plays the device side of a trace back, standing in for the serial port.
+ *
+ * Each recorded answer is held until the host has sent as many packages
+ * as it had when the answer was recorded, then delivered after the same
+ * delay it had (or right away with FAST_TIMING). Host packages that
+ * don't match the trace are counted in mismatches().
+ */
+class TraceReplayDevice : public QIODevice
+{
+	Q_OBJECT
+public:
+	enum Timing {
+		ORIGINAL_TIMING,
+		FAST_TIMING
+	};
+
+	explicit TraceReplayDevice(QObject *parent = nullptr);
+
+	bool load(const QString &fileName);
+	void setTiming(Timing timing) {m_timing = timing;};
+
+	bool open(OpenMode mode) override;
+	bool isSequential(void) const override {return true;};
+	qint64 bytesAvailable(void) const override;
+
+	int mismatches(void) const {return m_mismatches;};
+
+signals:
+	void replayFinished(void);
+
+protected:
+	qint64 readData(char *data, qint64 maxSize) override;
+	qint64 writeData(const char *data, qint64 size) override;
+
+private:
+	struct Reply {
+		TraceRecord record;
+		int afterTx = 0;		/* host packages sent before this one */
+		qint64 delayNs = 0;		/* since the package before it, either way */
+	};
+
+	void deliverNext(void);
+
+	QList<TraceRecord> m_expected;	/* host side, to check what we get */
+	QList<Reply> m_replies;
+	QByteArray m_rxBuffer;
+	Timing m_timing = ORIGINAL_TIMING;
+
+	int m_txSeen = 0;
+	int m_nextReply = 0;
+	int m_mismatches = 0;
+	bool m_scheduled = false;
+};
+
+#endif // TRACE_H
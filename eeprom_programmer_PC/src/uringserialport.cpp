@@ -0,0 +1,578 @@
+/*
+ *  EEPROM-Programmer - Read and write EEPROM memories.
+ *  Copyright (C) 2022  Fernando Coda <fcoda@pm.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "uringserialport.h"
+#include "crc16.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 256
+
+
+// <STX><CMD>[data]<CRC><ETX> into out, which has room for it
+static void assembleFrame(char *out, commands_e cmd, const QByteArray &data)
+{
+	const uint16_t crc = data.isEmpty() ? CRC16::gen(uint8_t(cmd)) : CRC16::gen(uint8_t(cmd), data);
+	out[0] = char(CMD_STARTXFER);
+	out[1] = char(cmd);
+	memcpy(out + 2, data.constData(), size_t(data.size()));
+	out += 2 + data.size();
+	out[0] = char(crc >> 8);
+	out[1] = char(crc & 0xFF);
+	out[2] = char(CMD_ENDXFER);
+}
+
+
+UringLoop::UringLoop()
+{
+	m_thread.setObjectName("serial-uring");
+}
+
+UringLoop *UringLoop::instance()
+{
+	// Never deleted: sessions may close their ports until the very end
+	static UringLoop *loop = []() -> UringLoop* {
+		UringLoop *loop = new UringLoop;
+		if(!loop->setup()) {
+			delete loop;
+			return nullptr;
+		}
+		loop->moveToThread(&loop->m_thread);
+		loop->m_thread.start();
+		QMetaObject::invokeMethod(loop, [loop]() {
+			loop->m_notifier = new QSocketNotifier(loop->m_eventFd, QSocketNotifier::Read, loop);
+			connect(loop->m_notifier, &QSocketNotifier::activated,
+					loop, &UringLoop::handleCompletions);
+		}, Qt::BlockingQueuedConnection);
+		return loop;
+	}();
+	return loop;
+}
+
+bool UringLoop::setup()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof params);
+	m_ringFd = int(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+	if(m_ringFd < 0) {
+		qDebug() << "io_uring_setup:" << strerror(errno);
+		return false;
+	}
+
+	const size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	const size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+
+	void *sq = mmap(nullptr, single ? qMax(sqSize, cqSize) : sqSize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+	void *cq = single ? sq : mmap(nullptr, cqSize, PROT_READ | PROT_WRITE,
+								  MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		qDebug() << "io_uring mmap:" << strerror(errno);
+		::close(m_ringFd);
+		return false;
+	}
+
+	char *sqRing = static_cast<char*>(sq);
+	m_sqHead = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+	m_sqMask = *reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+	m_sqEntries = params.sq_entries;
+	m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+	// SQE i always sits in slot i
+	unsigned *array = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+	for(unsigned i = 0; i < m_sqEntries; ++i)
+		array[i] = i;
+	m_sqLocalTail = m_sqSubmitted = *m_sqTail;
+
+	char *cqRing = static_cast<char*>(cq);
+	m_cqHead = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+	m_cqMask = *reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe*>(cqRing + params.cq_off.cqes);
+
+	const size_t buffersSize = size_t(2 * MAX_PORTS) * BUFFER_SIZE;
+	void *buffers = mmap(nullptr, buffersSize, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(buffers == MAP_FAILED) {
+		qDebug() << "io_uring buffers:" << strerror(errno);
+		::close(m_ringFd);
+		return false;
+	}
+	m_buffers = static_cast<char*>(buffers);
+
+	// Pinned once instead of on every transfer. A low RLIMIT_MEMLOCK
+	// only costs us that, plain READ / WRITE work on the same buffers.
+	struct iovec iov[2 * MAX_PORTS];
+	for(int i = 0; i < 2 * MAX_PORTS; ++i) {
+		iov[i].iov_base = m_buffers + i * BUFFER_SIZE;
+		iov[i].iov_len = BUFFER_SIZE;
+	}
+	m_fixed = syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_BUFFERS, iov, 2 * MAX_PORTS) == 0;
+	if(!m_fixed)
+		qDebug() << "io_uring: buffers not registered:" << strerror(errno);
+
+	m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_eventFd < 0
+			|| syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_EVENTFD, &m_eventFd, 1) < 0) {
+		qDebug() << "io_uring eventfd:" << strerror(errno);
+		::close(m_ringFd);
+		return false;
+	}
+	return true;
+}
+
+quint64 UringLoop::userData(quint32 gen, int slot, operation_e op)
+{
+	return (quint64(gen) << 32) | (quint64(slot) << 8) | quint64(op);
+}
+
+struct io_uring_sqe *UringLoop::getSqe()
+{
+	if(m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+		// Full: hand what we have to the kernel to make room
+		submit();
+		if(m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+			return nullptr;
+	}
+	struct io_uring_sqe *sqe = &m_sqes[m_sqLocalTail & m_sqMask];
+	memset(sqe, 0, sizeof *sqe);
+	++m_sqLocalTail;
+	return sqe;
+}
+
+void UringLoop::submit()
+{
+	m_submitScheduled = false;
+	const unsigned pending = m_sqLocalTail - m_sqSubmitted;
+	if(pending == 0)
+		return;
+
+	__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+	const int ret = int(syscall(__NR_io_uring_enter, m_ringFd, pending, 0, 0, nullptr, 0));
+	if(ret < 0)
+		qDebug() << "io_uring_enter:" << strerror(errno);
+	else
+		m_sqSubmitted += unsigned(ret);
+}
+
+// Once per pass of the event loop, however many ports queued something
+void UringLoop::submitSoon()
+{
+	if(m_submitScheduled)
+		return;
+	m_submitScheduled = true;
+	QMetaObject::invokeMethod(this, [this]() { submit(); }, Qt::QueuedConnection);
+}
+
+int UringLoop::attach(UringSerialPort *port)
+{
+	for(int i = 0; i < MAX_PORTS; ++i) {
+		Slot &slot = m_slots[i];
+		if(slot.port || slot.inflight > 0)
+			continue;
+		slot.port = port;
+		slot.fd = port->m_fd;
+		++slot.gen;
+		return i;
+	}
+	return -1;
+}
+
+void UringLoop::detach(int index)
+{
+	Slot &slot = m_slots[index];
+	if(!slot.port)
+		return;
+	slot.port = nullptr;
+	if(slot.inflight == 0)
+		return;
+
+	for(operation_e op : {OP_POLL_IN, OP_READ, OP_POLL_OUT, OP_WRITE}) {
+		struct io_uring_sqe *sqe = getSqe();
+		if(!sqe)
+			break;
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = userData(slot.gen, index, op);
+		sqe->user_data = userData(slot.gen, index, OP_CANCEL);
+		++slot.inflight;
+	}
+	// Now, the fd gets closed right after this
+	submit();
+}
+
+bool UringLoop::queue(int index, operation_e op, quint32 length)
+{
+	Slot &slot = m_slots[index];
+	struct io_uring_sqe *sqe = getSqe();
+	if(!sqe)
+		return false;
+
+	sqe->fd = slot.fd;
+	sqe->user_data = userData(slot.gen, index, op);
+	switch(op)
+	{
+	case OP_POLL_IN:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN | POLLERR | POLLHUP;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		break;
+	case OP_POLL_OUT:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLOUT | POLLERR | POLLHUP;
+		break;
+	case OP_READ:
+		sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->addr = quint64(quintptr(readBuffer(index)));
+		sqe->len = BUFFER_SIZE;
+		sqe->buf_index = quint16(2 * index);
+		sqe->off = quint64(-1);		/* a tty has no position */
+		break;
+	case OP_WRITE:
+		sqe->opcode = m_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->addr = quint64(quintptr(writeBuffer(index)));
+		sqe->len = length;
+		sqe->buf_index = quint16(2 * index + 1);
+		sqe->off = quint64(-1);
+		break;
+	case OP_CANCEL:
+		break;
+	}
+	++slot.inflight;
+	submitSoon();
+	return true;
+}
+
+int UringLoop::reap()
+{
+	int reaped = 0;
+	unsigned head = *m_cqHead;
+	while(head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+		const struct io_uring_cqe cqe = m_cqes[head & m_cqMask];
+		// Given back before calling out, a waitFor...() in there reaps too
+		__atomic_store_n(m_cqHead, ++head, __ATOMIC_RELEASE);
+		++reaped;
+
+		const int index = int((cqe.user_data >> 8) & 0xFF);
+		const operation_e op = operation_e(cqe.user_data & 0xFF);
+		const quint32 gen = quint32(cqe.user_data >> 32);
+		const bool more = cqe.flags & IORING_CQE_F_MORE;
+		if(index >= MAX_PORTS)
+			continue;
+
+		Slot &slot = m_slots[index];
+		if(!more)
+			--slot.inflight;
+		if(slot.port && slot.gen == gen && op != OP_CANCEL)
+			slot.port->completed(op, cqe.res, more);
+	}
+	return reaped;
+}
+
+void UringLoop::handleCompletions()
+{
+	eventfd_t count;
+	eventfd_read(m_eventFd, &count);
+	reap();
+	// Whatever the handlers queued, in one go
+	submit();
+}
+
+bool UringLoop::waitForCompletions(int msecs)
+{
+	QElapsedTimer timer;
+	timer.start();
+	for(;;) {
+		submit();
+		if(reap() > 0) {
+			submit();
+			return true;
+		}
+		const int left = msecs < 0 ? -1 : msecs - int(timer.elapsed());
+		if(msecs >= 0 && left <= 0)
+			return false;
+		struct pollfd wake = {m_eventFd, POLLIN, 0};
+		if(::poll(&wake, 1, left) <= 0)
+			return false;
+		eventfd_t count;
+		eventfd_read(m_eventFd, &count);
+	}
+}
+
+
+UringSerialPort::UringSerialPort(QObject *parent)
+	: RawSerialPort(parent)
+{
+}
+
+UringSerialPort::~UringSerialPort()
+{
+	close();
+}
+
+bool UringSerialPort::open(OpenMode mode)
+{
+	if(isOpen())
+		return false;
+
+	m_loop = UringLoop::instance();
+	if(!m_loop) {
+		setErrorString("io_uring is not available");
+		return false;
+	}
+	if(thread() != m_loop->thread()) {
+		setErrorString("not on the io_uring thread");
+		return false;
+	}
+	if(!openPort())
+		return false;
+
+	m_slot = m_loop->attach(this);
+	if(m_slot < 0) {
+		setErrorString(QString("more than %1 ports on io_uring").arg(UringLoop::MAX_PORTS));
+		closePort();
+		return false;
+	}
+	m_polling = m_loop->queue(m_slot, UringLoop::OP_POLL_IN);
+	return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+void UringSerialPort::close()
+{
+	if(m_slot >= 0)
+		m_loop->detach(m_slot);
+	m_slot = -1;
+	m_reading = m_readAgain = m_polling = false;
+	m_writeLength = 0;
+	m_writeBacklog.clear();
+	m_readBuffer.clear();
+	RawSerialPort::close();
+}
+
+qint64 UringSerialPort::bytesAvailable() const
+{
+	return QIODevice::bytesAvailable() + m_readBuffer.size();
+}
+
+qint64 UringSerialPort::bytesToWrite() const
+{
+	return m_writeLength + m_writeBacklog.size();
+}
+
+qint64 UringSerialPort::readData(char *data, qint64 maxSize)
+{
+	const qint64 n = qMin(maxSize, qint64(m_readBuffer.size()));
+	memcpy(data, m_readBuffer.constData(), size_t(n));
+	m_readBuffer.remove(0, n);
+	return n;
+}
+
+qint64 UringSerialPort::writeData(const char *data, qint64 maxSize)
+{
+	if(m_slot < 0)
+		return -1;
+	m_writeBacklog.append(data, maxSize);
+	startWrite();
+	return maxSize;
+}
+
+// Put together right in the registered buffer when it's free
+qint64 UringSerialPort::writeFrame(commands_e cmd, const QByteArray &data)
+{
+	if(m_slot < 0)
+		return -1;
+
+	const qint64 size = PKG_MINSIZE + data.size();
+	if(m_writeLength > 0 || !m_writeBacklog.isEmpty() || size > UringLoop::BUFFER_SIZE) {
+		QByteArray frame(int(size), Qt::Uninitialized);
+		assembleFrame(frame.data(), cmd, data);
+		return writeData(frame.constData(), size);
+	}
+
+	assembleFrame(m_loop->writeBuffer(m_slot), cmd, data);
+	m_writeLength = quint32(size);
+	if(!m_loop->queue(m_slot, UringLoop::OP_WRITE, m_writeLength)) {
+		errno = EBUSY;
+		fail("queue write to");
+		return -1;
+	}
+	return size;
+}
+
+void UringSerialPort::startWrite()
+{
+	if(m_writeLength > 0 || m_writeBacklog.isEmpty() || m_slot < 0)
+		return;
+
+	const int n = int(qMin<qint64>(m_writeBacklog.size(), UringLoop::BUFFER_SIZE));
+	memcpy(m_loop->writeBuffer(m_slot), m_writeBacklog.constData(), size_t(n));
+	m_writeBacklog.remove(0, n);
+	m_writeLength = quint32(n);
+	if(!m_loop->queue(m_slot, UringLoop::OP_WRITE, m_writeLength)) {
+		errno = EBUSY;
+		fail("queue write to");
+	}
+}
+
+// Nothing more comes from the ring for this port, a multishot POLLHUP
+// would otherwise keep firing until close()
+void UringSerialPort::lost(const QString &what)
+{
+	m_loop->detach(m_slot);
+	m_slot = -1;
+	fail(what);
+}
+
+void UringSerialPort::completed(UringLoop::operation_e op, int res, bool more)
+{
+	if(res == -ECANCELED)
+		return;
+
+	switch(op)
+	{
+	case UringLoop::OP_POLL_IN:
+		m_polling = more;
+		if(res < 0) {
+			errno = -res;
+			lost("poll");
+			return;
+		}
+		if(res & POLLIN) {
+			if(m_reading)
+				m_readAgain = true;
+			else
+				m_reading = m_loop->queue(m_slot, UringLoop::OP_READ);
+		}
+		if(res & (POLLHUP | POLLERR)) {
+			errno = EIO;
+			lost("lost");
+			return;
+		}
+		// Kernels without multishot poll fire once
+		if(!m_polling)
+			m_polling = m_loop->queue(m_slot, UringLoop::OP_POLL_IN);
+		break;
+
+	case UringLoop::OP_READ:
+		m_reading = false;
+		if(res < 0 && res != -EAGAIN) {
+			errno = -res;
+			lost("read from");
+			return;
+		}
+		if(res > 0) {
+			m_readSomething = true;
+			const char *data = m_loop->readBuffer(m_slot);
+			if(m_receiver) {
+				m_receiver(data, res);
+			}
+			else {
+				m_readBuffer.append(data, res);
+				emit readyRead();
+			}
+		}
+		// A full buffer or more news while reading: there's more
+		if(m_slot >= 0 && (m_readAgain || res == UringLoop::BUFFER_SIZE)) {
+			m_readAgain = false;
+			m_reading = m_loop->queue(m_slot, UringLoop::OP_READ);
+		}
+		break;
+
+	case UringLoop::OP_POLL_OUT:
+		if(res < 0) {
+			errno = -res;
+			lost("poll");
+			return;
+		}
+		m_loop->queue(m_slot, UringLoop::OP_WRITE, m_writeLength);
+		break;
+
+	case UringLoop::OP_WRITE:
+		if(res == -EAGAIN) {
+			m_loop->queue(m_slot, UringLoop::OP_POLL_OUT);
+			return;
+		}
+		if(res < 0) {
+			errno = -res;
+			lost("write to");
+			return;
+		}
+		if(quint32(res) < m_writeLength) {
+			char *buffer = m_loop->writeBuffer(m_slot);
+			memmove(buffer, buffer + res, m_writeLength - quint32(res));
+			m_writeLength -= quint32(res);
+			m_loop->queue(m_slot, UringLoop::OP_WRITE, m_writeLength);
+		}
+		else {
+			m_writeLength = 0;
+			startWrite();
+		}
+		m_wroteSomething = true;
+		emit bytesWritten(res);
+		break;
+
+	case UringLoop::OP_CANCEL:
+		break;
+	}
+}
+
+bool UringSerialPort::waitForReadyRead(int msecs)
+{
+	if(m_slot < 0)
+		return false;
+	m_readSomething = false;
+	QElapsedTimer timer;
+	timer.start();
+	while(!m_readSomething) {
+		const int left = msecs < 0 ? -1 : msecs - int(timer.elapsed());
+		if((msecs >= 0 && left <= 0) || !m_loop->waitForCompletions(left))
+			return false;
+	}
+	return true;
+}
+
+bool UringSerialPort::waitForBytesWritten(int msecs)
+{
+	if(m_slot < 0 || bytesToWrite() == 0)
+		return false;
+	m_wroteSomething = false;
+	QElapsedTimer timer;
+	timer.start();
+	while(!m_wroteSomething) {
+		const int left = msecs < 0 ? -1 : msecs - int(timer.elapsed());
+		if((msecs >= 0 && left <= 0) || !m_loop->waitForCompletions(left))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,159 @@
+#ifndef URINGSERIALPORT_H
+#define URINGSERIALPORT_H
+
+#include "rawserialport.h"
+
+#include <QObject>
+#include <QSocketNotifier>
+#include <QThread>
+
+#include <functional>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+class UringSerialPort;
+
+/*
+ * One io_uring, and one thread, for the serial ports of every session
+ * that picked --transport uring. With a station full of programmers the
+ * cost is one wakeup per batch of completions, whatever the number of
+ * ports, instead of a wakeup per port per block.
+ *
+ * Each port gets a pair of registered buffers, one for reads and one for
+ * writes. Reads are a multishot POLLIN followed by a READ_FIXED, which
+ * ptys and tty drivers complete inline instead of parking a kernel
+ * worker on every idle port. Everything queued while handling a batch
+ * goes to the kernel with a single io_uring_enter().
+ *
+ * Talks to the kernel through the raw syscalls, no liburing needed.
+ * Lives as long as the process, everything but instance() runs on its
+ * thread.
+ */
+class UringLoop : public QObject
+{
+	Q_OBJECT
+public:
+	// Started on first use. nullptr if the kernel has no io_uring.
+	static UringLoop *instance(void);
+
+	static constexpr int MAX_PORTS = 64;
+	static constexpr int BUFFER_SIZE = 4096;
+
+	enum operation_e {
+		OP_POLL_IN = 1,
+		OP_READ,
+		OP_POLL_OUT,
+		OP_WRITE,
+		OP_CANCEL
+	};
+
+	// A slot and its buffers, -1 if all are taken
+	int attach(UringSerialPort *port);
+	// Cancels what the port has in flight, the slot is reused once
+	// the kernel is done with it
+	void detach(int slot);
+
+	char *readBuffer(int slot) const {return m_buffers + (2 * slot) * BUFFER_SIZE;};
+	char *writeBuffer(int slot) const {return m_buffers + (2 * slot + 1) * BUFFER_SIZE;};
+
+	// Queue an operation on the port's fd, submitted with the batch
+	bool queue(int slot, operation_e op, quint32 length = 0);
+	// Reap completions for up to msecs, for the waitFor...() calls
+	bool waitForCompletions(int msecs);
+
+private slots:
+	void handleCompletions(void);
+
+private:
+	struct Slot {
+		UringSerialPort *port = nullptr;
+		int fd = -1;
+		quint32 gen = 0;		/* tells completions of a previous port apart */
+		int inflight = 0;		/* operations the kernel still owns */
+	};
+
+	UringLoop(void);
+	bool setup(void);
+	struct io_uring_sqe *getSqe(void);
+	void submit(void);
+	void submitSoon(void);
+	int reap(void);
+	static quint64 userData(quint32 gen, int slot, operation_e op);
+
+	int m_ringFd = -1;
+	int m_eventFd = -1;
+	QSocketNotifier *m_notifier = nullptr;
+	bool m_submitScheduled = false;
+
+	// Mapped rings
+	unsigned *m_sqHead = nullptr;
+	unsigned *m_sqTail = nullptr;
+	unsigned m_sqMask = 0;
+	unsigned m_sqEntries = 0;
+	unsigned m_sqLocalTail = 0;
+	unsigned m_sqSubmitted = 0;
+	struct io_uring_sqe *m_sqes = nullptr;
+	unsigned *m_cqHead = nullptr;
+	unsigned *m_cqTail = nullptr;
+	unsigned m_cqMask = 0;
+	struct io_uring_cqe *m_cqes = nullptr;
+
+	char *m_buffers = nullptr;	/* 2 * MAX_PORTS of BUFFER_SIZE */
+	bool m_fixed = false;		/* m_buffers registered with the ring */
+	Slot m_slots[MAX_PORTS];
+	QThread m_thread;
+};
+
+/*
+ * RawSerialPort driven by the shared UringLoop: the same termios setup,
+ * but reads and writes go through the ring. Has to live on the loop's
+ * thread.
+ *
+ * With a receiver set, data goes from the registered read buffer right
+ * into it and readyRead() is never emitted.
+ */
+class UringSerialPort : public RawSerialPort
+{
+	Q_OBJECT
+public:
+	explicit UringSerialPort(QObject *parent = nullptr);
+	~UringSerialPort();
+
+	void setReceiver(std::function<void(const char*, qint64)> receiver) {m_receiver = std::move(receiver);};
+
+	bool open(OpenMode mode) override;
+	void close(void) override;
+	qint64 bytesAvailable(void) const override;
+	qint64 bytesToWrite(void) const override;
+	bool waitForReadyRead(int msecs) override;
+	bool waitForBytesWritten(int msecs) override;
+
+	qint64 writeFrame(commands_e cmd, const QByteArray &data) override;
+
+protected:
+	qint64 readData(char *data, qint64 maxSize) override;
+	qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+	friend class UringLoop;
+
+	// From UringLoop::handleCompletions()
+	void completed(UringLoop::operation_e op, int res, bool more);
+	void startWrite(void);
+	void lost(const QString &what);
+
+	UringLoop *m_loop = nullptr;
+	int m_slot = -1;
+	std::function<void(const char*, qint64)> m_receiver;
+
+	QByteArray m_readBuffer;	/* without a receiver */
+	bool m_reading = false;		/* READ_FIXED in flight */
+	bool m_readAgain = false;	/* POLLIN came in meanwhile */
+	bool m_polling = false;		/* multishot POLLIN armed */
+	quint32 m_writeLength = 0;	/* bytes in the write buffer, in flight */
+	QByteArray m_writeBacklog;	/* behind those */
+	bool m_readSomething = false;	/* for the waitFor...() calls */
+	bool m_wroteSomething = false;
+};
+
+#endif // URINGSERIALPORT_H
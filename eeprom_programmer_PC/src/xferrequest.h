@@ -0,0 +1,74 @@
+#ifndef XFERREQUEST_H
+#define XFERREQUEST_H
+
+#include "eeprom.h"
+
+#include <QByteArray>
+#include <QString>
+
+#include <coroutine>
+#include <functional>
+#include <memory>
+
+/* Outcome of a queued job */
+struct XferResult {
+	errorcode_e error = ERROR_NONE;
+	QByteArray data;	/* memory content, for reads */
+	QString port;		/* programmer that ran it, for JobScheduler jobs */
+	qint64 wireBytes = 0;	/* packages sent and received for it */
+	qint64 mismatchAt = -1;	/* blank checks: first byte not the fill value, -1 if blank */
+
+	bool ok(void) const {return error == ERROR_NONE;}
+};
+
+/*
+ * Handle to a job queued on a MemoryComm session.
+ *
+ * The job is already queued when the request is created, so several of
+ * them can be outstanding at once. co_await it from a coroutine, or
+ * register a callback with onFinished().
+ */
+class XferRequest
+{
+public:
+	XferRequest() : m_state(std::make_shared<State>()) {}
+
+	bool isDone(void) const {return m_state->done;}
+	const XferResult &result(void) const {return m_state->result;}
+
+	// Called from the event loop once the job is over
+	void onFinished(std::function<void(const XferResult&)> callback) {
+		if(m_state->done)
+			callback(m_state->result);
+		else
+			m_state->callback = std::move(callback);
+	}
+
+	bool await_ready() const noexcept {return m_state->done;}
+	void await_suspend(std::coroutine_handle<> h) {m_state->waiter = h;}
+	XferResult await_resume() const {return m_state->result;}
+
+private:
+	friend class MemoryComm;
+	friend class JobScheduler;
+
+	struct State {
+		bool done = false;
+		XferResult result;
+		std::coroutine_handle<> waiter;
+		std::function<void(const XferResult&)> callback;
+
+		void complete(XferResult r) {
+			result = std::move(r);
+			done = true;
+			if(callback)
+				callback(result);
+			if(waiter)
+				std::exchange(waiter, {}).resume();
+		}
+	};
+
+	std::shared_ptr<State> m_state;
+};
+
+#endif // XFERREQUEST_H
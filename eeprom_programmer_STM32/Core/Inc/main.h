@@ -36,27 +36,32 @@ extern "C" {
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include "memory_table.h"
 /* USER CODE END Includes */
 
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
 #define PACKED __attribute__((packed))
 
-enum memtype_e {
-	MEMTYPE_NONE,
-	MEMTYPE_24LC16,
-	MEMTYPE_24LC64,
-	MEMTYPE_X24645,
-	MEMTYPE_24LC256,
-	MEMTYPE_mAX
-};
-// 24LC256 NOT SUPPORTED!!!
+// enum memtype_e comes from memory_table.h
 typedef enum memtype_e memtype_t;
 
-extern uint16_t g_memsize;
-extern enum memtype_e g_memtype;
+/* A socket: the I2C peripheral it hangs from and the memory in it */
+typedef struct {
+	I2C_HandleTypeDef *hi2c;
+	enum memtype_e memtype;
+	uint32_t memsize;
+	int chip;			/* strap of the chip addressed, -1 for the table's address */
+} eeprom_t;
+
+/* Channel 0 is the I2C2 socket (PB10/PB11), 1 the I2C1 one (PB6/PB7) */
+#define CHANNELS 2
+
+extern eeprom_t g_eeprom[CHANNELS];
+extern eeprom_t *g_dev;		/* the first channel of CMD_CHANNEL, where jobs go */
 extern uint8_t g_buffer[];
 
+extern I2C_HandleTypeDef hi2c1;
 extern I2C_HandleTypeDef hi2c2;
 //extern UART_HandleTypeDef huart2;
 
@@ -66,6 +71,10 @@ enum PACKED commands_e {
 	CMD_INIT			= 0x01,
 	CMD_PING			= 0x02,
 	CMD_MEMID			= 0x03,
+	CMD_TARGETS			= 0x04, /* <mask>, bit n: write to the chip strapped as n too, 0 for one chip */
+	CMD_GETSTATUS		= 0x05, /* answered CMD_CHIPSTATUS */
+	CMD_CHANNEL			= 0x06, /* <mask>, bit n: jobs go to channel n, writes to all of them at once */
+	CMD_LOOPBACK		= 0x07, /* <data[PKG_DATA_MAX]>, sent back as is, USB throughput test */
 	CMD_STARTXFER		= 0xA5, /* not really a command */
 	CMD_ENDXFER			= 0x5A, /* not really a command */
 	CMD_DISCONNECT		= 0x0F,
@@ -77,18 +86,37 @@ enum PACKED commands_e {
 	CMD_TXRX_ERR		= 0xF1, /* mid transfer error, meant to resend content        */
 
 	/* read eeprom and send to PC */
-	CMD_READMEM			= 0x60, /* Specifies which memory is required, and start TX process */
+	CMD_READMEM			= 0x60, /* <memtype><offset[4]><length[4]>, starts TX process */
 	CMD_READNEXT		= 0x61, /* Request to send next block */
+	CMD_READMEM_RLE		= 0x62, /* as CMD_READMEM, blocks may come back as CMD_MEMDATA_RLE */
+	CMD_BLANKCHECK		= 0x63, /* <memtype><offset[4]><length[4]><fill>, answered OK or NOTBLANK */
 
 	CMD_MEMDATA			= 0x70, /* Data is being sent over */
 	CMD_DATA			= 0x71, /* Simple 1byte data command */
 	CMD_INFO			= 0x72, /* PKG_DATA_MAX bytes of text */
+	CMD_MEMDATA_RLE		= 0x73, /* <length><PackBits[length]>, a CMD_MEMDATA block compressed */
+	CMD_NOTBLANK		= 0x74, /* <offset[4]>, first byte that isn't the fill value */
+	CMD_CHIPSTATUS		= 0x75, /* <mask><errorcode[CHIPS_MAX]>, of the chips of CMD_TARGETS */
 
 	/* get data from pc and write to eeprom */
-	CMD_WRITEMEM		= 0x80
+	CMD_WRITEMEM		= 0x80, /* <memtype><offset[4]><length[4]>, starts RX process */
+	CMD_FILL			= 0x81, /* <memtype><offset[4]><length[4]><pattern><verify>, no data follows */
+	CMD_STORE			= 0x82  /* <memtype><offset[4]><length[4]>, as CMD_WRITEMEM into the image store */
 };
 typedef enum commands_e command_t;
 
+/*
+ * READMEM / WRITEMEM data: memtype, then offset and length in bytes,
+ * both big endian and multiple of PKG_DATA_MAX.
+ */
+#define XFER_REQUEST_SIZE 9
+#define BLANKCHECK_REQUEST_SIZE (XFER_REQUEST_SIZE + 1)
+#define FILL_REQUEST_SIZE (XFER_REQUEST_SIZE + 2)
+
+/* Chips on a multi-chip fixture, one per value of the A2..A0 straps */
+#define CHIPS_MAX 8
+#define CHIPSTATUS_SIZE (1 + CHIPS_MAX)
+
 /*
  * PACKAGE STRUCTURE:
  * <STX><COMMAND>[<DATA><DATA>...]<CHECKSUM[1]><CHECKSUM[0]><ETX>
@@ -101,12 +129,40 @@ typedef struct {
 	uint8_t *data;
 } package_t;
 
+/* Tasks of the scheduler (PR_sched.c), the first ones run first */
+enum task_e {
+	TASK_RX,		/* frames out of the USB RX buffer */
+	TASK_PROTOCOL,	/* the commands and their answers */
+	TASK_USBTX,		/* starts sending what the others queued */
+	TASK_I2C,		/* memory jobs, a block or page per run */
+	TASKS
+};
+
+/* Events of a task, posted with sched_post() */
+#define EV_MSG		0x01U	/* something in one of its queues */
+#define EV_TIMER	0x02U	/* the one of sched_timer() went off */
+#define EV_WAKE		0x04U	/* task specific: data, room, more work */
+
+/* Fixed size messages from a task to another, see MSGQ(). n a power of 2 */
+typedef struct {
+	uint8_t *buf;
+	uint16_t size;
+	uint8_t depth;
+	uint8_t head, tail;	/* free running */
+	enum task_e owner;	/* woken with EV_MSG by msgq_put() */
+} msgq_t;
+
+#define MSGQ(name, type, n, task) \
+	static type name##_buf[n]; \
+	static msgq_t name = {(uint8_t *) name##_buf, sizeof(type), (n), 0U, 0U, (task)}
+
 
 struct memory_info {
 	uint16_t address7;
-	uint16_t size;
+	uint32_t size;
 	uint16_t pageSz;
 	uint16_t addrSz;
+	uint16_t twcMs;
 };
 
 enum PACKED errorcode_e {
@@ -130,6 +186,9 @@ typedef enum errorcode_e errorcode_t;
 /* Maximum data length in a single package */
 #define PKG_DATA_MAX 256
 
+/* cmdHasData(): the first data byte is the number of bytes after it */
+#define PKG_VARLEN (-1)
+
 /* Maximum number of times we will resend a message before giving up */
 #define RETRIES_MAX 10
 
@@ -148,19 +207,32 @@ void Error_Handler(void);
 /* USER CODE BEGIN EFP */
 
 
-HAL_StatusTypeDef EEPROM_InitMemory(enum memtype_e dev_id);
-uint16_t EEPROM_getMemSize(enum memtype_e memtype);
-int EEPROM_write(memtype_t device, const uint8_t *buffer, uint16_t register_base, uint16_t size);
-int EEPROM_writePage(memtype_t device, const uint8_t *pagebuffer, uint16_t register_address);
-int EEPROM_writeReg(memtype_t device, uint8_t reg, uint16_t register_address);
-int EEPROM_read(memtype_t device, uint8_t *buffer, uint16_t register_base, uint16_t size);
-int EEPROM_readPage(memtype_t device, uint8_t *pagebuffer, uint16_t register_address);
-int EEPROM_readReg(memtype_t device, uint8_t *reg, uint16_t register_address);
+HAL_StatusTypeDef EEPROM_InitMemory(eeprom_t *dev, enum memtype_e dev_id);
+uint32_t EEPROM_getMemSize(enum memtype_e memtype);
+uint16_t EEPROM_getPageSize(enum memtype_e memtype);
+bool EEPROM_isStrapValid(enum memtype_e memtype, uint8_t strap);
+void EEPROM_selectChip(eeprom_t *dev, int strap);
+HAL_StatusTypeDef EEPROM_isReady(eeprom_t *dev);
+int EEPROM_write(eeprom_t *dev, const uint8_t *buffer, uint32_t register_base, uint32_t size);
+int EEPROM_writePage(eeprom_t *dev, const uint8_t *pagebuffer, uint32_t register_address);
+int EEPROM_writePageStart(eeprom_t *dev, const uint8_t *pagebuffer, uint32_t register_address);
+int EEPROM_writeReg(eeprom_t *dev, uint8_t reg, uint32_t register_address);
+int EEPROM_read(eeprom_t *dev, uint8_t *buffer, uint32_t register_base, uint32_t size);
+int EEPROM_readStart(eeprom_t *dev, uint8_t *buffer, uint32_t register_address, uint16_t size);
+int EEPROM_readPage(eeprom_t *dev, uint8_t *pagebuffer, uint32_t register_address);
+int EEPROM_readReg(eeprom_t *dev, uint8_t *reg, uint32_t register_address);
+int EEPROM_wait(eeprom_t *dev, uint32_t timeout);
+
+int packbits_decode(const uint8_t *in, uint16_t len, uint8_t *out, uint16_t outmax);
+int packbits_encode(const uint8_t *in, uint16_t len, uint8_t *out, uint16_t outmax);
 
 int serial_write(const uint8_t *data, uint16_t len);
+int serial_queue(const uint8_t *data, uint16_t len);
+void serial_flush(void);
 int serial_writebyte(uint8_t byte);
 int serial_read(uint8_t *data, uint16_t len);
 int serial_readbyte(uint8_t *byte);
+uint16_t serial_readsome(uint8_t *data, uint16_t len);
 int serial_print(const char *s);
 int serial_printnum(const char *s, int num);
 int serial_println(const char *s);
@@ -172,9 +244,40 @@ int read_test();
 int write_test();
 
 int readMemory(uint8_t *);
-int readMemoryBlock(uint8_t *membuffer, uint16_t offset);
+int readMemoryBlock(uint8_t *membuffer, uint32_t offset);
 int saveMemory(const uint8_t *);
-int saveMemoryBlock(const uint8_t *membuffer, uint16_t offset);
+int saveMemoryBlock(const uint8_t *membuffer, uint32_t offset);
+errorcode_t initMemory(enum memtype_e memid);
+errorcode_t selectChannels(uint8_t mask);
+errorcode_t initChannels(uint8_t mask, enum memtype_e memid);
+uint8_t getChannels(void);
+void resetChannels(void);
+errorcode_t selectTargets(uint8_t mask);
+void getTargetStatus(uint8_t *status);
+
+uint32_t storeCapacity(void);
+bool storeValid(void);
+enum memtype_e storeMemtype(void);
+uint32_t storeLength(void);
+uint8_t storeChannels(void);
+const uint8_t *storeBlock(uint32_t offset);
+errorcode_t storeBegin(enum memtype_e memtype, uint8_t channels, uint32_t length);
+errorcode_t storeWriteBlock(const uint8_t *data, uint32_t offset);
+errorcode_t storeCommit(void);
+errorcode_t storeRunBegin(void);
+int storeRunBlock(uint32_t offset);
+
+void sched_add(enum task_e id, void (*run)(uint32_t events));
+void sched_post(enum task_e id, uint32_t events);
+void sched_timer(enum task_e id, uint32_t ms);
+void sched_tick(void);
+void sched_run(void);
+bool msgq_put(msgq_t *q, const void *msg);
+bool msgq_get(msgq_t *q, void *msg);
+void *msgq_peek(msgq_t *q);
+void msgq_drop(msgq_t *q);
+bool msgq_full(const msgq_t *q);
+bool msgq_empty(const msgq_t *q);
 
 HAL_StatusTypeDef sendErr(uint8_t);
 HAL_StatusTypeDef sendOK(void);
@@ -183,11 +286,10 @@ HAL_StatusTypeDef receiveMemory(void);
 HAL_StatusTypeDef sendMemory();
 int writeMemory(enum memtype_e memtype);
 void i2c_scanner(int);
-void uart_fsm(void);
+void app_init(void);
 
 HAL_StatusTypeDef sendCommand(uint8_t cmd);
 HAL_StatusTypeDef sendPackage(uint8_t cmd, uint8_t *data, uint16_t len);
-HAL_StatusTypeDef receivePackage(package_t *pkg);
 HAL_StatusTypeDef try_receive(package_t *pkg);
 
 /* USER CODE END EFP */
@@ -195,8 +297,13 @@ HAL_StatusTypeDef try_receive(package_t *pkg);
 /* Private defines -----------------------------------------------------------*/
 #define LED_Pin GPIO_PIN_12
 #define LED_GPIO_Port GPIOB
+#define START_Pin GPIO_PIN_0
+#define START_GPIO_Port GPIOA
 /* USER CODE BEGIN Private defines */
 
+/* START: a button or a socket-detect switch to GND, starts a standalone run */
+#define START_ACTIVE GPIO_PIN_RESET
+
 #define LED_ON  GPIO_PIN_RESET
 #define LED_OFF GPIO_PIN_SET
 
@@ -0,0 +1,41 @@
+/*
+ * memory_table.h
+ *
+ *  Supported memories and their geometry.
+ *
+ *  This header is shared by the firmware (DR_eeprom.c) and the PC
+ *  application (eeprom.h), so keep it plain C and free of HAL includes.
+ */
+
+#ifndef MEMORY_TABLE_H_
+#define MEMORY_TABLE_H_
+
+/*
+ * X(id, name, address7, size, pageSz, addrSz, twcMs)
+ *
+ *  address7: 7 bit I2C address, with pins A0:GND A1:GND A2:VCC
+ *            (block select bits, if any, set to 0)
+ *  size:     bytes
+ *  pageSz:   page write buffer size, in bytes
+ *  addrSz:   bytes of register address sent after the device address
+ *  twcMs:    maximum internal write cycle time, in ms
+ */
+#define MEMORY_TABLE(X) \
+	X(NONE,     "",                0,          0,    0,  0,  0) \
+	X(24LC16,   "24LC16",      0x50U,   0x0800UL,  16U, 1U,  5U) \
+	X(24LC64,   "24LC64",      0x54U,   0x2000UL,  32U, 2U,  5U) \
+	X(X24645,   "X24645",      0x00U,   0x2000UL,  32U, 1U, 10U) \
+	X(24LC256,  "24LC256",     0x54U,   0x8000UL,  64U, 2U,  5U) \
+	X(24LC512,  "24LC512",     0x54U,  0x10000UL, 128U, 2U,  5U) \
+	X(24LC1025, "24LC1025",    0x50U,  0x20000UL, 128U, 2U,  5U) \
+	X(24M02,    "24M02",       0x54U,  0x40000UL, 256U, 2U, 10U)
+
+#define MEMORY_TABLE_ENUM(id, name, address7, size, pageSz, addrSz, twcMs) \
+	MEMTYPE_##id,
+
+enum memtype_e {
+	MEMORY_TABLE(MEMORY_TABLE_ENUM)
+	MEMTYPE_mAX
+};
+
+#endif /* MEMORY_TABLE_H_ */
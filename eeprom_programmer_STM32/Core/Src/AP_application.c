@@ -23,10 +23,16 @@
 /*
  * Electrical connections:
  *
- * uC I2C2:
+ * uC I2C2 (channel 0):
  * 	 PB10: SCL
  * 	 PB11: SDA
  *
+ * uC I2C1 (channel 1, a second socket wired the same):
+ * 	 PB6: SCL
+ * 	 PB7: SDA
+ *
+ * PA0: START, button or socket-detect switch to GND (standalone mode)
+ *
  * EEPROM (DIP-8):
  * 	 1.  A0: GND
  * 	 2.  A1: GND
@@ -43,11 +49,86 @@
  */
 
 #define SEND(x) do {if((x) != HAL_OK) return HAL_ERROR;} while(0)
-#define RECV(x) do {if((x) != HAL_OK) return HAL_ERROR;} while(0)
 
 static int cmdHasData(uint8_t command);
 
-uint8_t        g_buffer[PKG_DATA_MAX];
+uint8_t        g_buffer[PKG_DATA_MAX];	/* block being written */
+static uint8_t s_packed[PKG_DATA_MAX];	/* variable length data, to / from a block */
+
+/* Read per pass of a blank check, words so the compare goes 4 bytes at a time */
+#define BLANKCHECK_CHUNK 1024U
+static uint32_t s_check[BLANKCHECK_CHUNK / 4];
+
+/* Page written over and over by CMD_FILL, no page is bigger than a block */
+static uint8_t s_page[PKG_DATA_MAX];
+
+/* Protocol state while a CMD_FILL writes its pages, not a command value */
+#define ST_FILLING 0x100
+/* Same, while a standalone run programs the stored image */
+#define ST_STANDALONE 0x101
+
+/* START held this long counts as a press */
+#define START_DEBOUNCE_MS 30U
+/* Half period of the LED blinking after a run that failed */
+#define BLINK_MS 100U
+/* START and the LED are looked at this often while disconnected */
+#define POLL_MS 10U
+/* Half a package and then nothing for this long, it's dropped */
+#define RX_FRAME_MS 200U
+
+/* errorcode_t of the last standalone run, -1 if none since power up */
+static int s_lastRun = -1;
+
+/*
+ * Tasks (see PR_sched.c):
+ *
+ * TASK_RX puts the packages together as the USB interrupt brings the
+ * bytes, and queues them for TASK_PROTOCOL. That one runs the protocol
+ * and hands the memory work to TASK_I2C as jobs, which answers with a
+ * result when done; a long job goes a chunk per run, so the others get
+ * their turn in between. Answers are queued for USB as they're made and
+ * TASK_USBTX starts sending them once the tasks before it are done.
+ *
+ * While a job runs the packages wait in their queue, and once that's full
+ * in the USB buffer, which holds the host back. Reads go a block ahead:
+ * the chip is read while the host takes the block before.
+ */
+
+/* A package and its data, as TASK_RX queues it */
+typedef struct {
+	command_t cmd;
+	uint16_t datalen;
+	uint8_t data[PKG_DATA_MAX];
+} frame_t;
+
+enum job_e {
+	JOB_READ,		/* a block into data */
+	JOB_WRITE,		/* a block from data */
+	JOB_STORE,		/* same, into the image store */
+	JOB_BLANKCHECK,	/* [offset, top) equal to fill? */
+	JOB_FILL,		/* [offset, top) written with s_page, read back if verify */
+	JOB_STANDALONE	/* the stored image into [offset, top) */
+};
+
+typedef struct {
+	enum job_e op;
+	uint32_t offset;
+	uint32_t top;
+	uint32_t base;		/* JOB_FILL: where the verify starts */
+	uint8_t fill;
+	bool verify;
+	uint8_t *data;		/* the job's until it's done */
+} job_t;
+
+typedef struct {
+	errorcode_t status;
+	uint32_t offset;	/* JOB_READ: of the block. Blank check: first byte that isn't fill */
+	bool notblank;
+} result_t;
+
+MSGQ(s_frames, frame_t, 2, TASK_PROTOCOL);
+MSGQ(s_jobs, job_t, 1, TASK_I2C);
+MSGQ(s_results, result_t, 1, TASK_PROTOCOL);
 
 
 HAL_StatusTypeDef sendCommand(uint8_t cmd) {
@@ -60,18 +141,18 @@ HAL_StatusTypeDef sendCommandWithData(uint8_t cmd, uint8_t data) {
 
 HAL_StatusTypeDef sendPackage(uint8_t cmd, uint8_t *data, uint16_t len) {
 
-	SEND(serial_writebyte(CMD_STARTXFER));
-	SEND(serial_writebyte(cmd));
+	// Queued as a whole, TASK_USBTX sends it along with any other answer
+	uint8_t head[2] = {CMD_STARTXFER, cmd};
+	SEND(serial_queue(head, 2));
 
 	if(data != NULL && len != 0) {
-		SEND(serial_write(data, len));
+		SEND(serial_queue(data, len));
 	}
 
-	uint8_t crc[2] = {0,0}; // TODO: crc
-	SEND(serial_write(crc, 2));
-
-	SEND(serial_writebyte(CMD_ENDXFER));
+	uint8_t tail[3] = {0, 0, CMD_ENDXFER}; // TODO: crc
+	SEND(serial_queue(tail, 3));
 
+	sched_post(TASK_USBTX, EV_WAKE);
 	return HAL_OK;
 }
 
@@ -83,58 +164,30 @@ HAL_StatusTypeDef sendOK(void) {
 	return sendCommand(CMD_OK);
 }
 
-HAL_StatusTypeDef receivePackage(package_t *pkg) {
-
-	//	<STX><COMMAND>[<DATA><DATA>...]<CHECKSUM[1]><CHECKSUM[0]><ETX>
-	
-	if(!serial_available())
-		return HAL_ERROR;
-
-	uint8_t *buf = g_buffer;
-	uint8_t tmp[3];
-
-	if(pkg == NULL)
-		return HAL_ERROR;
-	
-	pkg->cmd = CMD_ERR;
-	pkg->data = NULL;
-
-	RECV(serial_read(tmp, 2));
-
-	if(tmp[0] != CMD_STARTXFER)
-		return HAL_ERROR;
-
-	pkg->cmd = tmp[1];
-	pkg->datalen = cmdHasData(pkg->cmd);
-
-	if(pkg->datalen != 0)
-	{
-		RECV(serial_read(buf, pkg->datalen));
-		pkg->data = buf;
-	}
-
-	RECV(serial_read(tmp, 3));
-	
-	// TODO: { tmp[1], tmp[0] } is the checksum, we can ignore it...
-	if(tmp[2] != CMD_ENDXFER)
-		return HAL_ERROR;
-
-	return HAL_OK;
-}
-
 int cmdHasData(command_t command) {
 	switch(command) {
 
 	case CMD_INIT:  return 0;
 	case CMD_MEMID: return 1;
-
-	case CMD_READMEM: return 1; /* contains the memtype_e */
+	case CMD_TARGETS: return 1;
+	case CMD_CHANNEL: return 1;
+	case CMD_LOOPBACK: return PKG_DATA_MAX;
+	case CMD_GETSTATUS: return 0;
+	case CMD_CHIPSTATUS: return CHIPSTATUS_SIZE;
+
+	case CMD_READMEM: return XFER_REQUEST_SIZE;
+	case CMD_READMEM_RLE: return XFER_REQUEST_SIZE;
+	case CMD_BLANKCHECK: return BLANKCHECK_REQUEST_SIZE;
+	case CMD_FILL: return FILL_REQUEST_SIZE;
+	case CMD_NOTBLANK: return 4;
 	case CMD_READNEXT: return 0;
 	case CMD_MEMDATA: return PKG_DATA_MAX;
 	case CMD_DATA: return 1;
 	case CMD_INFO: return PKG_DATA_MAX;
+	case CMD_MEMDATA_RLE: return PKG_VARLEN;
 
-	case CMD_WRITEMEM: return 1;
+	case CMD_WRITEMEM: return XFER_REQUEST_SIZE;
+	case CMD_STORE: return XFER_REQUEST_SIZE;
 
 	case CMD_OK:  return 0;
 	case CMD_ERR: return 1;
@@ -152,33 +205,120 @@ int cmdHasData(command_t command) {
 	return 0;
 }
 
-static errorcode_t sendMemoryBlock(uint8_t cmd, uint16_t offset)
+/*
+ * With rle, a block that compresses goes as CMD_MEMDATA_RLE: a blank
+ * one is 5 bytes instead of 256, and USB stops being the slow part.
+ */
+static errorcode_t sendMemoryBlock(uint8_t *buf, bool rle)
 {
-//	package_t pkg;
-	uint8_t *buf = g_buffer;
-
-	if(readMemoryBlock(buf, offset) != HAL_OK) {
-		return ERROR_READMEM;
+	// Only if shorter than raw, length byte included
+	int packed = rle ? packbits_encode(buf, PKG_DATA_MAX, s_packed + 1, PKG_DATA_MAX - 2) : -1;
+	if(packed >= 0) {
+		s_packed[0] = (uint8_t) packed;
+		if(sendPackage(CMD_MEMDATA_RLE, s_packed, packed + 1) != HAL_OK)
+			return ERROR_COMM;
 	}
-	if(sendPackage(cmd, buf, PKG_DATA_MAX) != HAL_OK) {
+	else if(sendPackage(CMD_MEMDATA, buf, PKG_DATA_MAX) != HAL_OK) {
 		return ERROR_COMM;
 	}
 	return ERROR_NONE;
 }
 
-static int sendNext(uint16_t mem_idx, int *st) {
-	errorcode_t ret = sendMemoryBlock(CMD_MEMDATA, mem_idx);
-	if (ret == ERROR_NONE) {
-		*st = CMD_READNEXT;
+static uint32_t get_u32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] <<  8) |  (uint32_t)p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)(value >> 24);
+	p[1] = (uint8_t)(value >> 16);
+	p[2] = (uint8_t)(value >>  8);
+	p[3] = (uint8_t) value;
+}
+
+/*
+ * One chunk of a blank check, from *offset up to top. Everything equal
+ * to fill: returns 0 and moves *offset past the chunk. Otherwise returns
+ * 1 with *offset on the first byte that differs, or -1 if the read
+ * failed.
+ */
+static int blankCheckChunk(uint32_t *offset, uint32_t top, uint8_t fill)
+{
+	uint32_t size = top - *offset;
+	if(size > BLANKCHECK_CHUNK)
+		size = BLANKCHECK_CHUNK;
+
+	if(EEPROM_read(g_dev, (uint8_t *) s_check, *offset, size) != HAL_OK)
+		return -1;
+
+	// Offsets and lengths are whole blocks, so are the chunks
+	const uint32_t pattern = fill * 0x01010101U;
+	for(uint32_t i = 0; i < size / 4; ++i)
+	{
+		if(s_check[i] != pattern) {
+			const uint8_t *bytes = (const uint8_t *) &s_check[i];
+			uint32_t j = 0;
+			while(bytes[j] == fill)
+				++j;
+			*offset += 4 * i + j;
+			return 1;
+		}
 	}
-	else {
-		sendErr(ret);
-		if (ret == ERROR_COMM)
-			*st = 0;
-		else
-			*st = 1;
+	*offset += size;
+	return 0;
+}
+
+/*
+ * Parse a READMEM / WRITEMEM request into [*base, *top).
+ * Returns the error to report, or ERROR_NONE.
+ */
+static errorcode_t parseXferRequest(const uint8_t *data, uint32_t *base, uint32_t *top)
+{
+	if(data[0] != g_dev->memtype)
+		return ERROR_MEMID;
+
+	uint32_t offset = get_u32(&data[1]);
+	uint32_t length = get_u32(&data[5]);
+
+	if(length == 0 || offset % PKG_DATA_MAX != 0 || length % PKG_DATA_MAX != 0 ||
+	   offset >= g_dev->memsize || length > g_dev->memsize - offset)
+		return ERROR_MEMIDX;
+
+	*base = offset;
+	*top  = offset + length;
+	return ERROR_NONE;
+}
+
+/* START went active and stayed for START_DEBOUNCE_MS, once per press */
+static bool startPressed(void)
+{
+	static uint32_t since = 0;
+	static bool taken = false;
+
+	if(HAL_GPIO_ReadPin(START_GPIO_Port, START_Pin) != START_ACTIVE) {
+		since = 0;
+		taken = false;
+		return false;
 	}
-	return (int) ret;
+	if(since == 0)
+		since = HAL_GetTick() | 1U;
+	if(taken || HAL_GetTick() - since < START_DEBOUNCE_MS)
+		return false;
+	taken = true;
+	return true;
+}
+
+/* While disconnected: LED on if the last run went fine, blinking if it didn't */
+static void showLastRun(void)
+{
+	if(s_lastRun == ERROR_NONE)
+		led_on();
+	else if(s_lastRun > 0 && (HAL_GetTick() / BLINK_MS) % 2U == 0U)
+		led_on();
+	else
+		led_off();
 }
 
 static bool isCommandValid(int st, command_t cmd)
@@ -190,8 +330,16 @@ static bool isCommandValid(int st, command_t cmd)
 		break;
 	case 1:
 		if(		cmd == CMD_READMEM ||
+				cmd == CMD_READMEM_RLE ||
+				cmd == CMD_BLANKCHECK ||
 				cmd == CMD_WRITEMEM ||
+				cmd == CMD_FILL ||
+				cmd == CMD_STORE ||
+				cmd == CMD_TARGETS ||
+				cmd == CMD_CHANNEL ||
+				cmd == CMD_GETSTATUS ||
 				cmd == CMD_PING ||
+				cmd == CMD_LOOPBACK ||
 				cmd == CMD_DISCONNECT ||
 				cmd == CMD_MEMID)
 			return true;
@@ -203,203 +351,647 @@ static bool isCommandValid(int st, command_t cmd)
 }
 
 
-/*********************************************************/
+/************************* TASK_RX ***********************/
+
+enum {RX_START, RX_CMD, RX_LENGTH, RX_DATA, RX_TAIL};
+
+/* The package being put together */
+static struct {
+	int stage;
+	uint16_t have;		/* bytes of the stage so far */
+	uint8_t tail[3];
+	frame_t frame;
+} s_rx;
 
-void uart_fsm(void)
+/* Up to need bytes at dst, true once they're all there */
+static bool rxGather(uint8_t *dst, uint16_t need)
 {
-	static int st=0;
-	static uint32_t timeout = TIMEOUT_MS;
-	static uint16_t retries = 0;
-	static package_t package = {0};
-	static uint16_t mem_idx = 0;
-	HAL_StatusTypeDef ret;
-
-	if(st != 0 && HAL_GetTick() > timeout) {
-		st = 0;
+	s_rx.have += serial_readsome(dst + s_rx.have, need - s_rx.have);
+	if(s_rx.have < need)
+		return false;
+	s_rx.have = 0;
+	return true;
+}
+
+static void rxTask(uint32_t events)
+{
+	//	<STX><COMMAND>[<DATA><DATA>...]<CHECKSUM[1]><CHECKSUM[0]><ETX>
+	frame_t *f = &s_rx.frame;
+	uint8_t byte;
+	int len;
+
+	if(events & EV_TIMER) {
+		s_rx.stage = RX_START;
+		s_rx.have = 0;
 	}
 
-	switch (st)
+	// With the queue full the bytes stay in the USB buffer, TASK_PROTOCOL
+	// wakes us up when it takes a package
+	while(!msgq_full(&s_frames))
 	{
-	case 0: /* disconnected */
-		led_off();
-		// try to establish connection with serial port server
-		ret = receivePackage(&package);
-
-		if (ret == HAL_OK) {
-			if(package.cmd == CMD_INIT) {
-				sendCommand(CMD_INIT);
-				led_on();
-				st = CMD_MEMID;
-				timeout = HAL_GetTick()+TIMEOUT_MS;
-			}
-		}
-		break;
-
-	case CMD_MEMID:
-		ret = receivePackage(&package);
-		if(ret == HAL_OK && package.cmd == CMD_MEMID)
+		bool more = true;
+		switch(s_rx.stage)
 		{
-			enum memtype_e memid = package.data[0];
-			if(EEPROM_InitMemory(memid) == HAL_OK) {
-				sendCommand(CMD_OK);
-				st = 1;
+		case RX_START:
+			// Anything before a start is dropped
+			more = serial_readsome(&byte, 1) != 0;
+			if(more && byte == CMD_STARTXFER)
+				s_rx.stage = RX_CMD;
+			break;
+
+		case RX_CMD:
+			more = serial_readsome(&byte, 1) != 0;
+			if(!more)
+				break;
+			f->cmd = byte;
+			len = cmdHasData(f->cmd);
+			if(len == PKG_VARLEN) {
+				s_rx.stage = RX_LENGTH;
 			}
 			else {
-				sendErr(ERROR_MEMID);
-				st = 0;
+				f->datalen = (uint16_t) len;
+				s_rx.stage = len != 0 ? RX_DATA : RX_TAIL;
 			}
+			break;
+
+		case RX_LENGTH:
+			// Length byte kept as data[0], like the PC does
+			more = serial_readsome(&byte, 1) != 0;
+			if(!more)
+				break;
+			f->data[0] = byte;
+			f->datalen = 1U + byte;
+			s_rx.have = 1;
+			s_rx.stage = RX_DATA;
+			break;
+
+		case RX_DATA:
+			more = rxGather(f->data, f->datalen);
+			if(more)
+				s_rx.stage = RX_TAIL;
+			break;
+
+		case RX_TAIL:
+			more = rxGather(s_rx.tail, 3);
+			if(!more)
+				break;
+			s_rx.stage = RX_START;
+			// TODO: { tail[1], tail[0] } is the checksum, we can ignore it...
+			if(s_rx.tail[2] == CMD_ENDXFER)
+				msgq_put(&s_frames, f);
+			break;
+		}
+
+		if(!more) {
+			sched_timer(TASK_RX, s_rx.stage != RX_START ? RX_FRAME_MS : 0U);
+			return;
 		}
+	}
+}
+
+
+/************************* TASK_I2C **********************/
+
+static void i2cTask(uint32_t events)
+{
+	static job_t job;
+	static bool running = false;
+	result_t result = {ERROR_NONE, 0, false};
+	bool more = false;
+
+	(void) events;
+	if(!running && !msgq_get(&s_jobs, &job))
+		return;
+	running = true;
+
+	switch(job.op)
+	{
+	case JOB_READ:
+		if(readMemoryBlock(job.data, job.offset) != HAL_OK)
+			result.status = ERROR_READMEM;
+		break;
+
+	case JOB_WRITE:
+		if(saveMemoryBlock(job.data, job.offset) != HAL_OK)
+			result.status = ERROR_WRITEMEM;
 		break;
 
-	case 1: /* waiting to receive a package */
-		ret = receivePackage(&package);
-		if(ret != HAL_OK)
+	case JOB_STORE:
+		if(storeWriteBlock(job.data, job.offset) != ERROR_NONE)
+			result.status = ERROR_WRITEMEM;
+		break;
+
+	case JOB_BLANKCHECK: /* a chunk per run */
+		switch(blankCheckChunk(&job.offset, job.top, job.fill))
+		{
+		case 0:
+			more = job.offset < job.top;
+			break;
+		case 1:
+			result.notblank = true;
 			break;
+		default:
+			result.status = ERROR_READMEM;
+			break;
+		}
+		break;
 
-		if(!isCommandValid(st,package.cmd)) {
-			st = 0;
+	case JOB_FILL: /* a page per run, write_aux() polls for the ACK after the last one */
+		if(EEPROM_writePage(g_dev, s_page, job.offset) != HAL_OK) {
+			result.status = ERROR_WRITEMEM;
 			break;
 		}
+		job.offset += EEPROM_getPageSize(g_dev->memtype);
+		if(job.offset < job.top) {
+			more = true;
+		}
+		else if(job.verify) {
+			// Answered as a blank check of the same range
+			job.op = JOB_BLANKCHECK;
+			job.offset = job.base;
+			more = true;
+		}
+		break;
 
-		timeout = HAL_GetTick()+TIMEOUT_MS;
-		st = package.cmd;
+	case JOB_STANDALONE: /* a block per run, the LED blinks along */
+		if(storeRunBlock(job.offset) != HAL_OK) {
+			result.status = ERROR_WRITEMEM;
+			break;
+		}
+		HAL_GPIO_TogglePin(LED_GPIO_Port, LED_Pin);
+		job.offset += PKG_DATA_MAX;
+		more = job.offset < job.top;
 		break;
+	}
+
+	if(more) {
+		sched_post(TASK_I2C, EV_WAKE);
+		return;
+	}
+	running = false;
+	result.offset = job.offset;
+	msgq_put(&s_results, &result);
+}
+
+
+/*********************** TASK_USBTX **********************/
+
+/* What the tasks before queued, in as few USB transfers as it takes */
+static void usbTxTask(uint32_t events)
+{
+	(void) events;
+	serial_flush();
+}
+
+
+/********************* TASK_PROTOCOL *********************/
+
+#define NO_BLOCK 0xFFFFFFFFU
+
+static int s_st = 0;
+static bool s_busy = false;		/* a job of ours in TASK_I2C */
+static uint16_t s_retries = 0;
+static uint32_t s_memIdx = 0;
+static uint32_t s_memTop = 0;
+static bool s_rle = false;		/* the read asked for CMD_MEMDATA_RLE */
+static bool s_toStore = false;	/* CMD_MEMDATA goes to the image store */
+
+/* Blocks of a read: the host's and the next one, read ahead */
+static uint8_t s_block[2][PKG_DATA_MAX];
+static uint32_t s_blockAt[2] = {NO_BLOCK, NO_BLOCK};	/* offset each one holds */
+static int s_readInto = 0;		/* s_block of the JOB_READ going */
+static bool s_want = false;		/* the host asked for s_memIdx, still being read */
+
+static void submit(const job_t *job)
+{
+	msgq_put(&s_jobs, job);
+	s_busy = true;
+}
+
+/* The session times out if the host goes quiet, while disconnected START is polled */
+static void rearm(void)
+{
+	sched_timer(TASK_PROTOCOL, s_st == 0 ? POLL_MS : TIMEOUT_MS);
+}
+
+static bool isReading(void)
+{
+	return s_st == CMD_TXRX_ACK || s_st == CMD_READNEXT;
+}
+
+static void readBlock(uint32_t offset)
+{
+	// Not over the host's block, it may have to go again
+	s_readInto = s_blockAt[0] == s_memIdx ? 1 : 0;
+	s_blockAt[s_readInto] = NO_BLOCK;
+	job_t job = {.op = JOB_READ, .offset = offset, .data = s_block[s_readInto]};
+	submit(&job);
+}
+
+/* s_memIdx's block to the host, once it's read; then the next one is read */
+static void sendNext(void)
+{
+	int b = s_blockAt[0] == s_memIdx ? 0 : s_blockAt[1] == s_memIdx ? 1 : -1;
+	if(b < 0) {
+		s_want = true;
+		// Read ahead and failed: once more
+		if(!s_busy)
+			readBlock(s_memIdx);
+		return;
+	}
+	s_want = false;
 
-	case CMD_READMEM: /* received READMEM */
-		if(package.data[0] == g_memtype) {
-			mem_idx = 0;
+	errorcode_t ret = sendMemoryBlock(s_block[b], s_rle);
+	if(ret != ERROR_NONE) {
+		sendErr(ret);
+		s_st = 0;
+		return;
+	}
+	s_st = CMD_READNEXT;
+
+	const uint32_t next = s_memIdx + PKG_DATA_MAX;
+	if(!s_busy && next < s_memTop && s_blockAt[b ^ 1] != next)
+		readBlock(next);
+}
+
+/* Disconnected: START, and the LED showing how the last run went */
+static void idle(void)
+{
+	showLastRun();
+	if(startPressed()) {
+		// Standalone run, the host isn't needed
+		errorcode_t err = storeRunBegin();
+		if(err == ERROR_NONE) {
+			job_t job = {.op = JOB_STANDALONE, .offset = 0, .top = g_dev->memsize};
+			submit(&job);
+			s_st = ST_STANDALONE;
+		}
+		s_lastRun = err;
+	}
+}
+
+/* State 1, a valid command */
+static void command(const frame_t *f)
+{
+	uint8_t reply[CHIPSTATUS_SIZE];
+	errorcode_t err;
+	job_t job = {0};
+
+	switch(f->cmd)
+	{
+	case CMD_MEMID:
+		// Another chip in the socket, no need to go through INIT again
+		if(initMemory(f->data[0]) == ERROR_NONE) {
 			sendCommand(CMD_OK);
-			timeout = HAL_GetTick()+TIMEOUT_MS;
-			st = CMD_TXRX_ACK;
 		}
 		else {
 			sendErr(ERROR_MEMID);
-			st = 1;
+			s_st = 0;
 		}
 		break;
 
-	case CMD_TXRX_ACK: /* waiting to send data */
-		ret = receivePackage(&package);
-		if(ret != HAL_OK)
-			break;
+	case CMD_READMEM:
+	case CMD_READMEM_RLE:
+		s_rle = f->cmd == CMD_READMEM_RLE;
+		err = parseXferRequest(f->data, &s_memIdx, &s_memTop);
+		if(err == ERROR_NONE) {
+			sendCommand(CMD_OK);
+			s_st = CMD_TXRX_ACK;
+			// The first block is read before the host asks
+			s_blockAt[0] = s_blockAt[1] = NO_BLOCK;
+			s_want = false;
+			readBlock(s_memIdx);
+		}
+		else {
+			sendErr(err);
+		}
+		break;
 
-		if(package.cmd == CMD_READNEXT)
-		{
-			sendNext(mem_idx, &st);
-			retries = 0;
+	case CMD_WRITEMEM:
+		s_toStore = false;
+		err = parseXferRequest(f->data, &s_memIdx, &s_memTop);
+		if(err == ERROR_NONE) {
+			s_st = CMD_MEMDATA;
+			sendCommand(CMD_OK);
 		}
 		else {
+			sendErr(err);
+		}
+		break;
+
+	case CMD_STORE: /* a whole image for standalone runs */
+		s_toStore = true;
+		err = parseXferRequest(f->data, &s_memIdx, &s_memTop);
+		if(err == ERROR_NONE && s_memIdx != 0)
+			err = ERROR_MEMIDX;
+		if(err == ERROR_NONE)
+			err = storeBegin(g_dev->memtype, getChannels(), s_memTop);
+		if(err == ERROR_NONE) {
+			s_st = CMD_MEMDATA;
+			sendCommand(CMD_OK);
+		}
+		else {
+			sendErr(err);
+		}
+		break;
+
+	case CMD_BLANKCHECK:
+		err = parseXferRequest(f->data, &job.offset, &job.top);
+		if(err == ERROR_NONE) {
+			job.op = JOB_BLANKCHECK;
+			job.fill = f->data[XFER_REQUEST_SIZE];
+			submit(&job);
+			s_st = CMD_NOTBLANK;
+		}
+		else {
+			sendErr(err);
+		}
+		break;
+
+	case CMD_FILL:
+		err = parseXferRequest(f->data, &job.offset, &job.top);
+		if(err == ERROR_NONE) {
+			job.op = JOB_FILL;
+			job.fill = f->data[XFER_REQUEST_SIZE];
+			job.verify = f->data[XFER_REQUEST_SIZE + 1] != 0;
+			job.base = job.offset;
+			memset(s_page, job.fill, sizeof s_page);
+			submit(&job);
+			s_st = ST_FILLING;
+		}
+		else {
+			sendErr(err);
+		}
+		break;
+
+	case CMD_TARGETS: /* chips written together from now on */
+		err = selectTargets(f->data[0]);
+		if(err == ERROR_NONE)
+			sendCommand(CMD_OK);
+		else
+			sendErr(err);
+		break;
+
+	case CMD_CHANNEL: /* socket(s) the next jobs go to */
+		err = selectChannels(f->data[0]);
+		if(err == ERROR_NONE)
+			sendCommand(CMD_OK);
+		else
+			sendErr(err);
+		break;
+
+	case CMD_GETSTATUS:
+		getTargetStatus(reply);
+		sendPackage(CMD_CHIPSTATUS, reply, CHIPSTATUS_SIZE);
+		break;
+
+	case CMD_PING:
+		sendCommand(CMD_TXRX_ACK);
+		break;
+
+	case CMD_LOOPBACK: /* no I2C, the link alone */
+		sendPackage(CMD_LOOPBACK, (uint8_t *) f->data, PKG_DATA_MAX);
+		break;
+
+	case CMD_DISCONNECT:
+	default:
+		s_st = 0;
+		break;
+	}
+}
+
+/* CMD_MEMDATA state: a block to write */
+static void memoryData(const frame_t *f)
+{
+	// Copied, so the package's place takes the next one while this is written
+	if(f->cmd == CMD_MEMDATA_RLE) {
+		// A whole block or nothing, it can't be half written
+		if(packbits_decode(f->data + 1, f->datalen - 1, g_buffer, PKG_DATA_MAX) != PKG_DATA_MAX) {
+			sendErr(ERROR_COMM);
+			s_st = 1;
+			return;
+		}
+	}
+	else if(f->cmd == CMD_MEMDATA) {
+		memcpy(g_buffer, f->data, PKG_DATA_MAX);
+	}
+	else {
+		if(f->cmd != CMD_ERR)
 			sendErr(ERROR_UNKNOWN);
-			st = 0;
+		s_st = 0;
+		return;
+	}
+
+	if(s_memIdx + PKG_DATA_MAX > s_memTop) {
+		sendErr(ERROR_MEMIDX);
+		s_st = 0;
+		return;
+	}
+	job_t job = {.op = s_toStore ? JOB_STORE : JOB_WRITE, .offset = s_memIdx, .data = g_buffer};
+	submit(&job);
+}
+
+static void received(const frame_t *f)
+{
+	switch(s_st)
+	{
+	case 0: /* disconnected */
+		// try to establish connection with serial port server
+		if(f->cmd == CMD_INIT) {
+			s_lastRun = -1;
+			resetChannels();
+			sendCommand(CMD_INIT);
+			led_on();
+			s_st = CMD_MEMID;
 		}
 		break;
 
-	case CMD_READNEXT: /* Chunk of memory sent. Waiting acknowledge */
-		ret = receivePackage(&package);
-		if(ret != HAL_OK)
-			break;
+	case CMD_MEMID:
+		if(f->cmd == CMD_MEMID) {
+			if(initMemory(f->data[0]) == ERROR_NONE) {
+				sendCommand(CMD_OK);
+				s_st = 1;
+			}
+			else {
+				sendErr(ERROR_MEMID);
+				s_st = 0;
+			}
+		}
+		else if(f->cmd == CMD_INIT) {
+			// The host probed us and is now connecting for real
+			sendCommand(CMD_INIT);
+		}
+		break;
 
-		if(package.cmd == CMD_TXRX_ACK) {
+	case 1: /* waiting for a command */
+		if(isCommandValid(s_st, f->cmd))
+			command(f);
+		else
+			s_st = 0;
+		break;
+
+	case CMD_TXRX_ACK: /* waiting to send data */
+		if(f->cmd == CMD_READNEXT) {
+			sendNext();
+			s_retries = 0;
+		}
+		else {
+			sendErr(ERROR_UNKNOWN);
+			s_st = 0;
+		}
+		break;
+
+	case CMD_READNEXT: /* Chunk of memory sent. Waiting acknowledge */
+		if(f->cmd == CMD_TXRX_ACK) {
 			// go send next chunk
-			mem_idx += PKG_DATA_MAX;
-			if(mem_idx >= g_memsize) {
+			s_memIdx += PKG_DATA_MAX;
+			if(s_memIdx >= s_memTop) {
 				// PC is doing some stupid shit
 				sendErr(ERROR_MEMIDX);
-				st = 1;
+				s_st = 1;
 			}
 			else {
-				st = CMD_TXRX_ACK;
+				s_st = CMD_TXRX_ACK;
 			}
 		}
-		else if(package.cmd == CMD_TXRX_DONE) {
-			st = 1;
+		else if(f->cmd == CMD_TXRX_DONE) {
+			s_st = 1;
 		}
-		else if(package.cmd == CMD_TXRX_ERR && retries < RETRIES_MAX) {
-			// resend current chunk
-			sendNext(mem_idx, &st);
-			++retries;
+		else if(f->cmd == CMD_TXRX_ERR && s_retries < RETRIES_MAX) {
+			// resend current chunk, still in its s_block
+			sendNext();
+			++s_retries;
 		}
 		else {
 			// something went wrong
-			if(retries >= RETRIES_MAX)
+			if(s_retries >= RETRIES_MAX)
 				sendErr(ERROR_MAX_RETRY);
 		//	sendCommand(CMD_DISCONNECT);
-			st = 0;
+			s_st = 0;
 		}
+		break;
+
+	case CMD_MEMDATA: /* wait to receive memory data */
+		memoryData(f);
+		break;
 
-		timeout = HAL_GetTick()+TIMEOUT_MS;
+	default:
+		s_st = 0;
 		break;
+	}
+}
 
-	case CMD_WRITEMEM:
+/* TASK_I2C is done with the job, the answer depends on what it was */
+static void jobDone(const result_t *r)
+{
+	uint8_t reply[4];
 
-		if(package.data[0] == g_memtype) {
-			mem_idx = 0;
-			timeout = HAL_GetTick()+TIMEOUT_MS;
-			st = CMD_MEMDATA;
-			sendCommand(CMD_OK);
+	switch(s_st)
+	{
+	case CMD_TXRX_ACK:
+	case CMD_READNEXT:
+		if(r->status == ERROR_NONE)
+			s_blockAt[s_readInto] = r->offset;
+		if(s_want && r->status != ERROR_NONE && r->offset == s_memIdx) {
+			sendErr(ERROR_READMEM);
+			s_st = 1;
 		}
-		else {
-			st = 1;
-			sendErr(ERROR_MEMID);
+		else if(s_want) {
+			sendNext();
 		}
 		break;
 
-	case CMD_MEMDATA: /* wait to receive memory data */
-		ret = receivePackage(&package);
-		if(ret != HAL_OK)
+	case CMD_MEMDATA:
+		if(r->status != ERROR_NONE) {
+			sendErr(ERROR_WRITEMEM);
+			s_st = 1;
 			break;
-
-		if(package.cmd == CMD_MEMDATA)
-		{
-			int status = HAL_OK;
-			if((mem_idx + package.datalen) <= g_memsize) {
-				// write to eeprom the content received
-				status = saveMemoryBlock(package.data, mem_idx);
-				if(status == HAL_OK) {
-					mem_idx += package.datalen;
-					if(mem_idx >= g_memsize) {
-						sendCommand(CMD_TXRX_DONE);
-						st = 1;
-					}
-					else {
-						sendCommand(CMD_TXRX_ACK);
-					}
-				}
-				else {
-					sendErr(ERROR_WRITEMEM);
-					st = 1;
-				}
-			}
-			else {
-				sendErr(ERROR_MEMIDX);
-				st = 0;
-			}
+		}
+		s_memIdx += PKG_DATA_MAX;
+		if(s_memIdx < s_memTop) {
+			sendCommand(CMD_TXRX_ACK);
+		}
+		else if(s_toStore && storeCommit() != ERROR_NONE) {
+			sendErr(ERROR_WRITEMEM);
+			s_st = 1;
 		}
 		else {
-			if(package.cmd != CMD_ERR)
-				sendErr(ERROR_UNKNOWN);
-			st = 0;
+			sendCommand(CMD_TXRX_DONE);
+			s_st = 1;
 		}
-
-		timeout = HAL_GetTick()+TIMEOUT_MS;
 		break;
 
-	case CMD_PING:
-		sendCommand(CMD_TXRX_ACK);
-		timeout = HAL_GetTick()+TIMEOUT_MS;
-		st = 1;
+	case CMD_NOTBLANK:
+	case ST_FILLING:
+		if(r->status != ERROR_NONE) {
+			sendErr(r->status);
+		}
+		else if(r->notblank) {
+			put_u32(reply, r->offset);
+			sendPackage(CMD_NOTBLANK, reply, 4);
+		}
+		else {
+			sendCommand(CMD_OK);
+		}
+		s_st = 1;
 		break;
 
-	case CMD_DISCONNECT:
-		st = 0;
+	case ST_STANDALONE:
+		s_lastRun = r->status;
+		s_st = 0;
 		break;
 
 	default:
-		st=0;
+		// Read ahead, and the host was done with the read
 		break;
 	}
 }
-// TODO: split this...
+
+static void protocolTask(uint32_t events)
+{
+	result_t result;
+	frame_t *f;
+
+	if(msgq_get(&s_results, &result)) {
+		s_busy = false;
+		jobDone(&result);
+		rearm();
+	}
+
+	if(events & EV_TIMER) {
+		if(s_busy)
+			sched_timer(TASK_PROTOCOL, TIMEOUT_MS);	/* the job is what's going on */
+		else if(s_st != 0)
+			s_st = 0;
+		else
+			idle();
+		if(!s_busy)
+			rearm();
+	}
+
+	// Packages wait for the job, but for those of a read: the job is the
+	// next block, read while the host takes this one
+	while((!s_busy || isReading()) && (f = msgq_peek(&s_frames)) != NULL) {
+		received(f);
+		msgq_drop(&s_frames);
+		sched_post(TASK_RX, EV_WAKE);
+		rearm();
+	}
+}
+
+
+/*********************************************************/
+
+void app_init(void)
+{
+	sched_add(TASK_RX, rxTask);
+	sched_add(TASK_PROTOCOL, protocolTask);
+	sched_add(TASK_USBTX, usbTxTask);
+	sched_add(TASK_I2C, i2cTask);
+	// Whatever USB got before now
+	sched_post(TASK_RX, EV_WAKE);
+	sched_timer(TASK_PROTOCOL, POLL_MS);
+}
 
 /* ----------------------------------------------------------------------- */
 #if 0
@@ -408,8 +1000,8 @@ int write_test()
 {
 	int ret = HAL_OK;
 	uint8_t membuffer[0x2000];
-	extern struct memory_info memory[];
-	uint16_t memsz = memory[g_memtype].size;
+	extern const struct memory_info memory[];
+	uint32_t memsz = memory[g_memtype].size;
 
 	HAL_Delay(1000);
 	serial_clearScreen();
@@ -461,11 +1053,11 @@ void print_writeProtectRegister() {
 
 int read_test()
 {
-	uint16_t register_address = 0x0000U;
+	uint32_t register_address = 0x0000U;
 	int ret = HAL_OK;
 	char buf[64] = "";
 	uint8_t pagebuffer[32] = {0};
-	extern struct memory_info memory[];
+	extern const struct memory_info memory[];
 	uint8_t pagesz = memory[g_memtype].pageSz;
 
 	HAL_Delay(1500);
@@ -9,31 +9,60 @@
 
 
 
-struct memory_info
+#define MEMORY_INFO(id, name, address7, size, pageSz, addrSz, twcMs) \
+	{address7, size, pageSz, addrSz, twcMs},
+
+// Filled from memory_table.h, shared with the PC application
+const struct memory_info
 memory[MEMTYPE_mAX] = {
-// address7; size  ;pageSz;addrSz;
-	{    0,       0,   0,  0}, // MEMTYPE_NONE
-	{0x50U, 0x0800U, 16U, 1U}, // MEMTYPE_24LC16
-	{0x54U, 0x2000U, 32U, 2U}, // MEMTYPE_24LC64
-	{0x00U, 0x2000U, 32U, 1U}, // MEMTYPE_X24645
-	{0x54U, 0x8000U, 64U, 2U}  // MEMTYPE_24LC256
+	MEMORY_TABLE(MEMORY_INFO)
+};
+
+// One socket per I2C peripheral, the original one first
+eeprom_t g_eeprom[CHANNELS] = {
+	{&hi2c2, MEMTYPE_NONE, 0U, -1},
+	{&hi2c1, MEMTYPE_NONE, 0U, -1},
 };
-enum memtype_e g_memtype = MEMTYPE_NONE;
-uint16_t       g_memsize = 0U;
 
 
 // Memory pin 1: GND - pin 2: GND - pin 3: VCC
 // 24LC16B answers to address 0x50 to 0x57
 // 24LC64 answers to address 0x54
 // X24645 answers to address 0x00 to 0x1F
+// 24LC1025 answers to address 0x50 and 0x54 (B0 block select)
+// 24M02 answers to address 0x54 to 0x57 (A17:A16 in the device address)
 
 
 /*************************************************************************************************/
 
-static uint16_t getDevAddress(memtype_t device, uint16_t register_address)
+// Device address bits a fixture can strap per chip,
+// the others select a block inside the memory
+static uint8_t strapMask(memtype_t device)
+{
+	switch(device) {
+	case MEMTYPE_24LC64:
+	case MEMTYPE_24LC256:
+	case MEMTYPE_24LC512:
+		return 0x07U;	/* A2 A1 A0 */
+	case MEMTYPE_24LC1025:
+		return 0x03U;	/* A1 A0 */
+	case MEMTYPE_24M02:
+		return 0x04U;	/* E2 */
+	default:
+		return 0x00U;
+	}
+}
+
+static uint16_t getDevAddress(const eeprom_t *dev, uint32_t register_address)
 {
+	memtype_t device = dev->memtype;
 	uint16_t DevAddress = memory[device].address7;
 
+	if(dev->chip >= 0) {
+		uint8_t mask = strapMask(device);
+		DevAddress = (DevAddress & ~mask) | ((uint16_t) dev->chip & mask);
+	}
+
 	// Set specific device registers
 	switch(device) {
 	case MEMTYPE_24LC16:
@@ -46,8 +75,17 @@ static uint16_t getDevAddress(memtype_t device, uint16_t register_address)
 		DevAddress = DevAddress | ((register_address >> 8) & 0x1FU);
 		break;
 	case MEMTYPE_24LC256:
+	case MEMTYPE_24LC512:
 		// This is constant, just the 7bit address
 		break;
+	case MEMTYPE_24LC1025:
+		// Control byte is 1010 B0 A1 A0: B0 selects the upper 64K block
+		DevAddress = DevAddress | (((register_address >> 16) & 0x01U) << 2);
+		break;
+	case MEMTYPE_24M02:
+		// Control byte is 1010 E2 A17 A16
+		DevAddress = DevAddress | ((register_address >> 16) & 0x03U);
+		break;
 	default:
 		break;
 	}
@@ -57,51 +95,95 @@ static uint16_t getDevAddress(memtype_t device, uint16_t register_address)
 	return DevAddress;
 }
 
-static int write_aux(memtype_t device, const uint8_t *buffer, uint16_t register_address, uint16_t Size)
+/*************************************************************************************************/
+
+/*
+ * Transfers run on the I2C interrupts: a ...Start() call polls the chip
+ * for its ACK, hands the transfer to the peripheral and returns, and
+ * EEPROM_wait() waits for it to end. In between the CPU can start a
+ * transfer on the other bus, so both sockets are busy at the same time.
+ */
+
+/* Start a transfer within timeout ms of now, once the chip ACKs */
+static int start_aux(eeprom_t *dev, uint16_t DevAddress, uint32_t timeout)
 {
 	int ret = HAL_ERROR;
-	uint32_t timeout = HAL_GetTick() + 20;
-	// 24LC64 memory takes 5 ms to perform a page write cycle;
-	// with a max page size of 64 bytes at 100kHz should take about 6.7 ms
+	uint32_t tstart = HAL_GetTick();
 
-	uint16_t DevAddress = getDevAddress(device, register_address);
-	uint16_t MemAddress = register_address;
-	uint16_t MemAddSz   = memory[device].addrSz;
+	while((ret = HAL_I2C_IsDeviceReady(dev->hi2c, DevAddress, 1, 5)) != HAL_OK
+			&& HAL_GetTick()-tstart < timeout);
+
+	return ret;
+}
 
-	while((ret = HAL_I2C_IsDeviceReady(&hi2c2, DevAddress, 1, 5)) != HAL_OK
-			&& HAL_GetTick() < timeout);
+int EEPROM_wait(eeprom_t *dev, uint32_t timeout)
+{
+	uint32_t tstart = HAL_GetTick();
 
-	if(ret == HAL_OK) {
-		uint32_t timeleft = timeout - HAL_GetTick();
-		ret = HAL_I2C_Mem_Write(&hi2c2, DevAddress, MemAddress, MemAddSz,
-								(uint8_t *)buffer, Size, timeleft);
+	while(HAL_I2C_GetState(dev->hi2c) != HAL_I2C_STATE_READY) {
+		if(HAL_GetTick()-tstart >= timeout) {
+			// Stuck half way, start the peripheral over
+			HAL_I2C_DeInit(dev->hi2c);
+			HAL_I2C_Init(dev->hi2c);
+			return HAL_TIMEOUT;
+		}
 	}
 
+	return HAL_I2C_GetError(dev->hi2c) == HAL_I2C_ERROR_NONE ? HAL_OK : HAL_ERROR;
+}
+
+static int writeStart_aux(eeprom_t *dev, const uint8_t *buffer, uint32_t register_address, uint16_t Size)
+{
+	// 24LC64 memory takes 5 ms to perform a page write cycle;
+	// with a max page size of 64 bytes at 100kHz should take about 6.7 ms
+	uint16_t DevAddress = getDevAddress(dev, register_address);
+	uint16_t MemAddress = (uint16_t) register_address;
+	uint16_t MemAddSz   = memory[dev->memtype].addrSz;
+
+	int ret = start_aux(dev, DevAddress, memory[dev->memtype].twcMs + 15);
+	if(ret == HAL_OK)
+		ret = HAL_I2C_Mem_Write_IT(dev->hi2c, DevAddress, MemAddress, MemAddSz,
+								   (uint8_t *)buffer, Size);
+
+	return ret;
+}
+
+static int write_aux(eeprom_t *dev, const uint8_t *buffer, uint32_t register_address, uint16_t Size)
+{
+	int ret = writeStart_aux(dev, buffer, register_address, Size);
+	if(ret == HAL_OK)
+		ret = EEPROM_wait(dev, memory[dev->memtype].twcMs + 15);
 	return ret;
 }
 
-int EEPROM_writeReg(memtype_t device, uint8_t reg, uint16_t register_address)
+int EEPROM_writeReg(eeprom_t *dev, uint8_t reg, uint32_t register_address)
 {
-	return write_aux(device, &reg, register_address, 1);
+	return write_aux(dev, &reg, register_address, 1);
 }
 
-int EEPROM_writePage(memtype_t device, const uint8_t *page, uint16_t register_address)
+int EEPROM_writePageStart(eeprom_t *dev, const uint8_t *page, uint32_t register_address)
 {
-	uint16_t size = memory[device].pageSz;
-	return write_aux(device, page, register_address, size);
+	uint16_t size = memory[dev->memtype].pageSz;
+	return writeStart_aux(dev, page, register_address, size);
 }
 
-int EEPROM_write(memtype_t device, const uint8_t *buffer, uint16_t register_base, uint16_t size)
+int EEPROM_writePage(eeprom_t *dev, const uint8_t *page, uint32_t register_address)
+{
+	uint16_t size = memory[dev->memtype].pageSz;
+	return write_aux(dev, page, register_address, size);
+}
+
+int EEPROM_write(eeprom_t *dev, const uint8_t *buffer, uint32_t register_base, uint32_t size)
 {
 	int ret = HAL_OK;
-	uint16_t register_top = register_base + size;
+	uint32_t register_top = register_base + size;
 	uint32_t register_address;
-	uint16_t page_size = memory[device].pageSz;
+	uint16_t page_size = memory[dev->memtype].pageSz;
 
 	for(register_address = register_base; register_address < register_top; register_address += page_size)
 	{
-		int memindex = register_address - register_base;
-		if( (ret=EEPROM_writePage(device, &buffer[memindex], register_address)) != HAL_OK)
+		uint32_t memindex = register_address - register_base;
+		if( (ret=EEPROM_writePage(dev, &buffer[memindex], register_address)) != HAL_OK)
 			break;
 	}
 
@@ -110,85 +192,135 @@ int EEPROM_write(memtype_t device, const uint8_t *buffer, uint16_t register_base
 
 /*************************************************************************************************/
 
-static int read_aux(uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSz,
-					uint8_t *Buf, uint16_t Size, uint32_t Timeout)
+static int readStart_aux(eeprom_t *dev, uint8_t *Buf, uint32_t register_address, uint16_t Size, uint32_t Timeout)
 {
-	int ret = HAL_ERROR;
-	uint32_t tstart = HAL_GetTick();
+	uint16_t DevAddress = getDevAddress(dev, register_address);
+	uint16_t MemAddress = (uint16_t) register_address;
+	uint16_t MemAddSz   = memory[dev->memtype].addrSz;
 
-	while((ret = HAL_I2C_IsDeviceReady(&hi2c2, DevAddress, 1, 5)) != HAL_OK
-			&& HAL_GetTick()-tstart < Timeout);
+	int ret = start_aux(dev, DevAddress, Timeout);
+	if(ret == HAL_OK)
+		ret = HAL_I2C_Mem_Read_IT(dev->hi2c, DevAddress, MemAddress, MemAddSz, Buf, Size);
 
-	if(ret == HAL_OK) {
-		Timeout -= HAL_GetTick()-tstart;
-		ret=HAL_I2C_Mem_Read(&hi2c2, DevAddress, MemAddress, MemAddSz, Buf, Size, Timeout);
-	}
+	return ret;
+}
+
+static int read_aux(eeprom_t *dev, uint8_t *Buf, uint32_t register_address, uint16_t Size, uint32_t Timeout)
+{
+	uint32_t tstart = HAL_GetTick();
+
+	int ret = readStart_aux(dev, Buf, register_address, Size, Timeout);
+	if(ret == HAL_OK)
+		ret = EEPROM_wait(dev, Timeout - (HAL_GetTick()-tstart));
 
 	return ret;
 }
 
-int EEPROM_readPage(memtype_t device, uint8_t *page, uint16_t register_address)
+// The size must not cross a block of the register address (see EEPROM_read())
+int EEPROM_readStart(eeprom_t *dev, uint8_t *buf, uint32_t register_address, uint16_t size)
+{
+	return readStart_aux(dev, buf, register_address, size, 20);
+}
+
+int EEPROM_readPage(eeprom_t *dev, uint8_t *page, uint32_t register_address)
 {
-	uint16_t DevAddress = getDevAddress(device, register_address);
-	uint16_t MemAddress = register_address;
-	uint16_t MemAddSz   = memory[device].addrSz;
-	uint16_t Size       = memory[device].pageSz;
+	uint16_t Size       = memory[dev->memtype].pageSz;
 	uint32_t Timeout    = 20;
 
-	return read_aux(DevAddress, MemAddress, MemAddSz, page, Size, Timeout);
+	return read_aux(dev, page, register_address, Size, Timeout);
 }
 
-int EEPROM_read(memtype_t device, uint8_t *buf, uint16_t register_base, uint16_t size)
+/* Largest sequential read done in a single I2C transfer */
+#define READ_CHUNK_MAX 0x8000U
+
+int EEPROM_read(eeprom_t *dev, uint8_t *buf, uint32_t register_base, uint32_t size)
 {
-	uint16_t DevAddress = getDevAddress(device, register_base);
-	uint16_t MemAddress = register_base;
-	uint16_t MemAddSz   = memory[device].addrSz;
-	uint16_t Size       = size;
-	uint32_t Timeout    = (uint32_t)(size/memory[device].pageSz)*5 + 10;
+	int ret = HAL_OK;
+	// A sequential read can't go past what the register address reaches,
+	// the rest of the memory is behind another device address.
+	uint32_t block_size = 1UL << (8U * memory[dev->memtype].addrSz);
+
+	while(ret == HAL_OK && size > 0)
+	{
+		uint32_t block_left = block_size - (register_base & (block_size - 1U));
+		uint32_t chunk      = size < block_left ? size : block_left;
+		if(chunk > READ_CHUNK_MAX)
+			chunk = READ_CHUNK_MAX;
 
-	return read_aux(DevAddress, MemAddress, MemAddSz, buf, Size, Timeout);
+		uint16_t Size       = (uint16_t) chunk;
+		uint32_t Timeout    = (uint32_t)(chunk/memory[dev->memtype].pageSz)*5 + 10;
+
+		ret = read_aux(dev, buf, register_base, Size, Timeout);
+
+		buf           += chunk;
+		register_base += chunk;
+		size          -= chunk;
+	}
+
+	return ret;
 }
 
-int EEPROM_readReg(memtype_t device, uint8_t *reg, uint16_t register_address)
+int EEPROM_readReg(eeprom_t *dev, uint8_t *reg, uint32_t register_address)
 {
-	uint16_t DevAddress = getDevAddress(device, register_address);
-	uint16_t MemAddress = register_address;
-	uint16_t MemAddSz   = memory[device].addrSz;
 	uint16_t Size       = 1;
 	uint32_t Timeout    = 20;
 
-	return read_aux(DevAddress, MemAddress, MemAddSz, reg, Size, Timeout);
+	return read_aux(dev, reg, register_address, Size, Timeout);
 }
 
 /*************************************************************************************************/
 
-static HAL_StatusTypeDef MEMX24645_enableWriteAccess(void)
+static HAL_StatusTypeDef MEMX24645_enableWriteAccess(eeprom_t *dev)
 {
-	return EEPROM_writeReg(MEMTYPE_X24645, 0x02, 0x1FFF);
+	return EEPROM_writeReg(dev, 0x02, 0x1FFF);
 }
 
-uint16_t EEPROM_getMemSize(enum memtype_e memtype)
+uint32_t EEPROM_getMemSize(enum memtype_e memtype)
 {
 	return memory[memtype].size;
 }
 
-static HAL_StatusTypeDef verify_device(enum memtype_e dev_id)
+uint16_t EEPROM_getPageSize(enum memtype_e memtype)
+{
+	return memory[memtype].pageSz;
+}
+
+bool EEPROM_isStrapValid(enum memtype_e memtype, uint8_t strap)
+{
+	uint8_t mask = strapMask(memtype);
+	return mask != 0 && (strap & ~mask) == 0;
+}
+
+// Following accesses go to the chip strapped as strap, -1 for the default one
+void EEPROM_selectChip(eeprom_t *dev, int strap)
+{
+	dev->chip = strap;
+}
+
+HAL_StatusTypeDef EEPROM_isReady(eeprom_t *dev)
+{
+	return HAL_I2C_IsDeviceReady(dev->hi2c, getDevAddress(dev, 0), 3U, 5U);
+}
+
+static HAL_StatusTypeDef verify_device(eeprom_t *dev, enum memtype_e dev_id)
 {
 	uint16_t addr = memory[dev_id].address7 << 1;
-	return HAL_I2C_IsDeviceReady(&hi2c2, addr, 1000U, 50U);
+	return HAL_I2C_IsDeviceReady(dev->hi2c, addr, 1000U, 50U);
 }
 
-HAL_StatusTypeDef EEPROM_InitMemory(enum memtype_e dev_id)
+HAL_StatusTypeDef EEPROM_InitMemory(eeprom_t *dev, enum memtype_e dev_id)
 {
-	HAL_StatusTypeDef status = verify_device(dev_id);
+	dev->chip = -1;
+	HAL_StatusTypeDef status = verify_device(dev, dev_id);
 	if(status == HAL_OK)
 	{
+		dev->memtype = dev_id;
 		if(dev_id == MEMTYPE_X24645)
-			status = MEMX24645_enableWriteAccess();
-		if(status == HAL_OK) {
-			g_memtype = dev_id;
-			g_memsize = EEPROM_getMemSize(dev_id);
-		}
+			status = MEMX24645_enableWriteAccess(dev);
+		if(status == HAL_OK)
+			dev->memsize = EEPROM_getMemSize(dev_id);
+		else
+			dev->memtype = MEMTYPE_NONE;
 	}
 	return status;
 }
@@ -9,24 +9,263 @@
 
 
 
-int readMemoryBlock(uint8_t *buffer, uint16_t offset)
+/* Longest a page or a block takes to go through the bus at 100 kHz, and then some */
+#define TRANSFER_WAIT_MS 50U
+
+/* Channels of CMD_CHANNEL, bit n for g_eeprom[n]. g_dev is the first one */
+static uint8_t s_channels = 1U;
+eeprom_t *g_dev = &g_eeprom[0];
+/* Read back of each channel, they're read at the same time */
+static uint8_t s_verify[CHANNELS][PKG_DATA_MAX];
+
+/* Chips written together, bit n for the one strapped as n. 0: just the one chip */
+static uint8_t s_targets = 0U;
+/* errorcode_t of each, a chip that failed isn't written anymore */
+static uint8_t s_status[CHIPS_MAX];
+
+static bool isGood(int chip)
+{
+	return (s_targets & (1U << chip)) && s_status[chip] == ERROR_NONE;
+}
+
+static int firstGood(void)
+{
+	for(int chip = 0; chip < CHIPS_MAX; ++chip)
+		if(isGood(chip))
+			return chip;
+	return -1;
+}
+
+static bool isSelected(int ch)
+{
+	return (s_channels & (1U << ch)) != 0U;
+}
+
+/* Wait for the transfers started on the channels in started, ret: the first error */
+static int waitChannels(uint8_t started, int ret)
 {
-	return EEPROM_read(g_memtype, buffer, offset, PKG_DATA_MAX);
+	for(int ch = 0; ch < CHANNELS; ++ch) {
+		if(!(started & (1U << ch)))
+			continue;
+		int status = EEPROM_wait(&g_eeprom[ch], TRANSFER_WAIT_MS);
+		if(ret == HAL_OK)
+			ret = status;
+	}
+	return ret;
+}
+
+int readMemoryBlock(uint8_t *buffer, uint32_t offset)
+{
+	return EEPROM_read(g_dev, buffer, offset, PKG_DATA_MAX);
 }
 
 int readMemory(uint8_t *buffer)
 {
-	return EEPROM_read(g_memtype, buffer, 0, g_memsize);
+	return EEPROM_read(g_dev, buffer, 0, g_dev->memsize);
 }
 
 int saveMemory(const uint8_t *data)
 {
-	return EEPROM_write(g_memtype, data, 0, g_memsize);
+	return EEPROM_write(g_dev, data, 0, g_dev->memsize);
+}
+
+/*
+ * The block goes to every channel at once: each page is started on all
+ * the buses before waiting for any, so the transfers and write cycles of
+ * the sockets overlap, and so do the reads back. Both take the time of one.
+ */
+static int saveMemoryBlockChannels(const uint8_t *data, uint32_t offset)
+{
+	uint16_t page = EEPROM_getPageSize(g_dev->memtype);
+	uint8_t started;
+	int ret = HAL_OK;
+
+	for(uint32_t p = 0; ret == HAL_OK && p < PKG_DATA_MAX; p += page) {
+		started = 0U;
+		for(int ch = 0; ret == HAL_OK && ch < CHANNELS; ++ch) {
+			if(!isSelected(ch))
+				continue;
+			ret = EEPROM_writePageStart(&g_eeprom[ch], &data[p], offset + p);
+			if(ret == HAL_OK)
+				started |= 1U << ch;
+		}
+		ret = waitChannels(started, ret);
+	}
+	if(ret != HAL_OK)
+		return ret;
+
+	// A block never crosses what a read can reach in one go
+	started = 0U;
+	for(int ch = 0; ret == HAL_OK && ch < CHANNELS; ++ch) {
+		if(!isSelected(ch))
+			continue;
+		ret = EEPROM_readStart(&g_eeprom[ch], s_verify[ch], offset, PKG_DATA_MAX);
+		if(ret == HAL_OK)
+			started |= 1U << ch;
+	}
+	ret = waitChannels(started, ret);
+	if(ret != HAL_OK)
+		return ret;
+
+	for(int ch = 0; ch < CHANNELS; ++ch)
+		if(isSelected(ch) && memcmp(data, s_verify[ch], PKG_DATA_MAX) != 0)
+			return ERROR_WRITEMEM;
+	return HAL_OK;
+}
+
+/*
+ * The block goes to every target a page at a time, to each chip in turn:
+ * while one is in its write cycle the bus is writing to the others, and
+ * write_aux() polls a chip for its ACK only when its turn comes back. K
+ * chips take about the time of one as long as K page transfers fit in tWC.
+ */
+static int saveMemoryBlockMulti(const uint8_t *data, uint32_t offset)
+{
+	uint16_t page = EEPROM_getPageSize(g_dev->memtype);
+
+	for(uint32_t p = 0; p < PKG_DATA_MAX; p += page) {
+		for(int chip = 0; chip < CHIPS_MAX; ++chip) {
+			if(!isGood(chip))
+				continue;
+			EEPROM_selectChip(g_dev, chip);
+			if(EEPROM_writePage(g_dev, &data[p], offset + p) != HAL_OK)
+				s_status[chip] = ERROR_WRITEMEM;
+		}
+	}
+
+	uint8_t tmpbuf[PKG_DATA_MAX];
+	for(int chip = 0; chip < CHIPS_MAX; ++chip) {
+		if(!isGood(chip))
+			continue;
+		EEPROM_selectChip(g_dev, chip);
+		if(readMemoryBlock(tmpbuf, offset) != HAL_OK)
+			s_status[chip] = ERROR_READMEM;
+		else if(memcmp(data, tmpbuf, PKG_DATA_MAX) != 0)
+			s_status[chip] = ERROR_WRITEMEM;
+	}
+
+	// Anything else works on the first chip still good
+	int chip = firstGood();
+	EEPROM_selectChip(g_dev, chip);
+	return chip >= 0 ? HAL_OK : ERROR_WRITEMEM;
+}
+
+/* MEMID: the memory in every selected channel, on a single chip each */
+errorcode_t initMemory(enum memtype_e memid)
+{
+	selectTargets(0U);
+	for(int ch = 0; ch < CHANNELS; ++ch)
+		if(isSelected(ch) && EEPROM_InitMemory(&g_eeprom[ch], memid) != HAL_OK)
+			return ERROR_MEMID;
+	return ERROR_NONE;
+}
+
+/*
+ * Jobs go to the first channel in mask from now on, written blocks to all
+ * of them. The others get the memory type of the current one.
+ */
+errorcode_t selectChannels(uint8_t mask)
+{
+	if(mask == 0U || mask >= (1U << CHANNELS))
+		return ERROR_MEMID;
+
+	enum memtype_e memtype = g_dev->memtype;
+	int first = -1;
+	for(int ch = CHANNELS - 1; ch >= 0; --ch) {
+		if(!(mask & (1U << ch)))
+			continue;
+		if(EEPROM_InitMemory(&g_eeprom[ch], memtype) != HAL_OK)
+			return ERROR_MEMID;
+		first = ch;
+	}
+
+	selectTargets(0U);
+	s_channels = mask;
+	g_dev = &g_eeprom[first];
+	return ERROR_NONE;
+}
+
+/* The channels in mask, each with a memid chip: what a MEMID and a CMD_CHANNEL do */
+errorcode_t initChannels(uint8_t mask, enum memtype_e memid)
+{
+	if(mask == 0U || mask >= (1U << CHANNELS))
+		return ERROR_MEMID;
+
+	resetChannels();
+	s_channels = mask;
+	for(int ch = CHANNELS - 1; ch >= 0; --ch)
+		if(isSelected(ch))
+			g_dev = &g_eeprom[ch];
+	return initMemory(memid);
+}
+
+/* Bit n for g_eeprom[n] */
+uint8_t getChannels(void)
+{
+	return s_channels;
+}
+
+/* A new connection starts on channel 0 alone */
+void resetChannels(void)
+{
+	selectTargets(0U);
+	s_channels = 1U;
+	g_dev = &g_eeprom[0];
+}
+
+/*
+ * Write blocks to the chips in mask from now on, the ones that don't
+ * answer are left out. ERROR_MEMID if none does, the memory type has
+ * no straps to tell them apart or several channels are selected.
+ */
+errorcode_t selectTargets(uint8_t mask)
+{
+	s_targets = 0U;
+	memset(s_status, ERROR_NONE, sizeof s_status);
+	EEPROM_selectChip(g_dev, -1);
+	if(mask == 0U)
+		return ERROR_NONE;
+	if(s_channels & (s_channels - 1U))
+		return ERROR_MEMID;
+
+	for(int chip = 0; chip < CHIPS_MAX; ++chip)
+		if((mask & (1U << chip)) && !EEPROM_isStrapValid(g_dev->memtype, chip))
+			return ERROR_MEMID;
+
+	s_targets = mask;
+	for(int chip = 0; chip < CHIPS_MAX; ++chip) {
+		if(!isGood(chip))
+			continue;
+		EEPROM_selectChip(g_dev, chip);
+		if(EEPROM_isReady(g_dev) != HAL_OK)
+			s_status[chip] = ERROR_MEMID;
+	}
+
+	int chip = firstGood();
+	if(chip < 0) {
+		s_targets = 0U;
+		EEPROM_selectChip(g_dev, -1);
+		return ERROR_MEMID;
+	}
+	EEPROM_selectChip(g_dev, chip);
+	return ERROR_NONE;
+}
+
+/* CHIPSTATUS_SIZE bytes: the targets, then the errorcode_t of each chip */
+void getTargetStatus(uint8_t *status)
+{
+	status[0] = s_targets;
+	memcpy(&status[1], s_status, CHIPS_MAX);
 }
 
-int saveMemoryBlock(const uint8_t *data, uint16_t offset)
+int saveMemoryBlock(const uint8_t *data, uint32_t offset)
 {
-	int status = EEPROM_write(g_memtype, data, offset, PKG_DATA_MAX);
+	if(s_channels & (s_channels - 1U))
+		return saveMemoryBlockChannels(data, offset);
+	if(s_targets != 0U)
+		return saveMemoryBlockMulti(data, offset);
+
+	int status = EEPROM_write(g_dev, data, offset, PKG_DATA_MAX);
 	if(status != HAL_OK)
 		return status;
 	uint8_t tmpbuf[PKG_DATA_MAX] = {0};
@@ -0,0 +1,116 @@
+/*
+ * PR_packbits.c
+ *
+ *  Created on: 19 oct. 2026
+ *      Author: feer
+ */
+
+#include "main.h"
+
+#define RUN_MIN 3		/* shorter repeats go as literals */
+#define RUN_MAX 128
+#define LITERAL_MAX 128
+
+/*
+ * PackBits, as the PC encodes CMD_MEMDATA_RLE: a header byte n, then
+ * n+1 literal bytes for n in 0..127, or one byte repeated 1-n times for
+ * n in -127..-1. -128 does nothing.
+ *
+ * Needs no RAM of its own and every run is a memset or memcpy: a block
+ * takes a few us, nothing next to the page writes that follow.
+ *
+ * Returns the bytes written to out, or -1 if in is malformed or would
+ * write more than outmax.
+ */
+int packbits_decode(const uint8_t *in, uint16_t len, uint8_t *out, uint16_t outmax)
+{
+	const uint8_t *end = in + len;
+	uint16_t written = 0;
+
+	while(in < end)
+	{
+		int8_t n = (int8_t) *in++;
+		uint16_t count;
+
+		if(n >= 0) {
+			count = (uint16_t) n + 1;
+			if(count > end - in || count > outmax - written)
+				return -1;
+			memcpy(out + written, in, count);
+			in += count;
+		}
+		else if(n != -128) {
+			count = (uint16_t) (1 - n);
+			if(in == end || count > outmax - written)
+				return -1;
+			memset(out + written, *in++, count);
+		}
+		else {
+			continue;
+		}
+		written += count;
+	}
+	return written;
+}
+
+// n bytes from in as literals, in pieces of up to LITERAL_MAX
+static bool putLiteral(const uint8_t *in, uint16_t n, uint8_t *out, uint16_t *written, uint16_t outmax)
+{
+	while(n > 0)
+	{
+		uint16_t count = n < LITERAL_MAX ? n : LITERAL_MAX;
+		if(count + 1 > outmax - *written)
+			return false;
+		out[(*written)++] = (uint8_t) (count - 1);
+		memcpy(out + *written, in, count);
+		*written += count;
+		in += count;
+		n -= count;
+	}
+	return true;
+}
+
+/*
+ * The other way, for CMD_MEMDATA_RLE replies to reads. Gives up as soon
+ * as the output passes outmax, so a block that doesn't compress costs
+ * about one pass over it before going raw.
+ *
+ * Returns the bytes written to out, or -1.
+ */
+int packbits_encode(const uint8_t *in, uint16_t len, uint8_t *out, uint16_t outmax)
+{
+	uint16_t written = 0;
+	uint16_t literal = 0;	/* start of the pending literal, up to i */
+	uint16_t i = 0;
+
+	while(i < len)
+	{
+		uint16_t run = 1;
+		while(i + run < len && run < RUN_MAX && in[i + run] == in[i])
+			++run;
+
+		if(run < RUN_MIN) {
+			i += run;
+			if(i - literal < LITERAL_MAX)
+				continue;
+			// A full one, the rest of the run starts the next
+			i = literal + LITERAL_MAX;
+		}
+
+		if(!putLiteral(in + literal, i - literal, out, &written, outmax))
+			return -1;
+		literal = i;
+
+		if(run >= RUN_MIN) {
+			if(2 > outmax - written)
+				return -1;
+			out[written++] = (uint8_t) (1 - run);
+			out[written++] = in[i];
+			i += run;
+			literal = i;
+		}
+	}
+	if(!putLiteral(in + literal, len - literal, out, &written, outmax))
+		return -1;
+	return written;
+}
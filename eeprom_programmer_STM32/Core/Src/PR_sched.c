@@ -0,0 +1,141 @@
+/*
+ * PR_sched.c
+ *
+ *  Created on: 19 oct. 2026
+ *      Author: feer
+ */
+
+#include "main.h"
+
+/*
+ * Cooperative run to completion scheduler. A task is a function called
+ * with the events posted to it since its last run; it does what it can
+ * without waiting and returns. Tasks run by priority, the lowest task_e
+ * first, and when none has events the core sleeps until an interrupt.
+ *
+ * Events can be posted from interrupts (USB, SysTick), the rest of the
+ * scheduler is for task context only.
+ */
+
+typedef struct {
+	void (*run)(uint32_t events);
+	volatile uint32_t events;
+	volatile uint32_t due;		/* tick of the next EV_TIMER */
+	volatile bool armed;
+} task_t;
+
+static task_t s_tasks[TASKS];
+
+void sched_add(enum task_e id, void (*run)(uint32_t events))
+{
+	s_tasks[id].run = run;
+}
+
+void sched_post(enum task_e id, uint32_t events)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	s_tasks[id].events |= events;
+	__set_PRIMASK(primask);
+}
+
+/* EV_TIMER in ms, replacing the one armed. 0 disarms it */
+void sched_timer(enum task_e id, uint32_t ms)
+{
+	task_t *t = &s_tasks[id];
+	t->armed = false;
+	if(ms == 0U)
+		return;
+	t->due = HAL_GetTick() + ms;
+	t->armed = true;
+}
+
+/* From SysTick, every ms */
+void sched_tick(void)
+{
+	const uint32_t now = HAL_GetTick();
+	for(int id = 0; id < TASKS; ++id) {
+		task_t *t = &s_tasks[id];
+		if(t->armed && (int32_t)(now - t->due) >= 0) {
+			t->armed = false;
+			// USB may post at the same time
+			sched_post((enum task_e) id, EV_TIMER);
+		}
+	}
+}
+
+/* Highest priority task with events, TASKS if none. Interrupts off */
+static int nextTask(void)
+{
+	for(int id = 0; id < TASKS; ++id)
+		if(s_tasks[id].events != 0U && s_tasks[id].run != NULL)
+			return id;
+	return TASKS;
+}
+
+void sched_run(void)
+{
+	for(;;) {
+		__disable_irq();
+		const int id = nextTask();
+		if(id == TASKS) {
+			// Still off, so nothing posted since the check is missed:
+			// a pending interrupt wakes the core up anyway
+			__WFI();
+			__enable_irq();
+			continue;
+		}
+		const uint32_t events = s_tasks[id].events;
+		s_tasks[id].events = 0U;
+		__enable_irq();
+
+		s_tasks[id].run(events);
+	}
+}
+
+/*
+ * Message queues: fixed size messages copied in and out, one task puts
+ * and another takes. Putting one posts EV_MSG to the queue's owner.
+ */
+bool msgq_put(msgq_t *q, const void *msg)
+{
+	if(msgq_full(q))
+		return false;
+	memcpy(q->buf + (q->head % q->depth) * q->size, msg, q->size);
+	++q->head;
+	sched_post(q->owner, EV_MSG);
+	return true;
+}
+
+bool msgq_get(msgq_t *q, void *msg)
+{
+	if(msgq_empty(q))
+		return false;
+	memcpy(msg, q->buf + (q->tail % q->depth) * q->size, q->size);
+	++q->tail;
+	return true;
+}
+
+/* The oldest one, left in the queue */
+void *msgq_peek(msgq_t *q)
+{
+	if(msgq_empty(q))
+		return NULL;
+	return q->buf + (q->tail % q->depth) * q->size;
+}
+
+void msgq_drop(msgq_t *q)
+{
+	if(!msgq_empty(q))
+		++q->tail;
+}
+
+bool msgq_full(const msgq_t *q)
+{
+	return (uint8_t)(q->head - q->tail) >= q->depth;
+}
+
+bool msgq_empty(const msgq_t *q)
+{
+	return q->head == q->tail;
+}
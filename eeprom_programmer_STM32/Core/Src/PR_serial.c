@@ -18,19 +18,35 @@ int serial_clearScreen(void) {
 
 #if 1 // USB-CDC
 
+/* Into the TX queue, the USB interrupt sends it as the IN endpoint frees up */
 static int write(const uint8_t *data, uint16_t sz)
 {
-	return (int) CDC_Transmit_FS((uint8_t *) data, sz);
+	return (int) CDC_Enqueue_FS(data, sz);
 }
 
-int serial_write(const uint8_t *data, uint16_t len)
+/* Queued, not sent until serial_flush(). Waits for room only if the queue is full */
+int serial_queue(const uint8_t *data, uint16_t len)
 {
 	uint32_t tstart = HAL_GetTick();
-	int ret = USBD_FAIL;
+	int ret = write(data, len);
 
-	while(ret != USBD_OK && (HAL_GetTick()-tstart) < 200)
+	while(ret != USBD_OK && (HAL_GetTick()-tstart) < 200) {
+		CDC_Flush_FS();
 		ret = write(data, len);
+	}
+
+	return ret;
+}
 
+void serial_flush(void)
+{
+	CDC_Flush_FS();
+}
+
+int serial_write(const uint8_t *data, uint16_t len)
+{
+	int ret = serial_queue(data, len);
+	serial_flush();
 	return ret;
 }
 
@@ -44,7 +60,8 @@ bool serial_available(void) {
 	return CDC_GetRxBufferBytesAvailable_FS() > 0;
 }
 
-static int read(uint8_t *buf, uint16_t sz)
+/* What's there, up to sz bytes. Doesn't wait */
+uint16_t serial_readsome(uint8_t *buf, uint16_t sz)
 {
 	uint16_t bytesAvailable = CDC_GetRxBufferBytesAvailable_FS();
 	uint16_t bytesReaded = 0;
@@ -71,7 +88,7 @@ int serial_read(uint8_t *buffer, uint16_t len)
 		uint16_t bytesToRead = bytesRemaining > HL_RX_BUFFER_SIZE ?
 				HL_RX_BUFFER_SIZE : bytesRemaining;
 
-		uint16_t bytesReaded = read(buffer, bytesToRead);
+		uint16_t bytesReaded = serial_readsome(buffer, bytesToRead);
 
 		bytesRemaining -= bytesReaded;
 		buffer += bytesReaded;
@@ -0,0 +1,177 @@
+/*
+ * PR_store.c
+ *
+ *  Created on: 19 oct. 2026
+ *      Author: feer
+ */
+
+#include "main.h"
+
+/*
+ * Image store of the standalone mode: the top of the flash, past the
+ * code (see the linker script). The image goes from the start of it, the
+ * header takes the last block. An image can be shorter than the memory,
+ * the rest of the chip is written blank.
+ *
+ * The magic is programmed last, so an upload that didn't finish leaves
+ * no image behind.
+ */
+
+#define STORE_MAGIC 0x45455031U		/* "EEP1" */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t length;
+	uint8_t memtype;
+	uint8_t channels;
+	uint8_t _[2];
+	uint32_t reserved;
+} store_header_t;
+
+extern const uint8_t _sstore[];
+extern const uint8_t _estore[];
+
+#define STORE_BASE ((uint32_t) _sstore)
+#define STORE_HEADER (STORE_BASE + storeCapacity())
+
+static const store_header_t *header(void)
+{
+	return (const store_header_t *) STORE_HEADER;
+}
+
+static HAL_StatusTypeDef erasePage(uint32_t address)
+{
+	FLASH_EraseInitTypeDef erase = {0};
+	uint32_t error = 0;
+
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = address;
+	erase.NbPages = 1;
+	return HAL_FLASHEx_Erase(&erase, &error);
+}
+
+static HAL_StatusTypeDef program(uint32_t address, const uint8_t *data, uint32_t len)
+{
+	HAL_StatusTypeDef status = HAL_OK;
+	for(uint32_t i = 0; status == HAL_OK && i < len; i += 4) {
+		uint32_t word;
+		memcpy(&word, &data[i], 4);
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + i, word);
+	}
+	return status;
+}
+
+/* Largest image, a multiple of PKG_DATA_MAX */
+uint32_t storeCapacity(void)
+{
+	return (uint32_t)(_estore - _sstore) - PKG_DATA_MAX;
+}
+
+/* The stored image, if there's one */
+bool storeValid(void)
+{
+	const store_header_t *h = header();
+	return h->magic == STORE_MAGIC && h->memtype > MEMTYPE_NONE && h->memtype < MEMTYPE_mAX &&
+	       h->length <= storeCapacity() && h->channels != 0U;
+}
+
+enum memtype_e storeMemtype(void)
+{
+	return header()->memtype;
+}
+
+uint32_t storeLength(void)
+{
+	return header()->length;
+}
+
+uint8_t storeChannels(void)
+{
+	return header()->channels;
+}
+
+/* Memory mapped, no need to copy it out */
+const uint8_t *storeBlock(uint32_t offset)
+{
+	return (const uint8_t *)(STORE_BASE + offset);
+}
+
+/*
+ * A new image of length bytes, for memtype on the channels in mask.
+ * The old one is gone from here on.
+ */
+errorcode_t storeBegin(enum memtype_e memtype, uint8_t channels, uint32_t length)
+{
+	if(length == 0U || length > storeCapacity() || length % PKG_DATA_MAX != 0U)
+		return ERROR_MEMIDX;
+
+	HAL_FLASH_Unlock();
+	HAL_StatusTypeDef status = erasePage(STORE_HEADER & ~(FLASH_PAGE_SIZE - 1U));
+	HAL_FLASH_Lock();
+	if(status != HAL_OK)
+		return ERROR_WRITEMEM;
+
+	store_header_t h = {0};
+	h.length = length;
+	h.memtype = memtype;
+	h.channels = channels;
+	h.reserved = 0xFFFFFFFFU;
+	HAL_FLASH_Unlock();
+	// All but the magic
+	status = program(STORE_HEADER + 4U, (const uint8_t *) &h + 4U, sizeof h - 4U);
+	HAL_FLASH_Lock();
+	return status == HAL_OK ? ERROR_NONE : ERROR_WRITEMEM;
+}
+
+/* Blocks come in order, a flash page is erased when the first one gets there */
+errorcode_t storeWriteBlock(const uint8_t *data, uint32_t offset)
+{
+	const uint32_t address = STORE_BASE + offset;
+	if(offset + PKG_DATA_MAX > storeCapacity())
+		return ERROR_MEMIDX;
+
+	HAL_StatusTypeDef status = HAL_OK;
+	HAL_FLASH_Unlock();
+	// storeBegin() already did the header's page
+	if(address % FLASH_PAGE_SIZE == 0U && address != (STORE_HEADER & ~(FLASH_PAGE_SIZE - 1U)))
+		status = erasePage(address);
+	if(status == HAL_OK)
+		status = program(address, data, PKG_DATA_MAX);
+	HAL_FLASH_Lock();
+
+	if(status != HAL_OK || memcmp(storeBlock(offset), data, PKG_DATA_MAX) != 0)
+		return ERROR_WRITEMEM;
+	return ERROR_NONE;
+}
+
+/* After the last block: the image is there */
+errorcode_t storeCommit(void)
+{
+	const uint32_t magic = STORE_MAGIC;
+	HAL_FLASH_Unlock();
+	HAL_StatusTypeDef status = program(STORE_HEADER, (const uint8_t *) &magic, 4U);
+	HAL_FLASH_Lock();
+	return status == HAL_OK && storeValid() ? ERROR_NONE : ERROR_WRITEMEM;
+}
+
+/*
+ * Standalone run: the chips in the socket(s) the image was stored for.
+ * The memory of each, then a block at a time with storeRunBlock().
+ */
+errorcode_t storeRunBegin(void)
+{
+	if(!storeValid())
+		return ERROR_MEMID;
+	return initChannels(storeChannels(), storeMemtype());
+}
+
+/* Past the stored image the chip is written blank */
+int storeRunBlock(uint32_t offset)
+{
+	static uint8_t blank[PKG_DATA_MAX];
+
+	if(offset < storeLength())
+		return saveMemoryBlock(storeBlock(offset), offset);
+	memset(blank, 0xFF, sizeof blank);
+	return saveMemoryBlock(blank, offset);
+}
@@ -23,7 +23,8 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
-
+#include <stdbool.h>
+#include "main.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -102,6 +103,15 @@ uint8_t rxBuffer[HL_RX_BUFFER_SIZE]; // Receive buffer
 volatile uint16_t rxBufferHeadPos = 0; // Receive buffer write position
 volatile uint16_t rxBufferTailPos = 0; // Receive buffer read position
 
+// TX queue: UserTxBufferFS as a ring, drained from CDC_TransmitCplt_FS
+volatile uint16_t txBufferHeadPos = 0; // Next byte queued goes here
+volatile uint16_t txBufferTailPos = 0; // First byte not acknowledged by the host yet
+volatile uint16_t txInFlight = 0; // Bytes from the tail the IN endpoint is sending
+
+// OUT packet that didn't fit in rxBuffer, the endpoint NAKs until it's taken
+uint8_t* rxHeldBuf = NULL;
+volatile uint16_t rxHeldLen = 0;
+
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -132,9 +142,14 @@ static int8_t CDC_Init_FS(void);
 static int8_t CDC_DeInit_FS(void);
 static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length);
 static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len);
+static int8_t CDC_TransmitCplt_FS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
 
+static void CDC_StartTx_FS(void);
+static bool CDC_StoreRx_FS(const uint8_t* Buf, uint16_t Len);
+static void CDC_TakeHeldRx_FS(void);
+
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
 /**
@@ -146,7 +161,8 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
   CDC_Init_FS,
   CDC_DeInit_FS,
   CDC_Control_FS,
-  CDC_Receive_FS
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS
 };
 
 /* Private functions ---------------------------------------------------------*/
@@ -161,6 +177,11 @@ static int8_t CDC_Init_FS(void)
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxBufferFS, 0);
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
 
+  // Whatever was queued went with the previous configuration
+  txBufferHeadPos = 0;
+  txBufferTailPos = 0;
+  txInFlight = 0;
+
   // https://stackoverflow.com/a/26925578
   uint32_t baudrate = 9600;
   lcBuffer[0] = (uint8_t)(baudrate);
@@ -258,6 +279,8 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 
         // Get line coding is invoked when the host connects, clear the RxBuffer when this occurs
         CDC_FlushRxBuffer_FS();
+        // Same for frames queued while nobody was reading
+        CDC_DropTxBuffer_FS();
     break;
 
     case CDC_SET_CONTROL_LINE_STATE:
@@ -296,31 +319,19 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
   /* USER CODE BEGIN 6 */
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
 
-  uint8_t len = (uint8_t) *Len; // Get length
-  uint16_t tempHeadPos = rxBufferHeadPos; // Increment temp head pos while writing, then update main variable when complete
-
-  for (uint32_t i = 0; i < len; i++) {
-    rxBuffer[tempHeadPos] = Buf[i];
+  uint16_t len = (uint16_t) *Len; // Get length
 
-    // Compact position increment logic
-    tempHeadPos = (uint16_t)((uint16_t)(tempHeadPos + 1) % HL_RX_BUFFER_SIZE);
-
-    /*
-    // Simple but more verbose version if preferred
-    tempHeadPos++;
-    if (tempHeadPos == HL_RX_BUFFER_SIZE) {
-      tempHeadPos = 0;
-    }
-    */
-
-    if (tempHeadPos == rxBufferTailPos) {
-      return USBD_FAIL;
-    }
+  // No room: keep the packet and don't rearm the endpoint, the host is
+  // NAKed until CDC_ReadRxBuffer_FS makes room, nothing gets lost
+  if (!CDC_StoreRx_FS(Buf, len)) {
+    rxHeldBuf = Buf;
+    rxHeldLen = len;
+    sched_post(TASK_RX, EV_WAKE);
+    return (USBD_OK);
   }
 
-  rxBufferHeadPos = tempHeadPos;
-
   USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  sched_post(TASK_RX, EV_WAKE);
 
   return (USBD_OK);
   /* USER CODE END 6 */
@@ -351,8 +362,120 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
   return result;
 }
 
+/**
+  * @brief  CDC_TransmitCplt_FS
+  *         An IN transfer finished, ZLP included if it was a multiple of
+  *         the packet size: its bytes leave the queue and the next ones go.
+  *         Runs in the USB interrupt.
+  *
+  * @param  Buf: Buffer of data that was sent
+  * @param  Len: Number of data sent (in bytes)
+  * @param  epnum: Endpoint number
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
+{
+  uint8_t result = USBD_OK;
+  /* USER CODE BEGIN 13 */
+  UNUSED(Buf);
+  UNUSED(Len);
+  UNUSED(epnum);
+
+  txBufferTailPos = (uint16_t)((txBufferTailPos + txInFlight) % APP_TX_DATA_SIZE);
+  txInFlight = 0;
+  CDC_StartTx_FS();
+  /* USER CODE END 13 */
+  return result;
+}
+
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
+// Copy a packet to rxBuffer, all or nothing
+static bool CDC_StoreRx_FS(const uint8_t* Buf, uint16_t Len) {
+  uint16_t tempHeadPos = rxBufferHeadPos; // Increment temp head pos while writing, then update main variable when complete
+  // One byte always free, so a full ring isn't taken for an empty one
+  uint16_t room = (uint16_t)((rxBufferTailPos + HL_RX_BUFFER_SIZE - tempHeadPos - 1) % HL_RX_BUFFER_SIZE);
+
+  if (Len > room)
+    return false;
+
+  for (uint16_t i = 0; i < Len; i++) {
+    rxBuffer[tempHeadPos] = Buf[i];
+    tempHeadPos = (uint16_t)((uint16_t)(tempHeadPos + 1) % HL_RX_BUFFER_SIZE);
+  }
+
+  rxBufferHeadPos = tempHeadPos;
+  return true;
+}
+
+// After reading: the packet held back by CDC_Receive_FS, if it fits now
+static void CDC_TakeHeldRx_FS(void) {
+  if (rxHeldLen == 0)
+    return;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (rxHeldLen != 0 && CDC_StoreRx_FS(rxHeldBuf, rxHeldLen)) {
+    rxHeldLen = 0;
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  }
+  __set_PRIMASK(primask);
+}
+
+// Send what's queued, up to the end of the ring, if the endpoint is free.
+// From the USB interrupt or with it masked.
+static void CDC_StartTx_FS(void)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  uint16_t headPos = txBufferHeadPos;
+  uint16_t tailPos = txBufferTailPos;
+
+  if (hcdc == NULL || hcdc->TxState != 0 || txInFlight != 0 || headPos == tailPos)
+    return;
+
+  uint16_t len = headPos > tailPos ? headPos - tailPos : APP_TX_DATA_SIZE - tailPos;
+  txInFlight = len;
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, &UserTxBufferFS[tailPos], len);
+  if (USBD_CDC_TransmitPacket(&hUsbDeviceFS) != USBD_OK)
+    txInFlight = 0;
+}
+
+// Copy Len bytes to the TX queue, all or nothing: USBD_BUSY if there's
+// no room. Sent after the next CDC_Flush_FS.
+uint8_t CDC_Enqueue_FS(const uint8_t* Buf, uint16_t Len) {
+  uint16_t headPos = txBufferHeadPos;
+  // One byte always free, so a full ring isn't taken for an empty one
+  uint16_t room = (uint16_t)((txBufferTailPos + APP_TX_DATA_SIZE - headPos - 1) % APP_TX_DATA_SIZE);
+
+  if (Len > room)
+    return USBD_BUSY;
+
+  uint16_t first = APP_TX_DATA_SIZE - headPos;
+  if (first > Len)
+    first = Len;
+  memcpy(&UserTxBufferFS[headPos], Buf, first);
+  memcpy(&UserTxBufferFS[0], Buf + first, Len - first);
+
+  txBufferHeadPos = (uint16_t)((headPos + Len) % APP_TX_DATA_SIZE);
+  return USBD_OK;
+}
+
+// Start sending the queue if it isn't going already
+void CDC_Flush_FS(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  CDC_StartTx_FS();
+  __set_PRIMASK(primask);
+}
+
+// Forget what's queued and not on its way yet
+void CDC_DropTxBuffer_FS(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  txBufferHeadPos = (uint16_t)((txBufferTailPos + txInFlight) % APP_TX_DATA_SIZE);
+  __set_PRIMASK(primask);
+}
+
 uint8_t CDC_ReadRxBuffer_FS(uint8_t* Buf, uint16_t Len) {
 	uint16_t bytesAvailable = CDC_GetRxBufferBytesAvailable_FS();
 
@@ -370,6 +493,7 @@ uint8_t CDC_ReadRxBuffer_FS(uint8_t* Buf, uint16_t Len) {
 		*/
 	}
 
+	CDC_TakeHeldRx_FS();
 	return USB_CDC_RX_BUFFER_OK;
 }
 
@@ -413,6 +537,12 @@ void CDC_FlushRxBuffer_FS() {
 
     rxBufferHeadPos = 0;
     rxBufferTailPos = 0;
+
+    // Nothing held back anymore, the endpoint takes packets again
+    if (rxHeldLen != 0) {
+      rxHeldLen = 0;
+      USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+    }
 }
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
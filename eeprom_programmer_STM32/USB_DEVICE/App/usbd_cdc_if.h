@@ -52,7 +52,7 @@
 /* Define size for the receive and transmit buffer over CDC */
 /* It's up to user to redefine and/or remove those define */
 #define APP_RX_DATA_SIZE  512
-#define APP_TX_DATA_SIZE  512
+#define APP_TX_DATA_SIZE  1024 // TX queue, a few frames
 // TODO: Are these buffers necessary? can't we use the application buffers?
 
 #define HL_RX_BUFFER_SIZE 512 // Can be larger if desired
@@ -125,6 +125,10 @@ uint8_t CDC_PeekRxBuffer_FS(uint8_t* Buf, uint16_t Len);
 uint16_t CDC_GetRxBufferBytesAvailable_FS();
 void CDC_FlushRxBuffer_FS();
 
+uint8_t CDC_Enqueue_FS(const uint8_t* Buf, uint16_t Len);
+void CDC_Flush_FS(void);
+void CDC_DropTxBuffer_FS(void);
+
 /* USER CODE END EXPORTED_FUNCTIONS */
 
 /**